@@ -23,7 +23,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-static uint8_t memory_map_from_path(const char *path, struct memory_mapping *mm)
+static uint8_t memory_map_from_path(const char *path,
+                                    size_t max_size,
+                                    struct memory_mapping *mm)
 {
 	int32_t fd = open(path, O_RDONLY);
 	if (fd < 0) {
@@ -39,8 +41,8 @@ static uint8_t memory_map_from_path(const char *path, struct memory_mapping *mm)
 
 	size_t size = stat.st_size;
 	if (exit_code == 0) {
-		/* File size is too big for a ROM file */
-		if (size > UINT16_MAX) {
+		/* File size is too big for what it holds */
+		if (size > max_size) {
 			exit_code |= EXIT_CODE_ARG_ERROR_BIT;
 		}
 	}
@@ -83,5 +85,11 @@ uint8_t init_memory_mapping_from_args(int argc, char** argv,
 		return EXIT_CODE_ARG_ERROR_BIT;
 	}
 
-	return memory_map_from_path(argv[1], mm);
+	return memory_map_from_path(argv[1], UINT16_MAX, mm);
+}
+
+uint8_t init_memory_mapping_from_path(const char *path,
+                                      struct memory_mapping *mm)
+{
+	return memory_map_from_path(path, SIZE_MAX, mm);
 }
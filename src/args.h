@@ -30,6 +30,8 @@ struct memory_mapping {
 
 uint8_t init_memory_mapping_from_args(int argc, char** argv,
                                       struct memory_mapping *mm);
+uint8_t init_memory_mapping_from_path(const char *path,
+                                      struct memory_mapping *mm);
 uint8_t fini_memory_mapping(struct memory_mapping *mm);
 
 #ifdef __cpluscplus
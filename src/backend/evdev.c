@@ -2,9 +2,19 @@
 
 #include "../exit_code.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <stdio.h>
@@ -12,128 +22,365 @@
 
 #include <libevdev/libevdev.h>
 
-struct evdev_backend {
+#define EVDEV_DEVICES_MAX 16
+#define EVDEV_CONTROLLERS 2
+
+static const char INPUT_DIRECTORY[] = "/dev/input";
+
+/* Each gamepad takes the first free controller slot */
+struct evdev_device {
 	int fd;
 	struct libevdev *dev;
+	char name[NAME_MAX + 1];
+	uint8_t controller;
+};
 
-	uint8_t controller1_state;
-	uint8_t controller1_press;
+/* Written by the input thread, read on the emulation thread's $4016
+   strobe without a syscall */
+struct evdev_controller {
+	/* Held buttons in the low byte, buttons pressed since the last read
+	   in the high byte */
+	atomic_uint_fast16_t buttons;
+	/* Of the last event that changed the buttons, on CLOCK_MONOTONIC in
+	   nanoseconds */
+	atomic_int_fast64_t timestamp;
+	bool is_connected;
 };
 
-static void handle_key(struct evdev_backend *e, uint16_t code, int32_t value)
+struct evdev_backend {
+	int epoll_fd;
+	int inotify_fd;
+	int stop_fd;
+	pthread_t thread;
+
+	struct evdev_device *devices[EVDEV_DEVICES_MAX];
+	struct evdev_controller controllers[EVDEV_CONTROLLERS];
+};
+
+static const uint8_t BUTTON_A      = 1 << 7;
+static const uint8_t BUTTON_B      = 1 << 6;
+static const uint8_t BUTTON_SELECT = 1 << 5;
+static const uint8_t BUTTON_START  = 1 << 4;
+static const uint8_t BUTTON_UP     = 1 << 3;
+static const uint8_t BUTTON_DOWN   = 1 << 2;
+static const uint8_t BUTTON_LEFT   = 1 << 1;
+static const uint8_t BUTTON_RIGHT  = 1 << 0;
+
+/* The timestamp goes first, so a reader that sees the buttons sees it */
+static void press(struct evdev_controller *controller,
+                  uint8_t buttons,
+                  int64_t timestamp)
 {
-	const uint8_t BUTTON_A      = 1 << 7;
-	const uint8_t BUTTON_B      = 1 << 6;
-	const uint8_t BUTTON_SELECT = 1 << 5;
-	const uint8_t BUTTON_START  = 1 << 4;
+	atomic_store(&controller->timestamp, timestamp);
+	atomic_fetch_or(&controller->buttons, buttons | buttons << 8);
+}
+
+static void release(struct evdev_controller *controller,
+                    uint8_t buttons,
+                    int64_t timestamp)
+{
+	atomic_store(&controller->timestamp, timestamp);
+	atomic_fetch_and(&controller->buttons, ~(uint_fast16_t) buttons);
+}
+
+static void handle_key(struct evdev_controller *controller,
+                       uint16_t code,
+                       int32_t value,
+                       int64_t timestamp)
+{
+	uint8_t button;
+	switch (code) {
+	case BTN_SELECT:
+		button = BUTTON_SELECT;
+		break;
+	case BTN_START:
+		button = BUTTON_START;
+		break;
+	case BTN_WEST:
+		button = BUTTON_B;
+		break;
+	case BTN_SOUTH:
+		button = BUTTON_A;
+		break;
+	default:
+		return;
+	}
 
 	switch (value) {
 	case 0:
-		switch (code) {
-		case BTN_SELECT:
-			e->controller1_press &= ~(BUTTON_SELECT);
-			break;
-		case BTN_START:
-			e->controller1_press &= ~(BUTTON_START);
-			break;
-		case BTN_WEST:
-			e->controller1_press &= ~(BUTTON_B);
-			break;
-		case BTN_SOUTH:
-			e->controller1_press &= ~(BUTTON_A);
-			break;
-		}
+		release(controller, button, timestamp);
 		break;
 	case 1:
-		switch (code) {
-		case BTN_SELECT:
-			e->controller1_press |= BUTTON_SELECT;
-			e->controller1_state |= BUTTON_SELECT;
-			break;
-		case BTN_START:
-			e->controller1_press |= BUTTON_START;
-			e->controller1_state |= BUTTON_START;
-			break;
-		case BTN_WEST:
-			e->controller1_press |= BUTTON_B;
-			e->controller1_state |= BUTTON_B;
-			break;
-		case BTN_SOUTH:
-			e->controller1_press |= BUTTON_A;
-			e->controller1_state |= BUTTON_A;
-			break;
-		}
+		press(controller, button, timestamp);
 		break;
 	}
 }
 
-static void handle_abs_y(struct evdev_backend *e, int32_t value)
+/* The hat is -1, 0 or 1 on each axis */
+static void handle_hat(struct evdev_controller *controller,
+                       uint8_t negative,
+                       uint8_t positive,
+                       int32_t value,
+                       int64_t timestamp)
 {
-	const uint8_t BUTTON_UP     = 1 << 3;
-	const uint8_t BUTTON_DOWN   = 1 << 2;
-
 	switch (value) {
 	case -1:
-		e->controller1_press |= BUTTON_UP;
-		e->controller1_state |= BUTTON_UP;
+		release(controller, positive, timestamp);
+		press(controller, negative, timestamp);
 		break;
 	case 1:
-		e->controller1_press |= BUTTON_DOWN;
-		e->controller1_state |= BUTTON_DOWN;
+		release(controller, negative, timestamp);
+		press(controller, positive, timestamp);
 		break;
 	case 0:
-		e->controller1_press &= ~(BUTTON_UP);
-		e->controller1_press &= ~(BUTTON_DOWN);
+		release(controller, negative | positive, timestamp);
 		break;
 	}
 }
 
-static void handle_abs_x(struct evdev_backend *e, int32_t value)
+static void handle_event(struct evdev_controller *controller,
+                         const struct input_event *ev)
 {
-	const uint8_t BUTTON_LEFT   = 1 << 1;
-	const uint8_t BUTTON_RIGHT  = 1 << 0;
+	int64_t timestamp = (int64_t) ev->input_event_sec * 1000000000
+	                    + ev->input_event_usec * 1000;
+	if (ev->type == EV_KEY) {
+		handle_key(controller, ev->code, ev->value, timestamp);
+	}
+	else if (ev->type == EV_ABS && ev->code == ABS_HAT0Y) {
+		handle_hat(controller, BUTTON_UP, BUTTON_DOWN,
+		           ev->value, timestamp);
+	}
+	else if (ev->type == EV_ABS && ev->code == ABS_HAT0X) {
+		handle_hat(controller, BUTTON_LEFT, BUTTON_RIGHT,
+		           ev->value, timestamp);
+	}
+}
 
-	switch (value) {
-	case -1:
-		e->controller1_press |= BUTTON_LEFT;
-		e->controller1_state |= BUTTON_LEFT;
-		break;
-	case 1:
-		e->controller1_press |= BUTTON_RIGHT;
-		e->controller1_state |= BUTTON_RIGHT;
-		break;
-	case 0:
-		e->controller1_press &= ~(BUTTON_LEFT);
-		e->controller1_press &= ~(BUTTON_RIGHT);
-		break;
+static bool is_event_device(const char *name)
+{
+	return strncmp(name, "event", 5) == 0;
+}
+
+/* Opens name under the input directory if it is a gamepad and there is a
+   free slot, anything else is skipped */
+static void add_device(struct evdev_backend *e, const char *name)
+{
+	size_t index = EVDEV_DEVICES_MAX;
+	for (size_t i = 0; i < EVDEV_DEVICES_MAX; ++i) {
+		if (e->devices[i] != NULL
+		    && strcmp(e->devices[i]->name, name) == 0) {
+			return;
+		}
+		if (e->devices[i] == NULL && index == EVDEV_DEVICES_MAX) {
+			index = i;
+		}
 	}
+	uint8_t controller = EVDEV_CONTROLLERS;
+	for (uint8_t i = 0; i < EVDEV_CONTROLLERS; ++i) {
+		if (!e->controllers[i].is_connected) {
+			controller = i;
+			break;
+		}
+	}
+	if (index == EVDEV_DEVICES_MAX || controller == EVDEV_CONTROLLERS) {
+		return;
+	}
+
+	char path[sizeof(INPUT_DIRECTORY) + NAME_MAX + 1];
+	snprintf(path, sizeof(path), "%s/%s", INPUT_DIRECTORY, name);
+	/* Permissions are often set just after the node appears, a later
+	   IN_ATTRIB retries */
+	int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	struct libevdev *dev;
+	if (libevdev_new_from_fd(fd, &dev) < 0) {
+		close(fd);
+		return;
+	}
+	if (!libevdev_has_event_code(dev, EV_KEY, BTN_SOUTH)) {
+		libevdev_free(dev);
+		close(fd);
+		return;
+	}
+	libevdev_set_clock_id(dev, CLOCK_MONOTONIC);
+
+	struct evdev_device *device = malloc(sizeof(struct evdev_device));
+	if (device == NULL) {
+		libevdev_free(dev);
+		close(fd);
+		return;
+	}
+	device->fd = fd;
+	device->dev = dev;
+	strncpy(device->name, name, NAME_MAX);
+	device->name[NAME_MAX] = '\0';
+	device->controller = controller;
+
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = device,
+	};
+	if (epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		free(device);
+		libevdev_free(dev);
+		close(fd);
+		return;
+	}
+
+	e->devices[index] = device;
+	e->controllers[controller].is_connected = true;
+	printf("Evdev: %s (%s) is controller %u\n",
+	       libevdev_get_name(dev), path, controller + 1);
 }
 
-static uint8_t controller1_read(void *pointer)
+static void remove_device(struct evdev_backend *e, size_t index)
 {
-	struct evdev_backend *e = pointer;
+	struct evdev_device *device = e->devices[index];
+	struct evdev_controller *controller =
+		&e->controllers[device->controller];
+	epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+	printf("Evdev: controller %u disconnected\n", device->controller + 1);
 
-	int rc;
-	do {
+	/* Nothing stays held */
+	atomic_store(&controller->buttons, 0);
+	controller->is_connected = false;
+	libevdev_free(device->dev);
+	close(device->fd);
+	free(device);
+	e->devices[index] = NULL;
+}
+
+static void remove_device_pointer(struct evdev_backend *e,
+                                  struct evdev_device *device)
+{
+	for (size_t i = 0; i < EVDEV_DEVICES_MAX; ++i) {
+		if (e->devices[i] == device) {
+			remove_device(e, i);
+			return;
+		}
+	}
+}
+
+/* Drains a device, resynchronising if the kernel dropped events. Returns
+   false once the device is gone. */
+static bool read_device(struct evdev_backend *e, struct evdev_device *device)
+{
+	struct evdev_controller *controller =
+		&e->controllers[device->controller];
+	unsigned int flags = LIBEVDEV_READ_FLAG_NORMAL;
+	for (;;) {
 		struct input_event ev;
-		rc = libevdev_next_event(e->dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+		int rc = libevdev_next_event(device->dev, flags, &ev);
 		if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-			if (ev.type == EV_KEY) {
-				handle_key(e, ev.code, ev.value);
+			handle_event(controller, &ev);
+		}
+		else if (rc == LIBEVDEV_READ_STATUS_SYNC) {
+			handle_event(controller, &ev);
+			flags = LIBEVDEV_READ_FLAG_SYNC;
+		}
+		else if (rc == -EAGAIN && flags == LIBEVDEV_READ_FLAG_SYNC) {
+			flags = LIBEVDEV_READ_FLAG_NORMAL;
+		}
+		else if (rc == -EAGAIN) {
+			return true;
+		}
+		else {
+			return false;
+		}
+	}
+}
+
+static void read_inotify(struct evdev_backend *e)
+{
+	char buffer[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t size;
+	while ((size = read(e->inotify_fd, buffer, sizeof(buffer))) > 0) {
+		for (char *p = buffer; p < buffer + size;) {
+			const struct inotify_event *event =
+				(const struct inotify_event *) p;
+			p += sizeof(struct inotify_event) + event->len;
+			if (event->len != 0 && is_event_device(event->name)) {
+				add_device(e, event->name);
+			}
+		}
+	}
+}
+
+static void *thread_main(void *pointer)
+{
+	struct evdev_backend *e = pointer;
+	for (;;) {
+		struct epoll_event events[8];
+		int count = epoll_wait(e->epoll_fd, events, 8, -1);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count < 0) {
+			return NULL;
+		}
+		for (int i = 0; i < count; ++i) {
+			void *source = events[i].data.ptr;
+			if (source == &e->stop_fd) {
+				return NULL;
 			}
-			else if (ev.type == EV_ABS && ev.code == ABS_HAT0Y) {
-				handle_abs_y(e, ev.value);
+			else if (source == &e->inotify_fd) {
+				read_inotify(e);
 			}
-			else if (ev.type == EV_ABS && ev.code == ABS_HAT0X) {
-				handle_abs_x(e, ev.value);
+			else if ((events[i].events & (EPOLLHUP | EPOLLERR))
+			         || !read_device(e, source)) {
+				remove_device_pointer(e, source);
 			}
 		}
-	} while (rc != -EAGAIN);
+	}
+}
 
-	uint8_t state = e->controller1_state;
-	e->controller1_state = e->controller1_press;
+static uint8_t controller1_read(void *pointer)
+{
+	struct evdev_backend *e = pointer;
+	struct evdev_controller *controller = &e->controllers[0];
 
-	return state;
+	/* Latches the held buttons for the next read */
+	uint_fast16_t buttons = atomic_load(&controller->buttons);
+	uint_fast16_t held;
+	do {
+		held = buttons & 0xFF;
+	} while (!atomic_compare_exchange_weak(&controller->buttons, &buttons,
+	                                       held | held << 8));
+
+	return buttons >> 8;
+}
+
+static int64_t controller1_timestamp(void *pointer)
+{
+	struct evdev_backend *e = pointer;
+	return atomic_load(&e->controllers[0].timestamp);
+}
+
+static void close_devices(struct evdev_backend *e)
+{
+	for (size_t i = 0; i < EVDEV_DEVICES_MAX; ++i) {
+		if (e->devices[i] != NULL) {
+			libevdev_free(e->devices[i]->dev);
+			close(e->devices[i]->fd);
+			free(e->devices[i]);
+		}
+	}
+}
+
+static uint8_t watch(int epoll_fd, int fd, void *pointer)
+{
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = pointer,
+	};
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	return 0;
 }
 
 uint8_t nes_emulator_backend_evdev_init(
@@ -152,29 +399,74 @@ uint8_t nes_emulator_backend_evdev_init(
 
 	struct evdev_backend *e = malloc(sizeof(struct evdev_backend));
 	if (e == NULL) {
-		free(e);
+		free(b);
 		return EXIT_CODE_OS_ERROR_BIT;
 	}
-	e->controller1_state = 0;
-	e->controller1_press = 0;
+	for (size_t i = 0; i < EVDEV_DEVICES_MAX; ++i) {
+		e->devices[i] = NULL;
+	}
+	for (size_t i = 0; i < EVDEV_CONTROLLERS; ++i) {
+		atomic_init(&e->controllers[i].buttons, 0);
+		atomic_init(&e->controllers[i].timestamp, 0);
+		e->controllers[i].is_connected = false;
+	}
 
-	int fd = open("/dev/input/event23", O_RDONLY | O_NONBLOCK);
-	if (fd < 0) {
-		free(e);
-		free(b);
-		return EXIT_CODE_OS_ERROR_BIT;
+	e->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	e->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	e->stop_fd = eventfd(0, EFD_CLOEXEC);
+	uint8_t exit_code = 0;
+	if (e->epoll_fd < 0 || e->inotify_fd < 0 || e->stop_fd < 0) {
+		exit_code = EXIT_CODE_OS_ERROR_BIT;
+	}
+	/* Watched before the scan so a device plugged in during it is not
+	   missed. Unplugged devices hang up their own descriptor. */
+	if (exit_code == 0
+	    && inotify_add_watch(e->inotify_fd, INPUT_DIRECTORY,
+	                         IN_CREATE | IN_ATTRIB) < 0) {
+		exit_code = EXIT_CODE_OS_ERROR_BIT;
+	}
+	if (exit_code == 0) {
+		exit_code |= watch(e->epoll_fd, e->inotify_fd, &e->inotify_fd);
+		exit_code |= watch(e->epoll_fd, e->stop_fd, &e->stop_fd);
 	}
 
-	int rc = libevdev_new_from_fd(fd, &e->dev);
-	if (rc < 0) {
-		close(fd);
+	if (exit_code == 0) {
+		DIR *directory = opendir(INPUT_DIRECTORY);
+		if (directory != NULL) {
+			struct dirent *entry;
+			while ((entry = readdir(directory)) != NULL) {
+				if (is_event_device(entry->d_name)) {
+					add_device(e, entry->d_name);
+				}
+			}
+			closedir(directory);
+		}
+	}
+
+	if (exit_code == 0
+	    && pthread_create(&e->thread, NULL, thread_main, e) != 0) {
+		exit_code = EXIT_CODE_OS_ERROR_BIT;
+	}
+
+	if (exit_code != 0) {
+		close_devices(e);
+		if (e->stop_fd >= 0) {
+			close(e->stop_fd);
+		}
+		if (e->inotify_fd >= 0) {
+			close(e->inotify_fd);
+		}
+		if (e->epoll_fd >= 0) {
+			close(e->epoll_fd);
+		}
 		free(e);
 		free(b);
-		return EXIT_CODE_EVDEV_ERROR_BIT;
+		return exit_code;
 	}
 
 	b->pointer = e;
 	b->controller1_read = controller1_read;
+	b->controller1_timestamp = controller1_timestamp;
 	*controller_backend = b;
 	return 0;
 }
@@ -186,12 +478,21 @@ uint8_t nes_emulator_backend_evdev_fini(
 		return 0;
 	}
 
+	uint8_t exit_code = 0;
 	struct evdev_backend *e = (struct evdev_backend *)
 	                          (*controller_backend)->pointer;
-	libevdev_free(e->dev);
-	close(e->fd);
+	uint64_t stop = 1;
+	if (write(e->stop_fd, &stop, sizeof(stop)) < 0) {
+		exit_code |= EXIT_CODE_OS_ERROR_BIT;
+	}
+	pthread_join(e->thread, NULL);
+
+	close_devices(e);
+	close(e->stop_fd);
+	close(e->inotify_fd);
+	close(e->epoll_fd);
 	free(e);
 	free(*controller_backend);
 	*controller_backend = NULL;
-	return 0;
+	return exit_code;
 }
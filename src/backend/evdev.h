@@ -24,6 +24,8 @@
 extern "C" {
 #endif
 
+/* Gamepads under /dev/input, including ones plugged in later, are read
+   on a thread of their own. The first connected one is controller 1. */
 uint8_t nes_emulator_backend_evdev_init(
 	struct nes_emulator_controller_backend **controller_backend);
 uint8_t nes_emulator_backend_evdev_fini(
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "headless.h"
+
+#include "../exit_code.h"
+#include "pacing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct headless {
+	bool is_throttled;
+	struct pacing pacing;
+	int64_t start;
+
+	uint64_t frames;
+	uint64_t cpu_instructions;
+	uint64_t emulation_nsec;
+	uint64_t cpu_nsec;
+	uint64_t ppu_nsec;
+	uint64_t render_nsec;
+};
+
+static void frame_stats(void *pointer,
+                        const struct nes_emulator_frame_stats *stats)
+{
+	struct headless *headless = pointer;
+	++headless->frames;
+	headless->cpu_instructions += stats->cpu_instructions;
+	headless->emulation_nsec += stats->emulation_nsec;
+	headless->cpu_nsec += stats->cpu_nsec;
+	headless->ppu_nsec += stats->ppu_nsec;
+	headless->render_nsec += stats->render_nsec;
+}
+
+static void vertical_blank(void *pointer)
+{
+	struct headless *headless = pointer;
+	if (headless->is_throttled) {
+		pacing_wait(&headless->pacing);
+	}
+}
+
+static uint8_t joypad1_read(void *pointer)
+{
+	(void) pointer;
+	return 0;
+}
+
+uint8_t nes_emulator_ppu_backend_headless_init(
+	struct nes_emulator_ppu_backend **ppu_backend,
+	bool is_throttled)
+{
+	if (ppu_backend == NULL) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+	*ppu_backend = NULL;
+
+	struct nes_emulator_ppu_backend *b =
+		malloc(sizeof(struct nes_emulator_ppu_backend));
+	if (b == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+
+	struct headless *h = malloc(sizeof(struct headless));
+	if (h == NULL) {
+		free(b);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	h->is_throttled = is_throttled;
+	pacing_init(&h->pacing, PACING_MODE_DEADLINE, false);
+	h->start = pacing_now(&h->pacing);
+	h->frames = 0;
+	h->cpu_instructions = 0;
+	h->emulation_nsec = 0;
+	h->cpu_nsec = 0;
+	h->ppu_nsec = 0;
+	h->render_nsec = 0;
+
+	b->pointer = h;
+	b->render_pixel = NULL;
+	b->vertical_blank = vertical_blank;
+	b->joypad1_read = joypad1_read;
+	b->joypad1_timestamp = NULL;
+	b->scanline_ready = NULL;
+	b->frame_ready = NULL;
+	b->frame_stats = frame_stats;
+	b->is_occluded = NULL;
+	b->is_rewinding = NULL;
+	b->is_profiling = NULL;
+	*ppu_backend = b;
+	return 0;
+}
+
+uint8_t nes_emulator_ppu_backend_headless_fini(
+	struct nes_emulator_ppu_backend **ppu_backend)
+{
+	free((*ppu_backend)->pointer);
+	free(*ppu_backend);
+	*ppu_backend = NULL;
+	return 0;
+}
+
+void nes_emulator_ppu_backend_headless_report(
+	struct nes_emulator_ppu_backend *ppu_backend)
+{
+	struct headless *headless = ppu_backend->pointer;
+	double seconds = (pacing_now(&headless->pacing) - headless->start)
+	                 / 1e9;
+	uint64_t frames = headless->frames;
+	if (frames == 0 || seconds <= 0.0) {
+		printf("Report: no frames\n");
+		return;
+	}
+
+	printf("Report: %llu frames in %.3f s\n",
+	       (unsigned long long) frames, seconds);
+	printf("  %.1f frames/s\n", frames / seconds);
+	printf("  %.0f instructions/s\n",
+	       headless->cpu_instructions / seconds);
+	printf("  %llu ns/frame emulation\n",
+	       (unsigned long long) (headless->emulation_nsec / frames));
+	printf("  %llu ns/frame CPU, %llu ns/frame PPU (sampled)\n",
+	       (unsigned long long) (headless->cpu_nsec / frames),
+	       (unsigned long long) (headless->ppu_nsec / frames));
+	if (headless->render_nsec != 0) {
+		printf("  %llu ns/frame render thread\n",
+		       (unsigned long long) (headless->render_nsec / frames));
+	}
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "../ppu.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Takes frames without showing them, at the NES frame rate unless
+   unthrottled, and keeps totals of their stats */
+uint8_t nes_emulator_ppu_backend_headless_init(
+	struct nes_emulator_ppu_backend **ppu_backend,
+	bool is_throttled);
+uint8_t nes_emulator_ppu_backend_headless_fini(
+	struct nes_emulator_ppu_backend **ppu_backend);
+
+/* Prints the totals since init */
+void nes_emulator_ppu_backend_headless_report(
+	struct nes_emulator_ppu_backend *ppu_backend);
+
+#ifdef __cplusplus
+}
+#endif
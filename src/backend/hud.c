@@ -0,0 +1,309 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hud.h"
+
+#include "../exit_code.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cairo/cairo.h>
+
+#define HUD_GLYPH_FIRST ' '
+#define HUD_GLYPHS ('~' - ' ' + 1)
+#define HUD_COLUMNS 26
+#define HUD_ROWS 5
+
+/* In NES pixels */
+static const int32_t FONT_SIZE = 8;
+static const int32_t MARGIN = 2;
+static const int32_t HISTOGRAM_HEIGHT = 16;
+static const int32_t BAR_WIDTH = 6;
+
+/* Each bucket is 2 ms wide, the last also takes anything longer */
+static const int64_t BUCKET_NSEC = 2000000;
+/* Bars past a 60 Hz frame and some jitter are drawn red */
+static const uint32_t LATE_BUCKET = 9;
+
+static const uint32_t BAR_COLOUR = 0xFF4CD020;
+static const uint32_t LATE_BAR_COLOUR = 0xFFEC6A64;
+
+void hud_init(struct hud *hud)
+{
+	hud->scale = 0;
+	hud->glyph_width = 0;
+	hud->glyph_height = 0;
+	hud->glyphs = NULL;
+	hud->lines = 0;
+	hud->history_next = 0;
+	hud->history_size = 0;
+}
+
+void hud_fini(struct hud *hud)
+{
+	free(hud->glyphs);
+	hud->glyphs = NULL;
+	hud->scale = 0;
+}
+
+void hud_record(struct hud *hud, int64_t interval)
+{
+	hud->history[hud->history_next] = interval;
+	hud->history_next = (hud->history_next + 1) % HUD_HISTORY;
+	if (hud->history_size < HUD_HISTORY) {
+		++hud->history_size;
+	}
+}
+
+static void select_font(cairo_t *cairo, uint8_t scale)
+{
+	cairo_select_font_face(cairo, "Cousine",
+		CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+	cairo_set_font_size(cairo, FONT_SIZE * scale);
+}
+
+/* The only cairo work, done once per scale */
+static uint8_t rasterise(struct hud *hud, uint8_t scale)
+{
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+	cairo_t *cairo = cairo_create(surface);
+	select_font(cairo, scale);
+	cairo_font_extents_t extents;
+	cairo_font_extents(cairo, &extents);
+	cairo_destroy(cairo);
+	cairo_surface_destroy(surface);
+
+	int32_t glyph_width = ceil(extents.max_x_advance);
+	int32_t glyph_height = ceil(extents.ascent + extents.descent);
+	if (glyph_width <= 0 || glyph_height <= 0) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+
+	surface = cairo_image_surface_create(CAIRO_FORMAT_A8,
+	                                     glyph_width * HUD_GLYPHS,
+	                                     glyph_height);
+	if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surface);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	cairo = cairo_create(surface);
+	select_font(cairo, scale);
+	cairo_set_source_rgba(cairo, 1, 1, 1, 1);
+	for (int32_t i = 0; i < HUD_GLYPHS; ++i) {
+		char text[2] = {HUD_GLYPH_FIRST + i, '\0'};
+		cairo_move_to(cairo, i * glyph_width, extents.ascent);
+		cairo_show_text(cairo, text);
+	}
+	cairo_destroy(cairo);
+	cairo_surface_flush(surface);
+
+	uint8_t *glyphs = malloc(HUD_GLYPHS * glyph_width * glyph_height);
+	if (glyphs == NULL) {
+		cairo_surface_destroy(surface);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	/* Each glyph's cell is stored contiguously */
+	const uint8_t *data = cairo_image_surface_get_data(surface);
+	int32_t stride = cairo_image_surface_get_stride(surface);
+	for (int32_t i = 0; i < HUD_GLYPHS; ++i) {
+		for (int32_t y = 0; y < glyph_height; ++y) {
+			memcpy(glyphs + (i * glyph_height + y) * glyph_width,
+			       data + y * stride + i * glyph_width,
+			       glyph_width);
+		}
+	}
+	cairo_surface_destroy(surface);
+
+	free(hud->glyphs);
+	hud->glyphs = glyphs;
+	hud->glyph_width = glyph_width;
+	hud->glyph_height = glyph_height;
+	hud->scale = scale;
+	return 0;
+}
+
+/* Halves each channel */
+static void darken(uint32_t *data,
+                   int32_t stride,
+                   int32_t width,
+                   int32_t height)
+{
+	for (int32_t y = 0; y < height; ++y) {
+		uint32_t *row = data + y * stride;
+		for (int32_t x = 0; x < width; ++x) {
+			row[x] = ((row[x] >> 1) & 0x007F7F7F) | 0xFF000000;
+		}
+	}
+}
+
+/* White text at 80% opacity, blended per channel by each glyph's
+   coverage */
+static void blit_text(const struct hud *hud,
+                      uint32_t *data,
+                      int32_t stride,
+                      const char *text)
+{
+	for (int32_t i = 0; text[i] != '\0' && i < HUD_COLUMNS; ++i) {
+		int32_t c = (uint8_t) text[i] - HUD_GLYPH_FIRST;
+		if (c <= 0 || c >= HUD_GLYPHS) {
+			continue;
+		}
+		const uint8_t *glyph = hud->glyphs
+		                       + c * hud->glyph_height * hud->glyph_width;
+		uint32_t *cell = data + i * hud->glyph_width;
+		for (int32_t y = 0; y < hud->glyph_height; ++y) {
+			for (int32_t x = 0; x < hud->glyph_width; ++x) {
+				uint32_t alpha = glyph[y * hud->glyph_width + x]
+				                 * 204 / 255;
+				if (alpha == 0) {
+					continue;
+				}
+				uint32_t pixel = cell[y * stride + x];
+				uint32_t blended = 0xFF000000;
+				for (int32_t shift = 0; shift < 24; shift += 8) {
+					uint32_t channel = (pixel >> shift) & 0xFF;
+					channel += (0xFF - channel) * alpha / 255;
+					blended |= channel << shift;
+				}
+				cell[y * stride + x] = blended;
+			}
+		}
+	}
+}
+
+static void fill(uint32_t *data,
+                 int32_t stride,
+                 int32_t width,
+                 int32_t height,
+                 uint32_t colour)
+{
+	for (int32_t y = 0; y < height; ++y) {
+		for (int32_t x = 0; x < width; ++x) {
+			data[y * stride + x] = colour;
+		}
+	}
+}
+
+static void draw_histogram(const struct hud *hud,
+                           uint32_t *data,
+                           int32_t stride,
+                           uint8_t scale)
+{
+	uint32_t buckets[HUD_HISTOGRAM_BUCKETS] = {0};
+	uint32_t tallest = 1;
+	for (uint32_t i = 0; i < hud->history_size; ++i) {
+		int64_t bucket = hud->history[i] / BUCKET_NSEC;
+		if (bucket >= HUD_HISTOGRAM_BUCKETS) {
+			bucket = HUD_HISTOGRAM_BUCKETS - 1;
+		}
+		++buckets[bucket];
+		if (buckets[bucket] > tallest) {
+			tallest = buckets[bucket];
+		}
+	}
+
+	int32_t height = HISTOGRAM_HEIGHT * scale;
+	for (uint32_t i = 0; i < HUD_HISTOGRAM_BUCKETS; ++i) {
+		if (buckets[i] == 0) {
+			continue;
+		}
+		/* Any bucket in use shows at least a line */
+		int32_t bar_height = buckets[i] * height / tallest;
+		if (bar_height < scale) {
+			bar_height = scale;
+		}
+		fill(data + (height - bar_height) * stride
+		     + i * BAR_WIDTH * scale,
+		     stride, (BAR_WIDTH - 1) * scale, bar_height,
+		     i < LATE_BUCKET ? BAR_COLOUR : LATE_BAR_COLOUR);
+	}
+}
+
+static double msec(int64_t nsec)
+{
+	return nsec / 1e6;
+}
+
+uint8_t hud_draw(struct hud *hud,
+                 uint32_t *data,
+                 int32_t stride,
+                 uint8_t scale,
+                 const struct hud_stats *stats)
+{
+	if (hud->scale != scale) {
+		uint8_t exit_code = rasterise(hud, scale);
+		if (exit_code != 0) {
+			return exit_code;
+		}
+	}
+
+	int32_t margin = MARGIN * scale;
+	int32_t width = 2 * margin + HUD_COLUMNS * hud->glyph_width;
+	int32_t histogram_top = 2 * margin + HUD_ROWS * hud->glyph_height;
+	int32_t height = histogram_top + HISTOGRAM_HEIGHT * scale + margin;
+	if (width > stride) {
+		width = stride;
+	}
+	if (height > 240 * scale) {
+		height = 240 * scale;
+	}
+	hud->lines = (height + scale - 1) / scale;
+	darken(data, stride, width, height);
+
+	char rows[HUD_ROWS][HUD_COLUMNS + 1];
+	double fps = 0.0;
+	if (stats->interval != 0) {
+		fps = 1000000000.0 / stats->interval;
+	}
+	snprintf(rows[0], sizeof(rows[0]), "FPS %5.1f  %6.2f ms",
+	         fps, msec(stats->interval));
+	snprintf(rows[1], sizeof(rows[1]), "EMU %6.2f ms %7lu ins",
+	         msec(stats->frame.emulation_nsec),
+	         (unsigned long) stats->frame.cpu_instructions);
+	/* Without a render thread the PPU runs inside the emulation time, which
+	   is sampled while the HUD is visible */
+	uint64_t ppu_nsec = stats->frame.render_nsec;
+	if (ppu_nsec == 0) {
+		ppu_nsec = stats->frame.ppu_nsec;
+	}
+	snprintf(rows[2], sizeof(rows[2]), "PPU %6.2f  PRESENT %6.2f",
+	         msec(ppu_nsec), msec(stats->present_nsec));
+	snprintf(rows[3], sizeof(rows[3]), "DROP %-7llu DUP %-7llu",
+	         (unsigned long long) stats->dropped,
+	         (unsigned long long) stats->duplicated);
+	if (stats->has_latency) {
+		snprintf(rows[4], sizeof(rows[4]), "LAT %5.1f %5.1f %5.1f ms",
+		         msec(stats->latency_p50), msec(stats->latency_p90),
+		         msec(stats->latency_p99));
+	}
+	else {
+		snprintf(rows[4], sizeof(rows[4]), "LAT -");
+	}
+	for (int32_t i = 0; i < HUD_ROWS; ++i) {
+		blit_text(hud, data + (margin + i * hud->glyph_height) * stride
+		          + margin, stride, rows[i]);
+	}
+
+	if (histogram_top + HISTOGRAM_HEIGHT * scale <= height) {
+		draw_histogram(hud, data + histogram_top * stride + margin,
+		               stride, scale);
+	}
+	return 0;
+}
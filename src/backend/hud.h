@@ -0,0 +1,77 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../ppu.h"
+
+#define HUD_HISTORY 128
+#define HUD_HISTOGRAM_BUCKETS 16
+
+struct hud_stats {
+	struct nes_emulator_frame_stats frame;
+	/* Between the last two frames shown */
+	int64_t interval;
+	/* From the frame reaching the backend to its commit */
+	int64_t present_nsec;
+	uint64_t dropped;
+	uint64_t duplicated;
+	/* Input to presentation percentiles, if there was any input */
+	bool has_latency;
+	int64_t latency_p50;
+	int64_t latency_p90;
+	int64_t latency_p99;
+};
+
+struct hud {
+	/* Printable ASCII rasterised once per scale as 8-bit coverage, one
+	   glyph_width by glyph_height cell per character */
+	uint8_t scale;
+	int32_t glyph_width;
+	int32_t glyph_height;
+	uint8_t *glyphs;
+	/* NES lines the panel covers from the top, at the current scale */
+	int32_t lines;
+
+	/* The last frame intervals, for the histogram */
+	int64_t history[HUD_HISTORY];
+	uint32_t history_next;
+	uint32_t history_size;
+};
+
+void hud_init(struct hud *hud);
+void hud_fini(struct hud *hud);
+void hud_record(struct hud *hud, int64_t interval);
+
+/* Draws the panel over the top left of a buffer stride pixels wide, each
+   NES pixel scale buffer pixels wide, rasterising the glyphs first if the
+   scale changed */
+uint8_t hud_draw(struct hud *hud,
+                 uint32_t *data,
+                 int32_t stride,
+                 uint8_t scale,
+                 const struct hud_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
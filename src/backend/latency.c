@@ -0,0 +1,166 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "latency.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int64_t latency_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void latency_init(struct latency *latency, FILE *log)
+{
+	latency->log = log;
+	latency->is_pending = false;
+	latency->presenting_size = 0;
+	latency->commits = 0;
+	latency->feedbacks = 0;
+	latency->history_next = 0;
+	latency->history_size = 0;
+	latency->events = 0;
+	if (log != NULL) {
+		fprintf(log, "# frame input_ns commit_ms present_ms\n");
+	}
+}
+
+void latency_fini(struct latency *latency)
+{
+	int64_t p50, p90, p99;
+	if (latency_percentiles(latency, &p50, &p90, &p99)) {
+		printf("Latency: %llu inputs, last %u at %.1f/%.1f/%.1f ms "
+		       "50th/90th/99th percentile\n",
+		       (unsigned long long) latency->events,
+		       latency->history_size, p50 / 1e6, p90 / 1e6, p99 / 1e6);
+	}
+}
+
+/* present_nsec is 0 without feedback */
+static void finish(struct latency *latency,
+                   const struct latency_event *event,
+                   int64_t present_nsec)
+{
+	int64_t commit = event->commit_nsec - event->input_nsec;
+	int64_t end = present_nsec != 0 ? present_nsec : event->commit_nsec;
+	if (latency->log != NULL) {
+		fprintf(latency->log, "%llu %lld %.3f ",
+		        (unsigned long long) event->frame,
+		        (long long) event->input_nsec, commit / 1e6);
+		if (present_nsec != 0) {
+			fprintf(latency->log, "%.3f\n",
+			        (present_nsec - event->input_nsec) / 1e6);
+		}
+		else {
+			fprintf(latency->log, "-\n");
+		}
+	}
+
+	latency->history[latency->history_next] = end - event->input_nsec;
+	latency->history_next = (latency->history_next + 1) % LATENCY_HISTORY;
+	if (latency->history_size < LATENCY_HISTORY) {
+		++latency->history_size;
+	}
+	++latency->events;
+}
+
+void latency_frame(struct latency *latency,
+                   uint64_t frame,
+                   int64_t input_nsec)
+{
+	if (input_nsec == 0 || latency->is_pending) {
+		return;
+	}
+	latency->pending.input_nsec = input_nsec;
+	latency->pending.frame = frame;
+	latency->is_pending = true;
+}
+
+/* A dropped frame leaves the input pending, the next commit shows its
+   result too */
+void latency_commit(struct latency *latency, bool is_presenting)
+{
+	++latency->commits;
+	if (!latency->is_pending) {
+		return;
+	}
+	latency->is_pending = false;
+
+	struct latency_event *event = &latency->pending;
+	event->commit_nsec = latency_now();
+	event->commit = latency->commits;
+	if (is_presenting
+	    && latency->presenting_size < LATENCY_PRESENTING_MAX) {
+		latency->presenting[latency->presenting_size++] = *event;
+	}
+	else {
+		finish(latency, event, 0);
+	}
+}
+
+static void feedback(struct latency *latency, int64_t timestamp)
+{
+	++latency->feedbacks;
+	while (latency->presenting_size > 0
+	       && latency->presenting[0].commit <= latency->feedbacks) {
+		struct latency_event event = latency->presenting[0];
+		--latency->presenting_size;
+		memmove(&latency->presenting[0], &latency->presenting[1],
+		        latency->presenting_size
+		        * sizeof(struct latency_event));
+		bool is_this = event.commit == latency->feedbacks;
+		finish(latency, &event, is_this ? timestamp : 0);
+	}
+}
+
+void latency_presented(struct latency *latency, int64_t timestamp)
+{
+	feedback(latency, timestamp);
+}
+
+void latency_discarded(struct latency *latency)
+{
+	feedback(latency, 0);
+}
+
+static int compare(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+	return (x > y) - (x < y);
+}
+
+bool latency_percentiles(const struct latency *latency,
+                         int64_t *p50,
+                         int64_t *p90,
+                         int64_t *p99)
+{
+	uint32_t size = latency->history_size;
+	if (size == 0) {
+		return false;
+	}
+	int64_t sorted[LATENCY_HISTORY];
+	memcpy(sorted, latency->history, size * sizeof(int64_t));
+	qsort(sorted, size, sizeof(int64_t), compare);
+	*p50 = sorted[(size - 1) * 50 / 100];
+	*p90 = sorted[(size - 1) * 90 / 100];
+	*p99 = sorted[(size - 1) * 99 / 100];
+	return true;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define LATENCY_HISTORY 128
+#define LATENCY_PRESENTING_MAX 8
+
+/* Times are on CLOCK_MONOTONIC in nanoseconds */
+struct latency_event {
+	int64_t input_nsec;
+	/* The frame the game read the input in */
+	uint64_t frame;
+	int64_t commit_nsec;
+	uint64_t commit;
+};
+
+/* Follows input the game read to the commit of that frame, then to its
+   presentation when there is feedback */
+struct latency {
+	FILE *log;
+
+	/* Waiting for its frame to be committed, only the first input is
+	   followed until then */
+	struct latency_event pending;
+	bool is_pending;
+	/* Committed and waiting for presentation feedback, which arrives in
+	   commit order */
+	struct latency_event presenting[LATENCY_PRESENTING_MAX];
+	uint32_t presenting_size;
+	uint64_t commits;
+	uint64_t feedbacks;
+
+	/* Input to presentation, or to commit without feedback */
+	int64_t history[LATENCY_HISTORY];
+	uint32_t history_next;
+	uint32_t history_size;
+	uint64_t events;
+};
+
+/* log may be NULL, it is not closed by fini */
+void latency_init(struct latency *latency, FILE *log);
+void latency_fini(struct latency *latency);
+
+void latency_frame(struct latency *latency,
+                   uint64_t frame,
+                   int64_t input_nsec);
+void latency_commit(struct latency *latency, bool is_presenting);
+void latency_presented(struct latency *latency, int64_t timestamp);
+void latency_discarded(struct latency *latency);
+
+/* False without any events yet */
+bool latency_percentiles(const struct latency *latency,
+                         int64_t *p50,
+                         int64_t *p90,
+                         int64_t *p99);
+
+int64_t latency_now(void);
+
+#ifdef __cplusplus
+}
+#endif
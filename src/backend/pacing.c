@@ -0,0 +1,176 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pacing.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+
+static const int64_t NSEC_PER_SEC = 1000000000;
+
+/* 60.0988 Hz, 29780.5 cycles of the 1789773 Hz CPU */
+static const int64_t NES_FRAME_PERIOD = 16639267;
+
+/* Margin left for spinning, larger than a typical sleep overshoot */
+static const int64_t SPIN_NSEC = 1000000;
+
+void pacing_init(struct pacing *pacing,
+                 enum pacing_mode mode,
+                 bool is_spinning)
+{
+	pacing->mode = mode;
+	pacing->is_spinning = is_spinning;
+	pacing->clock = CLOCK_MONOTONIC;
+	pacing->period = NES_FRAME_PERIOD;
+	pacing->deadline = 0;
+	pacing->presented = 0;
+	pacing->refresh = 0;
+	pacing->previous = 0;
+	pacing->interval = 0;
+	pacing->intervals = 0;
+	pacing->interval_mean = 0.0;
+	pacing->interval_m2 = 0.0;
+	pacing->interval_min = INT64_MAX;
+	pacing->interval_max = 0;
+	pacing->duplicated = 0;
+}
+
+int64_t pacing_now(const struct pacing *pacing)
+{
+	struct timespec now;
+	clock_gettime(pacing->clock, &now);
+	return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static void sleep_until(const struct pacing *pacing, int64_t deadline)
+{
+	int64_t sleep_deadline = deadline;
+	if (pacing->is_spinning) {
+		sleep_deadline -= SPIN_NSEC;
+	}
+
+	struct timespec request = {
+		.tv_sec = sleep_deadline / NSEC_PER_SEC,
+		.tv_nsec = sleep_deadline % NSEC_PER_SEC,
+	};
+	while (clock_nanosleep(pacing->clock, TIMER_ABSTIME,
+	                       &request, NULL) == EINTR) {
+	}
+
+	if (pacing->is_spinning) {
+		while (pacing_now(pacing) < deadline) {
+		}
+	}
+}
+
+/* The first refresh at or after a deadline */
+static int64_t next_refresh(const struct pacing *pacing, int64_t deadline)
+{
+	if (pacing->mode != PACING_MODE_PRESENTATION || pacing->refresh == 0
+	    || pacing->presented == 0 || deadline <= pacing->presented) {
+		return deadline;
+	}
+	int64_t refreshes = (deadline - pacing->presented + pacing->refresh - 1)
+	                    / pacing->refresh;
+	return pacing->presented + refreshes * pacing->refresh;
+}
+
+/* Deadlines stay at the NES frame rate, the presentation mode only wakes
+   at the display's refresh after each */
+static void wait_deadline(struct pacing *pacing)
+{
+	int64_t now = pacing_now(pacing);
+	if (pacing->deadline == 0 || now - pacing->deadline > pacing->period) {
+		/* First frame, or too far behind to catch up */
+		pacing->deadline = now;
+	}
+	else {
+		sleep_until(pacing, next_refresh(pacing, pacing->deadline));
+	}
+	pacing->deadline += pacing->period;
+}
+
+void pacing_wait(struct pacing *pacing)
+{
+	if (pacing->mode == PACING_MODE_FRAME_CALLBACK) {
+		return;
+	}
+
+	wait_deadline(pacing);
+	if (pacing->mode == PACING_MODE_DEADLINE) {
+		pacing_frame(pacing, pacing_now(pacing));
+	}
+}
+
+void pacing_sleep(struct pacing *pacing)
+{
+	wait_deadline(pacing);
+	/* The next frame shown starts a new interval */
+	pacing->previous = 0;
+}
+
+void pacing_frame(struct pacing *pacing, int64_t timestamp)
+{
+	if (pacing->previous != 0) {
+		/* Welford's running mean and variance */
+		int64_t interval = timestamp - pacing->previous;
+		++pacing->intervals;
+		double delta = interval - pacing->interval_mean;
+		pacing->interval_mean += delta / pacing->intervals;
+		pacing->interval_m2 += delta * (interval - pacing->interval_mean);
+		if (interval < pacing->interval_min) {
+			pacing->interval_min = interval;
+		}
+		if (interval > pacing->interval_max) {
+			pacing->interval_max = interval;
+		}
+		pacing->interval = interval;
+		if (interval > pacing->period * 3 / 2) {
+			pacing->duplicated += (interval + pacing->period / 2)
+			                      / pacing->period - 1;
+		}
+	}
+	pacing->previous = timestamp;
+}
+
+void pacing_presented(struct pacing *pacing,
+                      int64_t timestamp,
+                      int64_t refresh)
+{
+	if (pacing->mode != PACING_MODE_PRESENTATION) {
+		return;
+	}
+	pacing_frame(pacing, timestamp);
+	pacing->presented = timestamp;
+	if (refresh > 0) {
+		pacing->refresh = refresh;
+	}
+}
+
+void pacing_print_statistics(const struct pacing *pacing)
+{
+	if (pacing->intervals < 2) {
+		return;
+	}
+	double deviation = sqrt(pacing->interval_m2 / (pacing->intervals - 1));
+	printf("Pacing: %llu frames, %.3f ms mean, %.3f ms standard deviation, "
+	       "%.3f-%.3f ms, %llu duplicated\n",
+	       (unsigned long long) pacing->intervals,
+	       pacing->interval_mean / 1e6, deviation / 1e6,
+	       pacing->interval_min / 1e6, pacing->interval_max / 1e6,
+	       (unsigned long long) pacing->duplicated);
+}
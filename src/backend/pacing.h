@@ -0,0 +1,88 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+enum pacing_mode {
+	/* Sleep to absolute deadlines at the NES frame rate */
+	PACING_MODE_DEADLINE,
+	/* Wait for the compositor's frame callback */
+	PACING_MODE_FRAME_CALLBACK,
+	/* Sleep to deadlines predicted from presentation feedback */
+	PACING_MODE_PRESENTATION,
+};
+
+struct pacing {
+	enum pacing_mode mode;
+	/* Sleep until shortly before a deadline, then spin */
+	bool is_spinning;
+	clockid_t clock;
+	int64_t period;
+	/* Next deadline in nanoseconds, 0 before the first frame */
+	int64_t deadline;
+	/* The last refresh shown and the display's refresh interval, from
+	   presentation feedback, 0 if unknown */
+	int64_t presented;
+	int64_t refresh;
+
+	/* Intervals between frames */
+	int64_t previous;
+	int64_t interval;
+	uint64_t intervals;
+	double interval_mean;
+	double interval_m2;
+	int64_t interval_min;
+	int64_t interval_max;
+	/* Periods an interval spanned past the first, each one showed the
+	   previous frame again */
+	uint64_t duplicated;
+};
+
+void pacing_init(struct pacing *pacing,
+                 enum pacing_mode mode,
+                 bool is_spinning);
+int64_t pacing_now(const struct pacing *pacing);
+
+/* Sleeps until the next deadline, for the deadline and presentation
+   modes */
+void pacing_wait(struct pacing *pacing);
+
+/* Sleeps until the next deadline in any mode, for frames that are not
+   shown */
+void pacing_sleep(struct pacing *pacing);
+
+/* A frame was shown at timestamp, on the pacing clock */
+void pacing_frame(struct pacing *pacing, int64_t timestamp);
+
+/* Presentation feedback, refresh is 0 if unknown. Only counts as a frame
+   shown in the presentation mode, the others record their own. */
+void pacing_presented(struct pacing *pacing,
+                      int64_t timestamp,
+                      int64_t refresh);
+
+void pacing_print_statistics(const struct pacing *pacing);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,168 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "scale.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCALE_X86
+#include <immintrin.h>
+#endif
+
+static const uint16_t LINE_WIDTH = 256;
+
+static void copy_rows(uint32_t *rows, size_t stride, uint8_t scale)
+{
+	for (uint8_t j = 1; j < scale; ++j) {
+		memcpy(rows + j * stride, rows,
+		       LINE_WIDTH * scale * sizeof(uint32_t));
+	}
+}
+
+static void scale_line_scalar(uint32_t *rows,
+                              const uint8_t *line,
+                              const uint32_t *palette,
+                              uint8_t scale)
+{
+	uint32_t *row = rows;
+	for (uint16_t x = 0; x < LINE_WIDTH; ++x) {
+		uint32_t colour = palette[line[x] & 0x3F];
+		for (uint8_t i = 0; i < scale; ++i) {
+			*row++ = colour;
+		}
+	}
+}
+
+#ifdef SCALE_X86
+/* Four pixels at a time, looked up one by one then spread over scale
+   vectors with a byte shuffle */
+__attribute__((target("sse4.1")))
+static void scale_line_sse41(uint32_t *rows,
+                             const uint8_t *line,
+                             const uint32_t *palette,
+                             uint8_t scale)
+{
+	__m128i shuffles[SCALE_MAX];
+	for (uint8_t j = 0; j < scale; ++j) {
+		uint8_t bytes[16];
+		for (uint8_t i = 0; i < 16; ++i) {
+			uint8_t pixel = (j * 4 + i / 4) / scale;
+			bytes[i] = pixel * 4 + i % 4;
+		}
+		shuffles[j] = _mm_loadu_si128((const __m128i *) bytes);
+	}
+
+	uint32_t *row = rows;
+	for (uint16_t x = 0; x < LINE_WIDTH; x += 4) {
+		__m128i colours = _mm_setr_epi32(palette[line[x] & 0x3F],
+		                                 palette[line[x + 1] & 0x3F],
+		                                 palette[line[x + 2] & 0x3F],
+		                                 palette[line[x + 3] & 0x3F]);
+		for (uint8_t j = 0; j < scale; ++j) {
+			_mm_storeu_si128((__m128i *) row,
+			                 _mm_shuffle_epi8(colours, shuffles[j]));
+			row += 4;
+		}
+	}
+}
+
+/* Eight pixels at a time with a gather, then spread over scale vectors
+   with a cross-lane permute */
+__attribute__((target("avx2")))
+static void scale_line_avx2(uint32_t *rows,
+                            const uint8_t *line,
+                            const uint32_t *palette,
+                            uint8_t scale)
+{
+	__m256i permutes[SCALE_MAX];
+	for (uint8_t j = 0; j < scale; ++j) {
+		int32_t pixels[8];
+		for (uint8_t i = 0; i < 8; ++i) {
+			pixels[i] = (j * 8 + i) / scale;
+		}
+		permutes[j] = _mm256_loadu_si256((const __m256i *) pixels);
+	}
+
+	const __m256i index_mask = _mm256_set1_epi32(0x3F);
+	uint32_t *row = rows;
+	for (uint16_t x = 0; x < LINE_WIDTH; x += 8) {
+		__m128i bytes = _mm_loadl_epi64((const __m128i *) (line + x));
+		__m256i indices = _mm256_and_si256(_mm256_cvtepu8_epi32(bytes),
+		                                   index_mask);
+		__m256i colours = _mm256_i32gather_epi32(
+			(const int *) palette, indices, 4);
+		for (uint8_t j = 0; j < scale; ++j) {
+			_mm256_storeu_si256(
+				(__m256i *) row,
+				_mm256_permutevar8x32_epi32(colours, permutes[j]));
+			row += 8;
+		}
+	}
+}
+#endif
+
+bool scale_kernel_is_supported(enum scale_kernel kernel)
+{
+	switch (kernel) {
+	case SCALE_KERNEL_SCALAR:
+		return true;
+#ifdef SCALE_X86
+	case SCALE_KERNEL_SSE41:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse4.1");
+	case SCALE_KERNEL_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+void scale_line_kernel(enum scale_kernel kernel,
+                       uint32_t *rows,
+                       size_t stride,
+                       const uint8_t *line,
+                       const uint32_t *palette,
+                       uint8_t scale)
+{
+	switch (kernel) {
+#ifdef SCALE_X86
+	case SCALE_KERNEL_SSE41:
+		scale_line_sse41(rows, line, palette, scale);
+		break;
+	case SCALE_KERNEL_AVX2:
+		scale_line_avx2(rows, line, palette, scale);
+		break;
+#endif
+	default:
+		scale_line_scalar(rows, line, palette, scale);
+		break;
+	}
+	copy_rows(rows, stride, scale);
+}
+
+enum scale_kernel scale_fastest_kernel(void)
+{
+	if (scale_kernel_is_supported(SCALE_KERNEL_AVX2)) {
+		return SCALE_KERNEL_AVX2;
+	}
+	if (scale_kernel_is_supported(SCALE_KERNEL_SSE41)) {
+		return SCALE_KERNEL_SSE41;
+	}
+	return SCALE_KERNEL_SCALAR;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCALE_MAX 6
+
+enum scale_kernel {
+	SCALE_KERNEL_SCALAR,
+	SCALE_KERNEL_SSE41,
+	SCALE_KERNEL_AVX2,
+	SCALE_KERNELS,
+};
+
+bool scale_kernel_is_supported(enum scale_kernel kernel);
+
+/* Expands a 256 pixel line of palette indices to ARGB, each pixel scale
+   times wide, into scale rows stride pixels apart. The first row is
+   written, the others are copies of it. */
+void scale_line_kernel(enum scale_kernel kernel,
+                       uint32_t *rows,
+                       size_t stride,
+                       const uint8_t *line,
+                       const uint32_t *palette,
+                       uint8_t scale);
+
+/* The fastest kernel the CPU supports, asking the CPU is too slow to do
+   for every line */
+enum scale_kernel scale_fastest_kernel(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -16,14 +16,31 @@
 
 #include "wayland_private.h"
 
+#include "scale.h"
 #include "wayland_buffer.h"
 
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include "../exit_code.h"
 
-static const int32_t WIDTH = 256 * SCALE;
-static const int32_t HEIGHT = 240 * SCALE;
+static void presentation_clock_id(void *data,
+                                  struct wp_presentation *presentation,
+                                  uint32_t clock_id)
+{
+	(void) (presentation);
+
+	struct wayland *wayland = (struct wayland *) data;
+	wayland->pacing.clock = clock_id;
+}
+
+static struct wp_presentation_listener presentation_listener = {
+	.clock_id = presentation_clock_id,
+};
 
 static void registry_global(void *data,
                             struct wl_registry *wl_registry,
@@ -49,6 +66,16 @@ static void registry_global(void *data,
 		wayland->seat = wl_registry_bind(
 			wl_registry, name, &wl_seat_interface, version);
 	}
+	else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		wayland->viewporter = wl_registry_bind(
+			wl_registry, name, &wp_viewporter_interface, 1);
+	}
+	else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		wayland->presentation = wl_registry_bind(
+			wl_registry, name, &wp_presentation_interface, 1);
+		wp_presentation_add_listener(wayland->presentation,
+		                             &presentation_listener, wayland);
+	}
 }
 
 static void registry_global_remove(void *data,
@@ -96,11 +123,21 @@ static void toplevel_configure(void *data,
                                int32_t height,
                                struct wl_array *states)
 {
-	(void) data;
 	(void) toplevel;
-	(void) width;
-	(void) height;
 	(void) states;
+
+	struct wayland *wayland = (struct wayland *) data;
+
+	/* Zero leaves the size to us */
+	if (width <= 0 || height <= 0) {
+		return;
+	}
+	if (width == wayland->window_width
+	    && height == wayland->window_height) {
+		return;
+	}
+	wayland->pending_window_width = width;
+	wayland->pending_window_height = height;
 }
 
 static void toplevel_close(void *data,
@@ -127,13 +164,75 @@ static void frame_callback_done(void *data,
                                 struct wl_callback *wl_callback,
                                 uint32_t time)
 {
-	(void) (data);
-	/* TODO: check the time to ensure we don't have a frame miss */
+	/* The time has no defined base, the pacing clock is used instead */
 	(void) (time);
 
+	struct wayland *wayland = (struct wayland *) data;
+	wayland->is_frame_done = true;
+	wayland->frame_done_nsec = pacing_now(&wayland->pacing);
+	if (wayland->pacing.mode == PACING_MODE_FRAME_CALLBACK) {
+		pacing_frame(&wayland->pacing, pacing_now(&wayland->pacing));
+	}
+
 	wl_callback_destroy(wl_callback);
 }
 
+static void presentation_feedback_sync_output(
+	void *data,
+	struct wp_presentation_feedback *feedback,
+	struct wl_output *output)
+{
+	(void) (data);
+	(void) (feedback);
+	(void) (output);
+}
+
+static void presentation_feedback_presented(
+	void *data,
+	struct wp_presentation_feedback *feedback,
+	uint32_t tv_sec_hi,
+	uint32_t tv_sec_lo,
+	uint32_t tv_nsec,
+	uint32_t refresh,
+	uint32_t seq_hi,
+	uint32_t seq_lo,
+	uint32_t flags)
+{
+	(void) (seq_hi);
+	(void) (seq_lo);
+	(void) (flags);
+
+	struct wayland *wayland = (struct wayland *) data;
+	int64_t tv_sec = ((int64_t) tv_sec_hi << 32) | tv_sec_lo;
+	int64_t timestamp = tv_sec * 1000000000 + tv_nsec;
+	pacing_presented(&wayland->pacing, timestamp, refresh);
+
+	/* Latency is measured on CLOCK_MONOTONIC */
+	if (wayland->pacing.clock != CLOCK_MONOTONIC) {
+		timestamp += latency_now() - pacing_now(&wayland->pacing);
+	}
+	latency_presented(&wayland->latency, timestamp);
+
+	wp_presentation_feedback_destroy(feedback);
+}
+
+static void presentation_feedback_discarded(
+	void *data,
+	struct wp_presentation_feedback *feedback)
+{
+	struct wayland *wayland = (struct wayland *) data;
+	++wayland->discarded_count;
+	latency_discarded(&wayland->latency);
+
+	wp_presentation_feedback_destroy(feedback);
+}
+
+struct wp_presentation_feedback_listener presentation_feedback_listener = {
+	.sync_output = presentation_feedback_sync_output,
+	.presented = presentation_feedback_presented,
+	.discarded = presentation_feedback_discarded,
+};
+
 static void keyboard_keymap(void *data,
                             struct wl_keyboard *wl_keyboard,
                             uint32_t format,
@@ -194,70 +293,61 @@ static void keyboard_key(void *data,
 	const uint8_t BUTTON_LEFT   = 1 << 1;
 	const uint8_t BUTTON_RIGHT  = 1 << 0;
 
+	/* F1 */
+	if (key == 59) {
+		if (state == 1) {
+			atomic_store(&wayland->is_hud_visible,
+			             !atomic_load(&wayland->is_hud_visible));
+		}
+		return;
+	}
+
+	/* Backspace */
+	if (key == 14) {
+		atomic_store(&wayland->is_rewinding, state == 1);
+		return;
+	}
+
+	uint8_t button;
+	switch (key) {
+	case 17:
+		button = BUTTON_UP;
+		break;
+	case 30:
+		button = BUTTON_LEFT;
+		break;
+	case 31:
+		button = BUTTON_DOWN;
+		break;
+	case 32:
+		button = BUTTON_RIGHT;
+		break;
+	case 34:
+		button = BUTTON_SELECT;
+		break;
+	case 35:
+		button = BUTTON_START;
+		break;
+	case 37:
+		button = BUTTON_B;
+		break;
+	case 38:
+		button = BUTTON_A;
+		break;
+	default:
+		return;
+	}
+
+	/* A press is also latched until the next read, so a tap between two
+	   reads still registers. The key's own time has no defined base, so
+	   the timestamp is when it arrives. */
+	atomic_store(&wayland->joypad1_timestamp, latency_now());
 	switch (state) {
 	case 0:
-		switch (key) {
-		case 17:
-			wayland->joypad1_press &= ~(BUTTON_UP);
-			break;
-		case 30:
-			wayland->joypad1_press &= ~(BUTTON_LEFT);
-			break;
-		case 31:
-			wayland->joypad1_press &= ~(BUTTON_DOWN);
-			break;
-		case 32:
-			wayland->joypad1_press &= ~(BUTTON_RIGHT);
-			break;
-		case 34:
-			wayland->joypad1_press &= ~(BUTTON_SELECT);
-			break;
-		case 35:
-			wayland->joypad1_press &= ~(BUTTON_START);
-			break;
-		case 37:
-			wayland->joypad1_press &= ~(BUTTON_B);
-			break;
-		case 38:
-			wayland->joypad1_press &= ~(BUTTON_A);
-			break;
-		}
+		atomic_fetch_and(&wayland->joypad1, ~(uint_fast16_t) button);
 		break;
 	case 1:
-		switch (key) {
-		case 17:
-			wayland->joypad1_press |= BUTTON_UP;
-			wayland->joypad1_state |= BUTTON_UP;
-			break;
-		case 30:
-			wayland->joypad1_press |= BUTTON_LEFT;
-			wayland->joypad1_state |= BUTTON_LEFT;
-			break;
-		case 31:
-			wayland->joypad1_press |= BUTTON_DOWN;
-			wayland->joypad1_state |= BUTTON_DOWN;
-			break;
-		case 32:
-			wayland->joypad1_press |= BUTTON_RIGHT;
-			wayland->joypad1_state |= BUTTON_RIGHT;
-			break;
-		case 34:
-			wayland->joypad1_press |= BUTTON_SELECT;
-			wayland->joypad1_state |= BUTTON_SELECT;
-			break;
-		case 35:
-			wayland->joypad1_press |= BUTTON_START;
-			wayland->joypad1_state |= BUTTON_START;
-			break;
-		case 37:
-			wayland->joypad1_press |= BUTTON_B;
-			wayland->joypad1_state |= BUTTON_B;
-			break;
-		case 38:
-			wayland->joypad1_press |= BUTTON_A;
-			wayland->joypad1_state |= BUTTON_A;
-			break;
-		}
+		atomic_fetch_or(&wayland->joypad1, button | button << 8);
 		break;
 	}
 }
@@ -299,8 +389,50 @@ struct wl_keyboard_listener keyboard_listener = {
 	.repeat_info = keyboard_repeat_info,
 };
 
-uint8_t init_wayland(struct wayland *wayland)
+/* With a viewport the buffer stays native and fills the window, otherwise
+   the window shrinks to the largest whole scale that fits in it */
+static void set_buffer_size(struct wayland *wayland)
 {
+	if (wayland->viewport != NULL) {
+		wayland->scale = 1;
+		wp_viewport_set_destination(wayland->viewport,
+		                            wayland->window_width,
+		                            wayland->window_height);
+	}
+	else {
+		int32_t scale = wayland->window_width / 256;
+		if (wayland->window_height / 240 < scale) {
+			scale = wayland->window_height / 240;
+		}
+		if (scale < 1) {
+			scale = 1;
+		}
+		else if (scale > SCALE_MAX) {
+			scale = SCALE_MAX;
+		}
+		wayland->scale = scale;
+		wayland->window_width = 256 * scale;
+		wayland->window_height = 240 * scale;
+	}
+	wayland->width = 256 * wayland->scale;
+	wayland->height = 240 * wayland->scale;
+	zxdg_surface_v6_set_window_geometry(wayland->shell_surface,
+	                                    0, 0,
+	                                    wayland->window_width,
+	                                    wayland->window_height);
+}
+
+uint8_t init_wayland(struct wayland *wayland, uint8_t scale)
+{
+	wayland->compositor = NULL;
+	wayland->shm = NULL;
+	wayland->shell = NULL;
+	wayland->seat = NULL;
+	wayland->viewporter = NULL;
+	wayland->viewport = NULL;
+	wayland->presentation = NULL;
+	wayland->scale_kernel = scale_fastest_kernel();
+
 	wayland->display = wl_display_connect(NULL);
 	if (wayland->display == NULL) {
 		return EXIT_CODE_WAYLAND_BIT;
@@ -329,6 +461,12 @@ uint8_t init_wayland(struct wayland *wayland)
 		if (wayland->seat != NULL) {
 			wl_seat_destroy(wayland->seat);
 		}
+		if (wayland->viewporter != NULL) {
+			wp_viewporter_destroy(wayland->viewporter);
+		}
+		if (wayland->presentation != NULL) {
+			wp_presentation_destroy(wayland->presentation);
+		}
 		wl_registry_destroy(wayland->registry);
 		wl_display_disconnect(wayland->display);
 		return EXIT_CODE_WAYLAND_BIT;
@@ -342,6 +480,12 @@ uint8_t init_wayland(struct wayland *wayland)
 		zxdg_shell_v6_destroy(wayland->shell);
 		wl_shm_destroy(wayland->shm);
 		wl_compositor_destroy(wayland->compositor);
+		if (wayland->viewporter != NULL) {
+			wp_viewporter_destroy(wayland->viewporter);
+		}
+		if (wayland->presentation != NULL) {
+			wp_presentation_destroy(wayland->presentation);
+		}
 		wl_registry_destroy(wayland->registry);
 		wl_display_disconnect(wayland->display);
 		return EXIT_CODE_WAYLAND_BIT;
@@ -355,6 +499,12 @@ uint8_t init_wayland(struct wayland *wayland)
 		zxdg_shell_v6_destroy(wayland->shell);
 		wl_shm_destroy(wayland->shm);
 		wl_compositor_destroy(wayland->compositor);
+		if (wayland->viewporter != NULL) {
+			wp_viewporter_destroy(wayland->viewporter);
+		}
+		if (wayland->presentation != NULL) {
+			wp_presentation_destroy(wayland->presentation);
+		}
 		wl_registry_destroy(wayland->registry);
 		wl_display_disconnect(wayland->display);
 		return EXIT_CODE_WAYLAND_BIT;
@@ -362,41 +512,63 @@ uint8_t init_wayland(struct wayland *wayland)
 	zxdg_surface_v6_add_listener(wayland->shell_surface,
 	                             &shell_surface_listener, NULL);
 
-	wayland->width = WIDTH;
-	wayland->height = HEIGHT;
-
 	wayland->toplevel = zxdg_surface_v6_get_toplevel(wayland->shell_surface);
 	if (wayland->toplevel == NULL) {
+		if (wayland->viewport != NULL) {
+			wp_viewport_destroy(wayland->viewport);
+		}
 		zxdg_surface_v6_destroy(wayland->shell_surface);
 		wl_surface_destroy(wayland->surface);
 		wl_seat_destroy(wayland->seat);
 		zxdg_shell_v6_destroy(wayland->shell);
 		wl_shm_destroy(wayland->shm);
 		wl_compositor_destroy(wayland->compositor);
+		if (wayland->viewporter != NULL) {
+			wp_viewporter_destroy(wayland->viewporter);
+		}
+		if (wayland->presentation != NULL) {
+			wp_presentation_destroy(wayland->presentation);
+		}
 		wl_registry_destroy(wayland->registry);
 		wl_display_disconnect(wayland->display);
 		return EXIT_CODE_WAYLAND_BIT;
 	}
 	zxdg_toplevel_v6_add_listener(wayland->toplevel, &toplevel_listener,
-	                              NULL);
+	                              wayland);
 
 	zxdg_toplevel_v6_set_title(wayland->toplevel, "NES Emulator");
 	zxdg_toplevel_v6_set_app_id(wayland->toplevel, "io.eyl.NESEmulator");
-	zxdg_surface_v6_set_window_geometry(wayland->shell_surface,
-	                                    0, 0,
-	                                    wayland->width, wayland->height);
+
+	if (wayland->viewporter != NULL) {
+		wayland->viewport = wp_viewporter_get_viewport(
+			wayland->viewporter, wayland->surface);
+	}
+	wayland->window_width = 256 * scale;
+	wayland->window_height = 240 * scale;
+	wayland->pending_window_width = 0;
+	wayland->pending_window_height = 0;
+	set_buffer_size(wayland);
 	wl_surface_commit(wayland->surface);
 	wl_display_roundtrip(wayland->display);
 
 	wayland->keyboard = wl_seat_get_keyboard(wayland->seat);
 	if (wayland->keyboard == NULL) {
 		zxdg_toplevel_v6_destroy(wayland->toplevel);
+		if (wayland->viewport != NULL) {
+			wp_viewport_destroy(wayland->viewport);
+		}
 		zxdg_surface_v6_destroy(wayland->shell_surface);
 		wl_surface_destroy(wayland->surface);
 		wl_seat_destroy(wayland->seat);
 		zxdg_shell_v6_destroy(wayland->shell);
 		wl_shm_destroy(wayland->shm);
 		wl_compositor_destroy(wayland->compositor);
+		if (wayland->viewporter != NULL) {
+			wp_viewporter_destroy(wayland->viewporter);
+		}
+		if (wayland->presentation != NULL) {
+			wp_presentation_destroy(wayland->presentation);
+		}
 		wl_registry_destroy(wayland->registry);
 		wl_display_disconnect(wayland->display);
 		return EXIT_CODE_WAYLAND_BIT;
@@ -408,23 +580,31 @@ uint8_t init_wayland(struct wayland *wayland)
 	if (exit_code != 0) {
 		wl_keyboard_release(wayland->keyboard);
 		zxdg_toplevel_v6_destroy(wayland->toplevel);
+		if (wayland->viewport != NULL) {
+			wp_viewport_destroy(wayland->viewport);
+		}
 		zxdg_surface_v6_destroy(wayland->shell_surface);
 		wl_surface_destroy(wayland->surface);
 		wl_seat_destroy(wayland->seat);
 		zxdg_shell_v6_destroy(wayland->shell);
 		wl_shm_destroy(wayland->shm);
 		wl_compositor_destroy(wayland->compositor);
+		if (wayland->viewporter != NULL) {
+			wp_viewporter_destroy(wayland->viewporter);
+		}
+		if (wayland->presentation != NULL) {
+			wp_presentation_destroy(wayland->presentation);
+		}
 		wl_registry_destroy(wayland->registry);
 		wl_display_disconnect(wayland->display);
 		return exit_code;
 	}
 
 	for (int64_t i = 0; i < (wayland->width * wayland->height); ++i) {
-		wayland->front_data[i] = 0xFF0000FF;
-	}
-	for (int64_t i = 0; i < (wayland->width * wayland->height); ++i) {
-		wayland->back_data[i] = 0xFF00FF00;
+		wayland->buffers[0].data[i] = 0xFF0000FF;
 	}
+	wayland->no_free_buffer_count = 0;
+	wayland->discarded_count = 0;
 
 	wayland->frame_callback = wl_surface_frame(wayland->surface);
 	if (wayland->frame_callback == NULL) {
@@ -432,12 +612,21 @@ uint8_t init_wayland(struct wayland *wayland)
 		exit_code |= fini_wayland_buffer(wayland);
 		wl_keyboard_release(wayland->keyboard);
 		zxdg_toplevel_v6_destroy(wayland->toplevel);
+		if (wayland->viewport != NULL) {
+			wp_viewport_destroy(wayland->viewport);
+		}
 		zxdg_surface_v6_destroy(wayland->shell_surface);
 		wl_surface_destroy(wayland->surface);
 		wl_seat_destroy(wayland->seat);
 		zxdg_shell_v6_destroy(wayland->shell);
 		wl_shm_destroy(wayland->shm);
 		wl_compositor_destroy(wayland->compositor);
+		if (wayland->viewporter != NULL) {
+			wp_viewporter_destroy(wayland->viewporter);
+		}
+		if (wayland->presentation != NULL) {
+			wp_presentation_destroy(wayland->presentation);
+		}
 		wl_registry_destroy(wayland->registry);
 		wl_display_disconnect(wayland->display);
 		return exit_code;
@@ -445,30 +634,253 @@ uint8_t init_wayland(struct wayland *wayland)
 
 	wl_callback_add_listener(wayland->frame_callback,
 	                         &frame_callback_listener, wayland);
+	wayland->is_frame_done = false;
 
 	wl_surface_damage(wayland->surface, 0, 0,
-	                  wayland->width, wayland->height);
-	wl_surface_attach(wayland->surface, wayland->front_buffer, 0, 0);
+	                  wayland->window_width, wayland->window_height);
+	wl_surface_attach(wayland->surface, wayland->buffers[0].buffer, 0, 0);
 	wl_surface_commit(wayland->surface);
+	wayland->buffers[0].is_busy = true;
 
 	wl_display_flush(wayland->display);
 
 	return 0;
 }
 
+/* Reads the display on the event thread, dispatching only the input
+   queue. Other events stay on the default queue for the emulation thread,
+   which reads the display too, so either thread may read events for the
+   other. */
+static void *event_thread_main(void *data)
+{
+	struct wayland *wayland = (struct wayland *) data;
+	struct wl_display *display = wayland->display;
+	struct pollfd fds[2] = {
+		{.fd = wl_display_get_fd(display), .events = POLLIN},
+		{.fd = wayland->event_thread_stop_fd, .events = POLLIN},
+	};
+
+	while (true) {
+		while (wl_display_prepare_read_queue(display,
+		                                     wayland->input_queue) != 0) {
+			wl_display_dispatch_queue_pending(display,
+			                                  wayland->input_queue);
+		}
+
+		if (poll(fds, 2, -1) < 0) {
+			wl_display_cancel_read(display);
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			wl_display_cancel_read(display);
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			if (wl_display_read_events(display) < 0) {
+				break;
+			}
+		}
+		else {
+			wl_display_cancel_read(display);
+			if (fds[0].revents & (POLLERR | POLLHUP)) {
+				break;
+			}
+		}
+
+		wl_display_dispatch_queue_pending(display, wayland->input_queue);
+	}
+	return NULL;
+}
+
+/* Moves the keyboard to its own queue, handled on the event thread */
+uint8_t start_wayland_event_thread(struct wayland *wayland)
+{
+	wayland->input_queue = wl_display_create_queue(wayland->display);
+	if (wayland->input_queue == NULL) {
+		return EXIT_CODE_WAYLAND_BIT;
+	}
+
+	wayland->event_thread_stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (wayland->event_thread_stop_fd < 0) {
+		wl_event_queue_destroy(wayland->input_queue);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+
+	wl_proxy_set_queue((struct wl_proxy *) wayland->keyboard,
+	                   wayland->input_queue);
+	if (pthread_create(&wayland->event_thread, NULL,
+	                   event_thread_main, wayland) != 0) {
+		uint8_t exit_code = EXIT_CODE_OS_ERROR_BIT;
+		wl_proxy_set_queue((struct wl_proxy *) wayland->keyboard, NULL);
+		if (close(wayland->event_thread_stop_fd) < 0) {
+			exit_code |= EXIT_CODE_OS_ERROR_BIT;
+		}
+		wl_event_queue_destroy(wayland->input_queue);
+		return exit_code;
+	}
+	return 0;
+}
+
+uint8_t stop_wayland_event_thread(struct wayland *wayland)
+{
+	uint8_t exit_code = 0;
+	uint64_t stop = 1;
+	if (write(wayland->event_thread_stop_fd, &stop, sizeof(stop)) < 0) {
+		exit_code |= EXIT_CODE_OS_ERROR_BIT;
+	}
+	pthread_join(wayland->event_thread, NULL);
+	wl_proxy_set_queue((struct wl_proxy *) wayland->keyboard, NULL);
+	if (close(wayland->event_thread_stop_fd) < 0) {
+		exit_code |= EXIT_CODE_OS_ERROR_BIT;
+	}
+	wl_event_queue_destroy(wayland->input_queue);
+	return exit_code;
+}
+
+/* Dispatches what the compositor sends within timeout milliseconds, 0
+   to never block or -1 to wait for something */
+uint8_t dispatch_wayland(struct wayland *wayland, int timeout)
+{
+	struct wl_display *display = wayland->display;
+	while (wl_display_prepare_read(display) != 0) {
+		wl_display_dispatch_pending(display);
+	}
+	wl_display_flush(display);
+
+	struct pollfd fd = {
+		.fd = wl_display_get_fd(display),
+		.events = POLLIN,
+	};
+	if (poll(&fd, 1, timeout) > 0 && (fd.revents & POLLIN)) {
+		if (wl_display_read_events(display) < 0) {
+			return EXIT_CODE_WAYLAND_BIT;
+		}
+	}
+	else {
+		wl_display_cancel_read(display);
+	}
+	if (wl_display_dispatch_pending(display) < 0) {
+		return EXIT_CODE_WAYLAND_BIT;
+	}
+	return 0;
+}
+
 uint8_t fini_wayland(struct wayland *wayland)
 {
+	if (wayland->no_free_buffer_count != 0) {
+		printf("Wayland: no free buffer for %llu frames\n",
+		       (unsigned long long) wayland->no_free_buffer_count);
+	}
+	if (wayland->discarded_count != 0) {
+		printf("Wayland: %llu frames discarded\n",
+		       (unsigned long long) wayland->discarded_count);
+	}
+	pacing_print_statistics(&wayland->pacing);
+
 	wl_display_roundtrip(wayland->display);
 	zxdg_toplevel_v6_destroy(wayland->toplevel);
 	wl_keyboard_release(wayland->keyboard);
 	wl_seat_destroy(wayland->seat);
 	uint8_t exit_code = fini_wayland_buffer(wayland);
+	if (wayland->viewport != NULL) {
+		wp_viewport_destroy(wayland->viewport);
+	}
 	zxdg_surface_v6_destroy(wayland->shell_surface);
 	wl_surface_destroy(wayland->surface);
 	zxdg_shell_v6_destroy(wayland->shell);
 	wl_shm_destroy(wayland->shm);
 	wl_compositor_destroy(wayland->compositor);
+	if (wayland->viewporter != NULL) {
+		wp_viewporter_destroy(wayland->viewporter);
+	}
+	if (wayland->presentation != NULL) {
+		wp_presentation_destroy(wayland->presentation);
+	}
 	wl_registry_destroy(wayland->registry);
 	wl_display_disconnect(wayland->display);
 	return exit_code;
 }
+
+/* The part of the backend a resize replaces. Nothing else is copied, the
+   event thread keeps updating the input state meanwhile. */
+struct wayland_geometry {
+	int32_t window_width;
+	int32_t window_height;
+	int32_t width;
+	int32_t height;
+	uint8_t scale;
+	int32_t fd;
+	uint32_t *data;
+	size_t capacity;
+	struct wl_shm_pool *shm_pool;
+	struct wayland_buffer buffers[WAYLAND_BUFFERS];
+	struct wayland_buffer *back;
+};
+
+static void save_geometry(const struct wayland *wayland,
+                          struct wayland_geometry *geometry)
+{
+	geometry->window_width = wayland->window_width;
+	geometry->window_height = wayland->window_height;
+	geometry->width = wayland->width;
+	geometry->height = wayland->height;
+	geometry->scale = wayland->scale;
+	geometry->fd = wayland->fd;
+	geometry->data = wayland->data;
+	geometry->capacity = wayland->capacity;
+	geometry->shm_pool = wayland->shm_pool;
+	memcpy(geometry->buffers, wayland->buffers, sizeof(wayland->buffers));
+	geometry->back = wayland->back;
+}
+
+static void load_geometry(struct wayland *wayland,
+                          const struct wayland_geometry *geometry)
+{
+	wayland->window_width = geometry->window_width;
+	wayland->window_height = geometry->window_height;
+	wayland->width = geometry->width;
+	wayland->height = geometry->height;
+	wayland->scale = geometry->scale;
+	wayland->fd = geometry->fd;
+	wayland->data = geometry->data;
+	wayland->capacity = geometry->capacity;
+	wayland->shm_pool = geometry->shm_pool;
+	memcpy(wayland->buffers, geometry->buffers, sizeof(wayland->buffers));
+	wayland->back = geometry->back;
+}
+
+/* Applies the pending window size. The new buffers are made before the
+   old ones go, so on failure everything stays at the old size. */
+uint8_t resize_wayland(struct wayland *wayland)
+{
+	struct wayland_geometry old;
+	save_geometry(wayland, &old);
+
+	wayland->window_width = wayland->pending_window_width;
+	wayland->window_height = wayland->pending_window_height;
+	wayland->pending_window_width = 0;
+	wayland->pending_window_height = 0;
+	set_buffer_size(wayland);
+	if (wayland->width == old.width && wayland->height == old.height) {
+		return 0;
+	}
+
+	uint8_t exit_code = init_wayland_buffer(wayland);
+	if (exit_code != 0) {
+		load_geometry(wayland, &old);
+		set_buffer_size(wayland);
+		return exit_code;
+	}
+
+	/* The old buffers are destroyed through the backend they were made
+	   with */
+	struct wayland_geometry resized;
+	save_geometry(wayland, &resized);
+	load_geometry(wayland, &old);
+	exit_code = fini_wayland_buffer(wayland);
+	load_geometry(wayland, &resized);
+	return exit_code;
+}
@@ -17,15 +17,28 @@
 #pragma once
 
 #include "../ppu.h"
+#include "pacing.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* The window starts at scale times the NES resolution and can be resized.
+   Presentation pacing falls back to deadlines without wp_presentation.
+   F1 toggles the performance HUD. While the window is hidden the console
+   keeps emulating without rendering, or pauses. Input latency goes to
+   latency_log_path if it is not NULL. */
 uint8_t nes_emulator_ppu_backend_wayland_init(
-	struct nes_emulator_ppu_backend **ppu_backend);
+	struct nes_emulator_ppu_backend **ppu_backend,
+	uint8_t scale,
+	enum pacing_mode pacing_mode,
+	bool is_pacing_spinning,
+	bool is_hud_visible,
+	bool is_pausing_occluded,
+	const char *latency_log_path);
 uint8_t nes_emulator_ppu_backend_wayland_fini(
 	struct nes_emulator_ppu_backend **ppu_backend);
 
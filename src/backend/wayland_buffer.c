@@ -25,6 +25,18 @@
 
 #include "../exit_code.h"
 
+static void buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+	(void) (wl_buffer);
+
+	struct wayland_buffer *buffer = (struct wayland_buffer *) data;
+	buffer->is_busy = false;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	.release = buffer_release,
+};
+
 uint8_t init_wayland_buffer(struct wayland *wayland)
 {
 	wayland->fd = syscall(SYS_memfd_create, "nes-emulator",
@@ -35,7 +47,7 @@ uint8_t init_wayland_buffer(struct wayland *wayland)
 
 	int32_t stride = wayland->width * sizeof(uint32_t);
 	int32_t single_capacity = stride * wayland->height;
-	wayland->capacity = single_capacity * 2;
+	wayland->capacity = single_capacity * WAYLAND_BUFFERS;
 
 	if (ftruncate(wayland->fd, wayland->capacity) < 0) {
 		uint8_t exit_code = EXIT_CODE_OS_ERROR_BIT;
@@ -55,9 +67,6 @@ uint8_t init_wayland_buffer(struct wayland *wayland)
 		return exit_code;
 	}
 
-	wayland->front_data = wayland->data;
-	wayland->back_data = wayland->data + (wayland->width * wayland->height);
-
 	wayland->shm_pool = wl_shm_create_pool(wayland->shm,
 	                                       wayland->fd, wayland->capacity);
 	if (wayland->shm_pool == NULL) {
@@ -71,37 +80,37 @@ uint8_t init_wayland_buffer(struct wayland *wayland)
 		return exit_code;
 	}
 
-	wayland->front_buffer = wl_shm_pool_create_buffer(
-		wayland->shm_pool, 0, wayland->width, wayland->height,
-		stride, WL_SHM_FORMAT_ARGB8888);
-	if (wayland->front_buffer == NULL) {
-		uint8_t exit_code = EXIT_CODE_WAYLAND_BIT;
-		wl_shm_pool_destroy(wayland->shm_pool);
-		if (munmap(wayland->data, wayland->capacity) < 0) {
-			exit_code |= EXIT_CODE_OS_ERROR_BIT;
+	for (size_t i = 0; i < WAYLAND_BUFFERS; ++i) {
+		struct wayland_buffer *buffer = &wayland->buffers[i];
+		buffer->buffer = wl_shm_pool_create_buffer(
+			wayland->shm_pool, single_capacity * i,
+			wayland->width, wayland->height,
+			stride, WL_SHM_FORMAT_ARGB8888);
+		if (buffer->buffer == NULL) {
+			uint8_t exit_code = EXIT_CODE_WAYLAND_BIT;
+			while (i > 0) {
+				--i;
+				wl_buffer_destroy(wayland->buffers[i].buffer);
+			}
+			wl_shm_pool_destroy(wayland->shm_pool);
+			if (munmap(wayland->data, wayland->capacity) < 0) {
+				exit_code |= EXIT_CODE_OS_ERROR_BIT;
+			}
+			if (close(wayland->fd) < 0) {
+				exit_code |= EXIT_CODE_OS_ERROR_BIT;
+			}
+			return exit_code;
 		}
-		if (close(wayland->fd) < 0) {
-			exit_code |= EXIT_CODE_OS_ERROR_BIT;
+		wl_buffer_add_listener(buffer->buffer, &buffer_listener,
+		                       buffer);
+		buffer->data = wayland->data
+		               + i * (wayland->width * wayland->height);
+		buffer->is_busy = false;
+		for (size_t y = 0; y < 240; ++y) {
+			buffer->line_version[y] = 0;
 		}
-		return exit_code;
-	}
-
-	wayland->back_buffer = wl_shm_pool_create_buffer(
-		wayland->shm_pool, single_capacity,
-		wayland->width, wayland->height,
-		stride, WL_SHM_FORMAT_ARGB8888);
-	if (wayland->back_buffer == NULL) {
-		uint8_t exit_code = EXIT_CODE_WAYLAND_BIT;
-		wl_buffer_destroy(wayland->front_buffer);
-		wl_shm_pool_destroy(wayland->shm_pool);
-		if (munmap(wayland->data, wayland->capacity) < 0) {
-			exit_code |= EXIT_CODE_OS_ERROR_BIT;
-		}
-		if (close(wayland->fd) < 0) {
-			exit_code |= EXIT_CODE_OS_ERROR_BIT;
-		}
-		return exit_code;
 	}
+	wayland->back = NULL;
 
 	return 0;
 }
@@ -109,8 +118,9 @@ uint8_t init_wayland_buffer(struct wayland *wayland)
 uint8_t fini_wayland_buffer(struct wayland *wayland)
 {
 	uint8_t exit_code = 0;
-	wl_buffer_destroy(wayland->back_buffer);
-	wl_buffer_destroy(wayland->front_buffer);
+	for (size_t i = 0; i < WAYLAND_BUFFERS; ++i) {
+		wl_buffer_destroy(wayland->buffers[i].buffer);
+	}
 	wl_shm_pool_destroy(wayland->shm_pool);
 	if (munmap(wayland->data, wayland->capacity) < 0) {
 		exit_code |= EXIT_CODE_OS_ERROR_BIT;
@@ -16,210 +16,348 @@
 
 #include "../exit_code.h"
 #include "../ppu.h"
+#include "hud.h"
+#include "scale.h"
 #include "wayland_private.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include <cairo/cairo.h>
+/* Any buffer the compositor is not reading, or none */
+static struct wayland_buffer *free_buffer(struct wayland *wayland)
+{
+	for (size_t i = 0; i < WAYLAND_BUFFERS; ++i) {
+		if (!wayland->buffers[i].is_busy) {
+			return &wayland->buffers[i];
+		}
+	}
+	return NULL;
+}
+
+/* Without a frame callback for this long the window is taken as hidden,
+   long enough to not mistake a slow compositor for it */
+static const int64_t OCCLUSION_NSEC = 250000000;
 
-static void swap_buffers(struct wayland *wayland)
+static const uint32_t PALETTE[64] = {
+	[0x00] = 0xFF545454,
+	[0x01] = 0xFF001E74,
+	[0x02] = 0xFF081090,
+	[0x03] = 0xFF300088,
+	[0x04] = 0xFF440064,
+	[0x05] = 0xFF5C0030,
+	[0x06] = 0xFF540400,
+	[0x07] = 0xFF3C1800,
+	[0x08] = 0xFF202A00,
+	[0x09] = 0xFF083A00,
+	[0x0A] = 0xFF004000,
+	[0x0B] = 0xFF003C00,
+	[0x0C] = 0xFF00323C,
+	[0x0D] = 0xFF000000,
+	[0x0E] = 0xFF000000,
+	[0x0F] = 0xFF000000,
+	[0x10] = 0xFF989698,
+	[0x11] = 0xFF084CC4,
+	[0x12] = 0xFF3032EC,
+	[0x13] = 0xFF5C1EE4,
+	[0x14] = 0xFF8814B0,
+	[0x15] = 0xFFA01464,
+	[0x16] = 0xFF982220,
+	[0x17] = 0xFF783C00,
+	[0x18] = 0xFF545A00,
+	[0x19] = 0xFF287200,
+	[0x1A] = 0xFF087C00,
+	[0x1B] = 0xFF007628,
+	[0x1C] = 0xFF006678,
+	[0x1D] = 0xFF000000,
+	[0x1E] = 0xFF000000,
+	[0x1F] = 0xFF000000,
+	[0x20] = 0xFFECEEEC,
+	[0x21] = 0xFF4C9AEC,
+	[0x22] = 0xFF787CEC,
+	[0x23] = 0xFFB062EC,
+	[0x24] = 0xFFE454EC,
+	[0x25] = 0xFFEC58B4,
+	[0x26] = 0xFFEC6A64,
+	[0x27] = 0xFFD48820,
+	[0x28] = 0xFFA0AA00,
+	[0x29] = 0xFF74C400,
+	[0x2A] = 0xFF4CD020,
+	[0x2B] = 0xFF38CC6C,
+	[0x2C] = 0xFF38B4CC,
+	[0x2D] = 0xFF3C3C3C,
+	[0x2E] = 0xFF000000,
+	[0x2F] = 0xFF000000,
+	[0x30] = 0xFFECEEEC,
+	[0x31] = 0xFFA8CCEC,
+	[0x32] = 0xFFBCBCEC,
+	[0x33] = 0xFFD4B2EC,
+	[0x34] = 0xFFECAEEC,
+	[0x35] = 0xFFECAED4,
+	[0x36] = 0xFFECB4B0,
+	[0x37] = 0xFFE4C490,
+	[0x38] = 0xFFCCD278,
+	[0x39] = 0xFFB4DE78,
+	[0x3A] = 0xFFA8E290,
+	[0x3B] = 0xFF98E2B4,
+	[0x3C] = 0xFFA0D6E4,
+	[0x3D] = 0xFFA0A2A0,
+	[0x3E] = 0xFF000000,
+	[0x3F] = 0xFF000000,
+};
+
+static void frame_stats(void *pointer,
+                        const struct nes_emulator_frame_stats *stats)
 {
-	uint32_t *tmp_data;
-	tmp_data = wayland->front_data;
-	wayland->front_data = wayland->back_data;
-	wayland->back_data = tmp_data;
-
-	struct wl_buffer *tmp_buffer;
-	tmp_buffer = wayland->front_buffer;
-	wayland->front_buffer = wayland->back_buffer;
-	wayland->back_buffer = tmp_buffer;
+	struct wayland *wayland = pointer;
+	wayland->frame_stats = *stats;
+	latency_frame(&wayland->latency, stats->frame, stats->input_nsec);
 }
 
-static void render_pixel(void *pointer,
-                         uint8_t x,
-                         uint8_t y,
-                         uint8_t c)
+static void frame_ready(void *pointer,
+                        const uint8_t *frame,
+                        const bool *is_line_changed)
 {
 	struct wayland *wayland = pointer;
-	static uint32_t palette[64] = {
-		[0x00] = 0xFF545454,
-		[0x01] = 0xFF001E74,
-		[0x02] = 0xFF081090,
-		[0x03] = 0xFF300088,
-		[0x04] = 0xFF440064,
-		[0x05] = 0xFF5C0030,
-		[0x06] = 0xFF540400,
-		[0x07] = 0xFF3C1800,
-		[0x08] = 0xFF202A00,
-		[0x09] = 0xFF083A00,
-		[0x0A] = 0xFF004000,
-		[0x0B] = 0xFF003C00,
-		[0x0C] = 0xFF00323C,
-		[0x0D] = 0xFF000000,
-		[0x0E] = 0xFF000000,
-		[0x0F] = 0xFF000000,
-		[0x10] = 0xFF989698,
-		[0x11] = 0xFF084CC4,
-		[0x12] = 0xFF3032EC,
-		[0x13] = 0xFF5C1EE4,
-		[0x14] = 0xFF8814B0,
-		[0x15] = 0xFFA01464,
-		[0x16] = 0xFF982220,
-		[0x17] = 0xFF783C00,
-		[0x18] = 0xFF545A00,
-		[0x19] = 0xFF287200,
-		[0x1A] = 0xFF087C00,
-		[0x1B] = 0xFF007628,
-		[0x1C] = 0xFF006678,
-		[0x1D] = 0xFF000000,
-		[0x1E] = 0xFF000000,
-		[0x1F] = 0xFF000000,
-		[0x20] = 0xFFECEEEC,
-		[0x21] = 0xFF4C9AEC,
-		[0x22] = 0xFF787CEC,
-		[0x23] = 0xFFB062EC,
-		[0x24] = 0xFFE454EC,
-		[0x25] = 0xFFEC58B4,
-		[0x26] = 0xFFEC6A64,
-		[0x27] = 0xFFD48820,
-		[0x28] = 0xFFA0AA00,
-		[0x29] = 0xFF74C400,
-		[0x2A] = 0xFF4CD020,
-		[0x2B] = 0xFF38CC6C,
-		[0x2C] = 0xFF38B4CC,
-		[0x2D] = 0xFF3C3C3C,
-		[0x2E] = 0xFF000000,
-		[0x2F] = 0xFF000000,
-		[0x30] = 0xFFECEEEC,
-		[0x31] = 0xFFA8CCEC,
-		[0x32] = 0xFFBCBCEC,
-		[0x33] = 0xFFD4B2EC,
-		[0x34] = 0xFFECAEEC,
-		[0x35] = 0xFFECAED4,
-		[0x36] = 0xFFECB4B0,
-		[0x37] = 0xFFE4C490,
-		[0x38] = 0xFFCCD278,
-		[0x39] = 0xFFB4DE78,
-		[0x3A] = 0xFFA8E290,
-		[0x3B] = 0xFF98E2B4,
-		[0x3C] = 0xFFA0D6E4,
-		[0x3D] = 0xFFA0A2A0,
-		[0x3E] = 0xFF000000,
-		[0x3F] = 0xFF000000,
-	};
-	for (int32_t i = x * SCALE; i < x * SCALE + SCALE; ++i) {
-		for (int32_t j = y * SCALE; j < y * SCALE + SCALE; ++j) {
-			wayland->back_data[i + (j * wayland->width)] =
-				palette[c];
+
+	if (atomic_load(&wayland->is_hud_visible)) {
+		wayland->frame_ready_nsec = pacing_now(&wayland->pacing);
+	}
+
+	/* The whole surface changes size */
+	if (wayland->pending_window_width != 0
+	    && resize_wayland(wayland) == 0) {
+		for (int32_t y = 0; y < 240; ++y) {
+			wayland->is_line_damaged[y] = true;
 		}
 	}
-}
 
-#include <time.h>
-static struct timespec tv_prev = {
-	.tv_sec = 0,
-	.tv_nsec = 0,
-};
-// static int frame_count = 0;
+	for (int32_t y = 0; y < 240; ++y) {
+		if (is_line_changed[y]) {
+			++wayland->line_version[y];
+			wayland->is_line_damaged[y] = true;
+		}
+	}
 
-static int32_t nano_elapsed(struct timespec *start, struct timespec *end)
-{
-	uint32_t ret;
-	if ((end->tv_nsec - start->tv_nsec) < 0) {
-		ret = (end->tv_sec - start->tv_sec - 1) * 1000000000;
-		ret += end->tv_nsec - start->tv_nsec + 1000000000;
+	if (atomic_load(&wayland->is_occluded)) {
+		return;
+	}
+
+	/* Rather than wait on the compositor the frame is dropped, its
+	   damage carries over to the next one */
+	if (wayland->back == NULL) {
+		wayland->back = free_buffer(wayland);
 	}
-	else {
-		ret = (end->tv_sec - start->tv_sec) * 1000000000;
-		ret += end->tv_nsec - start->tv_nsec;
+	if (wayland->back == NULL) {
+		++wayland->no_free_buffer_count;
+		return;
+	}
+
+	struct wayland_buffer *back = wayland->back;
+	for (int32_t y = 0; y < 240; ++y) {
+		if (back->line_version[y] != wayland->line_version[y]) {
+			scale_line_kernel(wayland->scale_kernel, back->data
+			                  + y * wayland->scale * wayland->width,
+			                  wayland->width, frame + y * 256,
+			                  PALETTE, wayland->scale);
+			back->line_version[y] = wayland->line_version[y];
+		}
+	}
+}
+
+/* One damage rectangle per run of damaged lines, in surface coordinates
+   which differ from the buffer's under a viewport */
+static void damage_lines(struct wayland *wayland)
+{
+	int32_t start = -1;
+	for (int32_t y = 0; y <= 240; ++y) {
+		bool is_damaged = y < 240 && wayland->is_line_damaged[y];
+		if (is_damaged && start < 0) {
+			start = y;
+		}
+		else if (!is_damaged && start >= 0) {
+			int32_t top = start * wayland->window_height / 240;
+			int32_t bottom = (y * wayland->window_height + 239) / 240;
+			wl_surface_damage(wayland->surface,
+			                  0, top,
+			                  wayland->window_width, bottom - top);
+			start = -1;
+		}
+		if (y < 240) {
+			wayland->is_line_damaged[y] = false;
+		}
 	}
-	return ret;
 }
 
 static void vertical_blank(void *pointer)
 {
 	struct wayland *wayland = pointer;
 
-	wl_display_roundtrip(wayland->display);
+	dispatch_wayland(wayland, 0);
 
-	struct timespec tv;
-	int32_t nsec_diff;
-	clock_gettime(CLOCK_MONOTONIC, &tv);
-	if (tv_prev.tv_sec == 0 && tv_prev.tv_nsec == 0) {
-		nsec_diff = 0;
-		tv_prev = tv;
+	/* Nothing is committed until the compositor shows the surface and
+	   answers the last frame callback */
+	if (atomic_load(&wayland->is_occluded)) {
+		if (wayland->is_pausing_occluded) {
+			while (!wayland->is_frame_done
+			       && dispatch_wayland(wayland, -1) == 0) {
+			}
+		}
+		if (!wayland->is_frame_done) {
+			pacing_sleep(&wayland->pacing);
+			return;
+		}
+		atomic_store(&wayland->is_occluded, false);
 	}
-	else {
-		nsec_diff = nano_elapsed(&tv_prev, &tv);
-		tv_prev = tv;
-
-		// assert(sec_diff == 0);
-
-		cairo_surface_t *cairo_surface =
-			cairo_image_surface_create_for_data(
-				(unsigned char *)wayland->back_data,
-				CAIRO_FORMAT_ARGB32,
-				256 * SCALE, 240 * SCALE, 256 * SCALE * 4);
-		cairo_t *cairo = cairo_create(cairo_surface);
-		char buffer[200];
-		double fps = 1000000000.0 / ((double) nsec_diff);
-		sprintf(buffer, "FPS %.1f", fps);
-		cairo_set_source_rgba(cairo, 255, 255, 255, 0.8);
-		cairo_select_font_face(cairo, "Cousine",
-			CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
-		cairo_set_font_size(cairo, 12 * SCALE);
-		cairo_move_to(cairo, 2 * SCALE, 236 * SCALE);
-		cairo_show_text(cairo, buffer);
-		cairo_destroy(cairo);
-		cairo_surface_destroy(cairo_surface);
-		// ++frame_count;
+
+	struct wayland_buffer *back = wayland->back;
+	bool is_hud_visible = atomic_load(&wayland->is_hud_visible);
+	if (!is_hud_visible && wayland->was_hud_visible) {
+		/* The back buffer already has the frame under the panel, it
+		   only needs to reach the screen */
+		for (int32_t y = 0; y < wayland->hud.lines; ++y) {
+			wayland->is_line_damaged[y] = true;
+		}
 	}
+	wayland->was_hud_visible = is_hud_visible;
 
-	swap_buffers(wayland);
+	if (back != NULL && is_hud_visible) {
+		if (wayland->pacing.interval != 0) {
+			hud_record(&wayland->hud, wayland->pacing.interval);
+		}
+		struct hud_stats stats = {
+			.frame = wayland->frame_stats,
+			.interval = wayland->pacing.interval,
+			.present_nsec = wayland->present_nsec,
+			.dropped = wayland->no_free_buffer_count
+			           + wayland->discarded_count,
+			.duplicated = wayland->pacing.duplicated,
+		};
+		stats.has_latency = latency_percentiles(&wayland->latency,
+		                                        &stats.latency_p50,
+		                                        &stats.latency_p90,
+		                                        &stats.latency_p99);
+		if (hud_draw(&wayland->hud, back->data, wayland->width,
+		             wayland->scale, &stats) == 0) {
+			/* Drawn over, so the buffer needs the frame again for
+			   these lines */
+			for (int32_t y = 0; y < wayland->hud.lines; ++y) {
+				back->line_version[y] = 0;
+				wayland->is_line_damaged[y] = true;
+			}
+		}
+	}
 
-	wayland->frame_callback = wl_surface_frame(wayland->surface);
-	wl_callback_add_listener(wayland->frame_callback,
-	                         &frame_callback_listener, wayland);
+	if (back != NULL) {
+		wayland->frame_callback = wl_surface_frame(wayland->surface);
+		wl_callback_add_listener(wayland->frame_callback,
+		                         &frame_callback_listener, wayland);
+		wayland->is_frame_done = false;
+		if (wayland->presentation != NULL) {
+			struct wp_presentation_feedback *feedback =
+				wp_presentation_feedback(wayland->presentation,
+				                         wayland->surface);
+			wp_presentation_feedback_add_listener(
+				feedback, &presentation_feedback_listener,
+				wayland);
+		}
 
-	wl_surface_damage(wayland->surface, 0, 0,
-	                  wayland->width, wayland->height);
-	wl_surface_attach(wayland->surface, wayland->front_buffer, 0, 0);
-	wl_surface_commit(wayland->surface);
+		damage_lines(wayland);
+		wl_surface_attach(wayland->surface, back->buffer, 0, 0);
+		wl_surface_commit(wayland->surface);
+		latency_commit(&wayland->latency,
+		               wayland->presentation != NULL);
+		back->is_busy = true;
+		wayland->back = NULL;
 
-	wl_display_flush(wayland->display);
+		wl_display_flush(wayland->display);
 
-	const int32_t NSEC_PER_60FPS_TICK = 16666666;
-	if (nsec_diff != 0) {
-		struct timespec req = {
-			.tv_sec = 0,
-			.tv_nsec = NSEC_PER_60FPS_TICK - nsec_diff,
-		};
-		struct timespec rem;
-		nanosleep(&req, &rem);
+		if (is_hud_visible) {
+			wayland->present_nsec = pacing_now(&wayland->pacing)
+			                        - wayland->frame_ready_nsec;
+		}
+
+		if (wayland->pacing.mode == PACING_MODE_FRAME_CALLBACK) {
+			while (!wayland->is_frame_done) {
+				int64_t timeout = wayland->frame_done_nsec
+				                  + OCCLUSION_NSEC
+				                  - pacing_now(&wayland->pacing);
+				if (timeout <= 0
+				    || dispatch_wayland(wayland,
+				                        timeout / 1000000 + 1) != 0) {
+					break;
+				}
+			}
+		}
 	}
+
+	if (!wayland->is_frame_done
+	    && pacing_now(&wayland->pacing) - wayland->frame_done_nsec
+	       > OCCLUSION_NSEC) {
+		atomic_store(&wayland->is_occluded, true);
+		pacing_sleep(&wayland->pacing);
+		return;
+	}
+
+	pacing_wait(&wayland->pacing);
 }
 
-static uint8_t joypad1_read(void *pointer)
+static bool is_occluded(void *pointer)
 {
 	struct wayland *wayland = pointer;
+	return atomic_load(&wayland->is_occluded);
+}
 
-	wl_display_roundtrip(wayland->display);
+static bool is_rewinding(void *pointer)
+{
+	struct wayland *wayland = pointer;
+	return atomic_load(&wayland->is_rewinding);
+}
 
-	uint8_t state = wayland->joypad1_state;
-	wayland->joypad1_state = wayland->joypad1_press;
+static bool is_profiling(void *pointer)
+{
+	struct wayland *wayland = pointer;
+	return atomic_load(&wayland->is_hud_visible);
+}
 
-	return state;
+static int64_t joypad1_timestamp(void *pointer)
+{
+	struct wayland *wayland = pointer;
+	return atomic_load(&wayland->joypad1_timestamp);
+}
+
+static uint8_t joypad1_read(void *pointer)
+{
+	struct wayland *wayland = pointer;
+
+	/* Latches the held buttons for the next read */
+	uint_fast16_t joypad1 = atomic_load(&wayland->joypad1);
+	uint_fast16_t held;
+	do {
+		held = joypad1 & 0xFF;
+	} while (!atomic_compare_exchange_weak(&wayland->joypad1, &joypad1,
+	                                       held | held << 8));
+
+	return joypad1 >> 8;
 }
 
 uint8_t nes_emulator_ppu_backend_wayland_init(
-	struct nes_emulator_ppu_backend **ppu_backend)
+	struct nes_emulator_ppu_backend **ppu_backend,
+	uint8_t scale,
+	enum pacing_mode pacing_mode,
+	bool is_pacing_spinning,
+	bool is_hud_visible,
+	bool is_pausing_occluded,
+	const char *latency_log_path)
 {
 	if (ppu_backend == NULL) {
 		return EXIT_CODE_ARG_ERROR_BIT;
 	}
 	*ppu_backend = NULL;
+	if (scale < 1 || scale > SCALE_MAX) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
 
 	struct nes_emulator_ppu_backend *b =
 		malloc(sizeof(struct nes_emulator_ppu_backend));
@@ -232,20 +370,71 @@ uint8_t nes_emulator_ppu_backend_wayland_init(
 		free(b);
 		return EXIT_CODE_OS_ERROR_BIT;
 	}
-	w->joypad1_state = 0;
-	w->joypad1_press = 0;
+	atomic_init(&w->joypad1, 0);
+	atomic_init(&w->joypad1_timestamp, 0);
+	w->latency_log = NULL;
+	if (latency_log_path != NULL) {
+		w->latency_log = fopen(latency_log_path, "w");
+		if (w->latency_log == NULL) {
+			free(w);
+			free(b);
+			return EXIT_CODE_OS_ERROR_BIT;
+		}
+	}
+	latency_init(&w->latency, w->latency_log);
+	atomic_init(&w->is_hud_visible, is_hud_visible);
+	w->was_hud_visible = is_hud_visible;
+	hud_init(&w->hud);
+	memset(&w->frame_stats, 0, sizeof(w->frame_stats));
+	w->frame_ready_nsec = 0;
+	w->present_nsec = 0;
+	atomic_init(&w->is_occluded, false);
+	atomic_init(&w->is_rewinding, false);
+	w->is_pausing_occluded = is_pausing_occluded;
+	for (int32_t y = 0; y < 240; ++y) {
+		w->line_version[y] = 1;
+		w->is_line_damaged[y] = false;
+	}
 
-	uint8_t exit_code = init_wayland(w);
+	pacing_init(&w->pacing, pacing_mode, is_pacing_spinning);
+
+	uint8_t exit_code = init_wayland(w, scale);
 	if (exit_code != 0) {
+		if (w->latency_log != NULL) {
+			fclose(w->latency_log);
+		}
+		free(w);
+		free(b);
+		return exit_code;
+	}
+	if (pacing_mode == PACING_MODE_PRESENTATION
+	    && w->presentation == NULL) {
+		w->pacing.mode = PACING_MODE_DEADLINE;
+	}
+	w->frame_done_nsec = pacing_now(&w->pacing);
+
+	exit_code = start_wayland_event_thread(w);
+	if (exit_code != 0) {
+		exit_code |= fini_wayland(w);
+		if (w->latency_log != NULL) {
+			fclose(w->latency_log);
+		}
 		free(w);
 		free(b);
 		return exit_code;
 	}
 
 	b->pointer = w;
-	b->render_pixel = render_pixel;
+	b->render_pixel = NULL;
 	b->vertical_blank = vertical_blank;
 	b->joypad1_read = joypad1_read;
+	b->joypad1_timestamp = joypad1_timestamp;
+	b->scanline_ready = NULL;
+	b->frame_ready = frame_ready;
+	b->frame_stats = frame_stats;
+	b->is_occluded = is_occluded;
+	b->is_rewinding = is_rewinding;
+	b->is_profiling = is_profiling;
 	*ppu_backend = b;
 	return 0;
 }
@@ -255,7 +444,13 @@ uint8_t nes_emulator_ppu_backend_wayland_fini(
 {
 	uint8_t exit_code = 0;
 	struct wayland *wayland = (struct wayland *) (*ppu_backend)->pointer;
+	exit_code |= stop_wayland_event_thread(wayland);
 	exit_code |= fini_wayland(wayland);
+	hud_fini(&wayland->hud);
+	latency_fini(&wayland->latency);
+	if (wayland->latency_log != NULL && fclose(wayland->latency_log) != 0) {
+		exit_code |= EXIT_CODE_OS_ERROR_BIT;
+	}
 	free(wayland);
 	free(*ppu_backend);
 	*ppu_backend = NULL;
@@ -20,11 +20,33 @@
 extern "C" {
 #endif
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 #include <wayland-client-protocol.h>
 
+#include "presentation-time-client-protocol.h"
+#include "viewporter-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
 
-#define SCALE 2
+#include "hud.h"
+#include "latency.h"
+#include "pacing.h"
+#include "scale.h"
+
+#define WAYLAND_BUFFERS 3
+
+/* A buffer is busy from its commit until the compositor releases it.
+   Each line's version says which version of it the buffer holds (0 for
+   none), so a buffer only converts the lines it is missing. */
+struct wayland_buffer {
+	struct wl_buffer *buffer;
+	uint32_t *data;
+	bool is_busy;
+	uint32_t line_version[240];
+};
 
 struct wayland {
 	struct wl_display *display;
@@ -35,28 +57,85 @@ struct wayland {
 	struct wl_surface *surface;
 	struct zxdg_surface_v6 *shell_surface;
 	struct zxdg_toplevel_v6 *toplevel;
+	/* Optional, with it buffers stay 256x240 and the compositor scales
+	   them to the window */
+	struct wp_viewporter *viewporter;
+	struct wp_viewport *viewport;
+	/* The window size, the buffer size, and how many buffer pixels each
+	   side of a NES pixel takes */
+	int32_t window_width;
+	int32_t window_height;
 	int32_t width;
 	int32_t height;
+	uint8_t scale;
+	enum scale_kernel scale_kernel;
+	/* Set by the toplevel configure, applied before the next frame */
+	int32_t pending_window_width;
+	int32_t pending_window_height;
 	int32_t fd;
 	uint32_t *data;
 	size_t capacity;
-	uint32_t *front_data;
-	uint32_t *back_data;
 	struct wl_shm_pool *shm_pool;
-	struct wl_buffer *front_buffer;
-	struct wl_buffer *back_buffer;
+	struct wayland_buffer buffers[WAYLAND_BUFFERS];
+	/* The buffer the current frame goes into, NULL until one is free */
+	struct wayland_buffer *back;
+	uint64_t no_free_buffer_count;
+	uint64_t discarded_count;
 	struct wl_callback *frame_callback;
+	bool is_frame_done;
+	int64_t frame_done_nsec;
+	/* Set once frame callbacks stop for a while, cleared by the next
+	   one. Read by the emulating thread when the render thread calls
+	   the backend. */
+	atomic_bool is_occluded;
+	bool is_pausing_occluded;
+
+	/* Optional, for presentation feedback */
+	struct wp_presentation *presentation;
+	struct pacing pacing;
+
+	/* Each line's version goes up when it changes */
+	uint32_t line_version[240];
+	bool is_line_damaged[240];
+
+	/* Toggled by F1 from the event thread, nothing is measured or drawn
+	   while hidden */
+	atomic_bool is_hud_visible;
+	bool was_hud_visible;
+	struct hud hud;
+	struct nes_emulator_frame_stats frame_stats;
+	int64_t frame_ready_nsec;
+	int64_t present_nsec;
+
+	struct latency latency;
+	FILE *latency_log;
+
+	/* Backspace held, from the event thread */
+	atomic_bool is_rewinding;
 
 	struct wl_seat *seat;
 	struct wl_keyboard *keyboard;
-	uint8_t joypad1_press;
-	uint8_t joypad1_state;
+	/* Held buttons in the low byte, buttons pressed since the last read
+	   in the high byte */
+	atomic_uint_fast16_t joypad1;
+	/* When a key last changed joypad1, on CLOCK_MONOTONIC */
+	atomic_int_fast64_t joypad1_timestamp;
+
+	/* Dispatches the keyboard's queue */
+	pthread_t event_thread;
+	struct wl_event_queue *input_queue;
+	int event_thread_stop_fd;
 };
 
-uint8_t init_wayland(struct wayland *wayland);
+uint8_t init_wayland(struct wayland *wayland, uint8_t scale);
 uint8_t fini_wayland(struct wayland *wayland);
+uint8_t resize_wayland(struct wayland *wayland);
+uint8_t start_wayland_event_thread(struct wayland *wayland);
+uint8_t stop_wayland_event_thread(struct wayland *wayland);
+uint8_t dispatch_wayland(struct wayland *wayland, int timeout);
 
-struct wl_callback_listener frame_callback_listener;
+extern struct wl_callback_listener frame_callback_listener;
+extern struct wp_presentation_feedback_listener presentation_feedback_listener;
 
 #ifdef __cplusplus
 }
@@ -27,6 +27,16 @@ static const uint16_t HEADER_SIZE = 16;               /* 16 B */
 static const uint16_t PRG_ROM_SIZE_PER_UNIT = 0x4000; /* 16 KiB */
 static const uint16_t CHR_ROM_SIZE_PER_UNIT = 0x2000; /*  8 KiB */
 
+static uint64_t hash(const uint8_t *data, size_t size)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; ++i) {
+		h ^= data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
 uint8_t nes_emulator_cartridge_init(struct nes_emulator_cartridge **cartridge,
                                     uint8_t *data,
                                     size_t size)
@@ -77,12 +87,20 @@ uint8_t nes_emulator_cartridge_init(struct nes_emulator_cartridge **cartridge,
 		c->prg_rom_bank_2 = data + HEADER_SIZE + PRG_ROM_SIZE_PER_UNIT;
 	}
 
-	/* TODO: Assume horizontal arrangement / vertical mirroring */
-	uint8_t mirroring = data[6];
-	if ((mirroring != 0) && (mirroring != 1)) {
+	/* Flags 6: mirroring (bit 0) and four-screen VRAM (bit 3) */
+	uint8_t flags = data[6];
+	if ((flags & ~0x09) != 0) {
 		return EXIT_CODE_UNIMPLEMENTED_BIT;
 	}
-	c->mirroring = mirroring;
+	if (flags & 0x08) {
+		c->mirroring = CARTRIDGE_MIRRORING_FOUR_SCREEN;
+	}
+	else if (flags & 0x01) {
+		c->mirroring = CARTRIDGE_MIRRORING_VERTICAL;
+	}
+	else {
+		c->mirroring = CARTRIDGE_MIRRORING_HORIZONTAL;
+	}
 
 	if (chr_rom_units == 1) {
 		c->chr_rom = data + HEADER_SIZE
@@ -90,12 +108,13 @@ uint8_t nes_emulator_cartridge_init(struct nes_emulator_cartridge **cartridge,
 		c->owns_chr_rom = false;
 	}
 	else {
-		c->chr_rom = malloc(CHR_ROM_SIZE_PER_UNIT);
+		c->chr_rom = calloc(1, CHR_ROM_SIZE_PER_UNIT);
 		c->owns_chr_rom = true;
 		if (c->chr_rom == NULL) {
 			return EXIT_CODE_OS_ERROR_BIT;
 		}
 	}
+	c->hash = hash(data + HEADER_SIZE, size - HEADER_SIZE);
 
 	*cartridge = c;
 	return 0;
@@ -132,22 +151,3 @@ void cartridge_cpu_bus_write(struct nes_emulator_console *console,
 	(void) address;
 	(void) value;
 }
-
-uint8_t cartridge_ppu_bus_read(struct nes_emulator_console *console,
-                               uint16_t address)
-{
-	if (console->cartridge->chr_rom == NULL) {
-		return 0;
-	}
-	return console->cartridge->chr_rom[address];
-}
-
-void cartridge_ppu_bus_write(struct nes_emulator_console *console,
-                             uint16_t address,
-                             uint8_t value)
-{
-	if (console->cartridge->chr_rom == NULL) {
-		return;
-	}
-	console->cartridge->chr_rom[address] = value;
-}
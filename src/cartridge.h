@@ -25,12 +25,26 @@ extern "C" {
 
 struct nes_emulator_console;
 
+#define CARTRIDGE_CHR_SIZE  0x2000 /* 8 KiB */
+#define CARTRIDGE_VRAM_SIZE 0x0800 /* 2 KiB */
+
+enum cartridge_mirroring {
+	CARTRIDGE_MIRRORING_HORIZONTAL,
+	CARTRIDGE_MIRRORING_VERTICAL,
+	CARTRIDGE_MIRRORING_SINGLE_SCREEN_LOWER,
+	CARTRIDGE_MIRRORING_SINGLE_SCREEN_UPPER,
+	CARTRIDGE_MIRRORING_FOUR_SCREEN,
+};
+
 struct nes_emulator_cartridge {
 	uint8_t *chr_rom;
 	uint8_t *prg_rom_bank_1;
 	uint8_t *prg_rom_bank_2;
 	uint8_t mirroring;
 	bool owns_chr_rom;
+
+	/* FNV-1a of the PRG and CHR ROM, to match states to the game */
+	uint64_t hash;
 };
 
 uint8_t cartridge_cpu_bus_read(struct nes_emulator_console *console,
@@ -38,11 +52,6 @@ uint8_t cartridge_cpu_bus_read(struct nes_emulator_console *console,
 void cartridge_cpu_bus_write(struct nes_emulator_console *console,
                              uint16_t address,
                              uint8_t value);
-uint8_t cartridge_ppu_bus_read(struct nes_emulator_console *console,
-                               uint16_t address);
-void cartridge_ppu_bus_write(struct nes_emulator_console *console,
-                             uint16_t address,
-                             uint8_t value);
 
 #ifdef __cpluscplus
 }
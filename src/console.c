@@ -17,8 +17,28 @@
 #include "console.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "exit_code.h"
+#include "movie.h"
+#include "render_thread.h"
+#include "rewind.h"
+#include "snapshot.h"
+#include "speculation.h"
+
+/* The cheapest of a few back to back reads */
+static uint64_t measure_clock_nsec(void)
+{
+	uint64_t clock_nsec = UINT64_MAX;
+	for (int i = 0; i < 1000; ++i) {
+		uint64_t start = ppu_now_nsec();
+		uint64_t nsec = ppu_now_nsec() - start;
+		if (nsec < clock_nsec) {
+			clock_nsec = nsec;
+		}
+	}
+	return clock_nsec;
+}
 
 uint8_t nes_emulator_console_init(struct nes_emulator_console **console)
 {
@@ -33,6 +53,29 @@ uint8_t nes_emulator_console_init(struct nes_emulator_console **console)
 	cpu_init(c);
 	ppu_init(c);
 	apu_init(c);
+	memset(c->chr, 0, sizeof(c->chr));
+	memset(c->vram, 0, sizeof(c->vram));
+
+	c->frame_cpu_instructions = 0;
+	c->frame_input_nsec = 0;
+	c->is_profiling = false;
+	c->is_profiling_requested = false;
+	c->profile_steps = PROFILE_SAMPLE_STEPS;
+	c->profile_random = 1;
+	c->profile_cpu_nsec = 0;
+	c->profile_ppu_nsec = 0;
+	c->profile_ppu_start_nsec = 0;
+	c->profile_clock_nsec = measure_clock_nsec();
+
+	c->run_ahead_frames = 0;
+	c->is_running_ahead = false;
+	c->run_ahead_buttons = 0;
+	c->run_ahead_snapshot = NULL;
+	c->speculation = NULL;
+	c->is_frame_input_read = false;
+	c->is_frame_input_mixed = false;
+	c->rewind = NULL;
+	c->movie = NULL;
 
 	c->controller = NULL;
 	c->cartridge = NULL;
@@ -46,17 +89,66 @@ void nes_emulator_console_insert_cartridge(
 	struct nes_emulator_cartridge *cartridge)
 {
 	console->cartridge = cartridge;
+	memcpy(console->chr, cartridge->chr_rom, CARTRIDGE_CHR_SIZE);
+	memset(console->vram, 0, sizeof(console->vram));
+	ppu_update_pages(console);
 	cpu_reset(console);
 }
 
-uint8_t nes_emulator_console_step(struct nes_emulator_console *console)
+/* Steps to the next timed one, 1 to twice the mean less one */
+static uint32_t next_profile_steps(struct nes_emulator_console *console)
+{
+	/* xorshift32 */
+	uint32_t x = console->profile_random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	console->profile_random = x;
+	return 1 + x % (2 * PROFILE_SAMPLE_STEPS - 1);
+}
+
+/* Timing every step would cost more than the step, so only a sample of
+   them is timed. A vertical blank moves the PPU start past the backends. */
+static uint8_t profiled_step(struct nes_emulator_console *console)
+{
+	uint64_t start = ppu_now_nsec();
+	uint8_t exit_code = cpu_step(console);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+	++console->frame_cpu_instructions;
+	console->profile_ppu_start_nsec = ppu_now_nsec();
+	uint64_t cpu_nsec = console->profile_ppu_start_nsec - start;
+
+	exit_code = ppu_step(console);
+	uint64_t ppu_nsec = ppu_now_nsec() - console->profile_ppu_start_nsec;
+
+	uint64_t clock_nsec = console->profile_clock_nsec;
+	console->profile_cpu_nsec += cpu_nsec > clock_nsec
+	                             ? cpu_nsec - clock_nsec : 0;
+	console->profile_ppu_nsec += ppu_nsec > clock_nsec
+	                             ? ppu_nsec - clock_nsec : 0;
+	return exit_code;
+}
+
+static uint8_t step(struct nes_emulator_console *console)
 {
 	uint8_t exit_code;
 
+	if (console->ppu.is_occluded != console->ppu.is_render_suspended) {
+		ppu_update_occlusion(console);
+	}
+
+	if (console->is_profiling && --console->profile_steps == 0) {
+		console->profile_steps = next_profile_steps(console);
+		return profiled_step(console);
+	}
+
 	exit_code = cpu_step(console);
 	if (exit_code != 0) {
 		return exit_code;
 	}
+	++console->frame_cpu_instructions;
 
 	exit_code = ppu_step(console);
 	if (exit_code != 0) {
@@ -66,9 +158,239 @@ uint8_t nes_emulator_console_step(struct nes_emulator_console *console)
 	return 0;
 }
 
+uint8_t console_run_frames(struct nes_emulator_console *console,
+                           uint8_t frames)
+{
+	uint8_t exit_code = 0;
+	uint32_t end = console->ppu.vertical_blanks + frames;
+	while (exit_code == 0 && console->ppu.vertical_blanks != end) {
+		console->ppu.is_render_skipped =
+			end - console->ppu.vertical_blanks > 1;
+		exit_code = step(console);
+	}
+	return exit_code;
+}
+
+/* Runs from the vertical blank that ended a frame to the one ending the
+   frame shown, then restores the snapshot. The frames ahead are not
+   counted, the shown frame carries the stats of the last counted one with
+   the time spent ahead as its render time. */
+static uint8_t run_ahead(struct nes_emulator_console *console)
+{
+	snapshot_save(console, console->run_ahead_snapshot);
+	uint32_t frame_cpu_instructions = console->frame_cpu_instructions;
+	int64_t frame_input_nsec = console->frame_input_nsec;
+	uint64_t profile_cpu_nsec = console->profile_cpu_nsec;
+	uint64_t profile_ppu_nsec = console->profile_ppu_nsec;
+
+	console->is_running_ahead = true;
+	console->run_ahead_buttons = console->cpu.controller_status;
+	console->ppu.is_replaying = true;
+	console->ppu.frame_start_nsec = ppu_now_nsec();
+
+	uint8_t exit_code = console_run_frames(console,
+	                                       console->run_ahead_frames);
+
+	snapshot_load(console, console->run_ahead_snapshot);
+	console->frame_cpu_instructions = frame_cpu_instructions;
+	console->frame_input_nsec = frame_input_nsec;
+	console->profile_cpu_nsec = profile_cpu_nsec;
+	console->profile_ppu_nsec = profile_ppu_nsec;
+
+	console->is_running_ahead = false;
+	console->ppu.is_replaying = false;
+	console->ppu.is_render_skipped = true;
+	return exit_code;
+}
+
+/* A branch that guessed the input replaces running ahead here */
+static uint8_t show_frame_ahead(struct nes_emulator_console *console)
+{
+	uint8_t exit_code = 0;
+	if (console->speculation == NULL || !speculation_join(console)) {
+		exit_code = run_ahead(console);
+	}
+	if (console->speculation != NULL && exit_code == 0) {
+		speculation_fork(console);
+	}
+	console->is_frame_input_read = false;
+	console->is_frame_input_mixed = false;
+
+	console->ppu.frame_start_nsec = ppu_now_nsec();
+	console->profile_ppu_start_nsec = console->ppu.frame_start_nsec;
+	return exit_code;
+}
+
+uint8_t nes_emulator_console_step(struct nes_emulator_console *console)
+{
+	if (console->run_ahead_frames == 0 && console->rewind == NULL
+	    && console->movie == NULL) {
+		return step(console);
+	}
+
+	uint32_t vertical_blanks = console->ppu.vertical_blanks;
+	uint8_t exit_code = step(console);
+	if (exit_code != 0 || console->ppu.vertical_blanks == vertical_blanks) {
+		return exit_code;
+	}
+	if (console->movie != NULL) {
+		exit_code = movie_frame(console);
+		if (exit_code != 0) {
+			return exit_code;
+		}
+	}
+	if (console->rewind != NULL) {
+		rewind_frame(console);
+	}
+	if (console->run_ahead_frames == 0) {
+		return 0;
+	}
+	return show_frame_ahead(console);
+}
+
+/* Restoring a snapshot would leave the render thread replaying frames
+   from a state that is gone */
+static bool is_render_thread_requested(struct nes_emulator_console *console)
+{
+	return console->ppu.requested_render_mode
+	       == NES_EMULATOR_RENDER_MODE_DEFERRED
+	       || console->ppu.requested_render_mode
+	       == NES_EMULATOR_RENDER_MODE_PARALLEL;
+}
+
+uint8_t nes_emulator_console_set_run_ahead(
+	struct nes_emulator_console *console,
+	uint8_t frames)
+{
+	if (frames > RUN_AHEAD_FRAMES_MAX || console->cartridge == NULL) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+	if (frames != 0 && is_render_thread_requested(console)) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+
+	if (frames != 0 && console->run_ahead_snapshot == NULL) {
+		console->run_ahead_snapshot = malloc(sizeof(struct snapshot));
+		if (console->run_ahead_snapshot == NULL) {
+			return EXIT_CODE_OS_ERROR_BIT;
+		}
+	}
+	if (frames == 0 && console->speculation != NULL) {
+		speculation_stop(console);
+	}
+	console->run_ahead_frames = frames;
+	console->ppu.is_render_skipped = frames != 0;
+	return 0;
+}
+
+uint8_t nes_emulator_console_set_speculation(
+	struct nes_emulator_console *console,
+	uint8_t branches)
+{
+	if (branches > SPECULATION_BRANCHES_MAX
+	    || (branches != 0 && console->run_ahead_frames == 0)) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+
+	if (console->speculation != NULL) {
+		speculation_stop(console);
+	}
+	if (branches == 0) {
+		return 0;
+	}
+	return speculation_start(console, branches);
+}
+
+uint8_t nes_emulator_console_set_rewind(struct nes_emulator_console *console,
+                                        size_t bytes)
+{
+	/* Going back would leave a movie at the wrong frame */
+	if (console->cartridge == NULL
+	    || (bytes != 0 && (is_render_thread_requested(console)
+	                       || console->movie != NULL))) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+
+	if (console->rewind != NULL) {
+		rewind_stop(console);
+	}
+	if (bytes == 0) {
+		return 0;
+	}
+	return rewind_start(console, bytes);
+}
+
+void console_reset(struct nes_emulator_console *console)
+{
+	if (console->speculation != NULL) {
+		speculation_cancel(console);
+	}
+	cpu_reset(console);
+}
+
+void nes_emulator_console_reset(struct nes_emulator_console *console)
+{
+	if (console->movie != NULL) {
+		movie_reset(console);
+		return;
+	}
+	console_reset(console);
+}
+
+uint8_t nes_emulator_console_seek_movie(struct nes_emulator_console *console,
+                                        uint64_t frame)
+{
+	if (console->movie == NULL) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+	uint64_t replay_frames;
+	uint8_t exit_code = movie_seek(console, frame, &replay_frames);
+
+	console->ppu.is_render_skipped = true;
+	while (exit_code == 0 && replay_frames != 0) {
+		uint32_t vertical_blanks = console->ppu.vertical_blanks;
+		exit_code = step(console);
+		if (exit_code == 0
+		    && console->ppu.vertical_blanks != vertical_blanks) {
+			exit_code = movie_frame(console);
+			--replay_frames;
+		}
+	}
+	console->ppu.is_render_skipped = console->run_ahead_frames != 0;
+	return exit_code;
+}
+
+uint64_t nes_emulator_console_frames(struct nes_emulator_console *console)
+{
+	return console->ppu.frame_stats.frame;
+}
+
+void nes_emulator_console_set_profiling(struct nes_emulator_console *console,
+                                        bool is_profiling)
+{
+	console->is_profiling_requested = is_profiling;
+	console->is_profiling = is_profiling;
+	console->profile_steps = PROFILE_SAMPLE_STEPS;
+	console->profile_cpu_nsec = 0;
+	console->profile_ppu_nsec = 0;
+}
+
 void nes_emulator_console_fini(struct nes_emulator_console **console)
 {
 	if (*console != NULL) {
+		if ((*console)->ppu.render_thread != NULL) {
+			render_thread_stop(*console);
+		}
+		if ((*console)->speculation != NULL) {
+			speculation_stop(*console);
+		}
+		if ((*console)->rewind != NULL) {
+			rewind_stop(*console);
+		}
+		if ((*console)->movie != NULL) {
+			movie_stop(*console);
+		}
+		free((*console)->run_ahead_snapshot);
 		free(*console);
 	}
 	*console = NULL;
@@ -20,23 +20,96 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+#include <string.h>
+
 #include "apu.h"
+#include "cartridge.h"
 #include "cpu.h"
 #include "ppu.h"
 #include "controller.h"
 
+#define PROFILE_SAMPLE_STEPS 32
+#define RUN_AHEAD_FRAMES_MAX 4
+
+struct movie;
+struct rewind;
+struct snapshot;
+struct speculation;
+
 struct nes_emulator_console {
+	/* Emulation state, everything from here up to ppu.pages */
 	struct cpu cpu;
 	uint16_t cpu_step_cycles;
-
-	struct ppu ppu;
 	struct apu apu;
+	/* The cartridge's CHR, copied in when it is inserted since writes
+	   reach it even as ROM, and its extra nametables for four-screen */
+	uint8_t chr[CARTRIDGE_CHR_SIZE];
+	uint8_t vram[CARTRIDGE_VRAM_SIZE];
+	struct ppu ppu;
+
+	uint32_t frame_cpu_instructions;
+	/* The first new input the game read this frame, 0 for none */
+	int64_t frame_input_nsec;
+
+	/* One step in PROFILE_SAMPLE_STEPS is timed on average, at random
+	   so the samples do not follow the game's loops, the sums are for
+	   the current frame. Set from each vertical blank while requested or
+	   a backend asks for it. */
+	bool is_profiling;
+	bool is_profiling_requested;
+	uint32_t profile_steps;
+	uint32_t profile_random;
+	uint64_t profile_cpu_nsec;
+	uint64_t profile_ppu_nsec;
+	uint64_t profile_ppu_start_nsec;
+	/* What reading the clock adds to each timed part */
+	uint64_t profile_clock_nsec;
+
+	/* Each frame is emulated without rendering, then the console runs
+	   run_ahead_frames more with the same input, shows the last and goes
+	   back to the snapshot */
+	uint8_t run_ahead_frames;
+	bool is_running_ahead;
+	uint8_t run_ahead_buttons;
+	struct snapshot *run_ahead_snapshot;
+	/* Branches forked at each vertical blank to run ahead of the next
+	   frame, which needs to know whether its reads all saw one input */
+	struct speculation *speculation;
+	bool is_frame_input_read;
+	bool is_frame_input_mixed;
+
+	/* Every frame's state, recorded on a helper thread */
+	struct rewind *rewind;
+	/* Recording or playing each frame's input */
+	struct movie *movie;
 
 	struct nes_emulator_controller_backend *controller;
 
 	struct nes_emulator_cartridge *cartridge;
 };
 
+/* The emulation state at the start of the console, without pointers, so
+   saving or restoring it is one copy */
+#define CONSOLE_STATE_SIZE (offsetof(struct nes_emulator_console, ppu) \
+                            + offsetof(struct ppu, pages))
+
+/* Reads a field out of a copy of the state, which need not be aligned */
+#define CONSOLE_STATE_READ(value, state, field) \
+	memcpy(&(value), \
+	       (state) + offsetof(struct nes_emulator_console, field), \
+	       sizeof(value))
+/* A bool holding anything but 0 or 1 is undefined to read */
+#define CONSOLE_STATE_IS_BOOL(state, field) \
+	((state)[offsetof(struct nes_emulator_console, field)] <= 1)
+
+/* Steps until frames more vertical blanks start, rendering only the last
+   frame */
+uint8_t console_run_frames(struct nes_emulator_console *console,
+                           uint8_t frames);
+/* Also drops branches forked before it, which ran ahead without it */
+void console_reset(struct nes_emulator_console *console);
+
 #ifdef __cpluscplus
 }
 #endif
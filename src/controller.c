@@ -17,6 +17,7 @@
 #include "controller.h"
 
 #include "console.h"
+#include "movie.h"
 
 void nes_emulator_console_add_controller_backend(
 	struct nes_emulator_console *console,
@@ -27,21 +28,71 @@ void nes_emulator_console_add_controller_backend(
 	}
 }
 
-uint8_t controller_read(struct nes_emulator_console *console)
+/* Buttons that were not down at the previous read are new input, the
+   frame records when it happened */
+static uint8_t read_backends(struct nes_emulator_console *console,
+                             uint8_t previous)
 {
+	int64_t timestamp = 0;
+
 	/* TODO: indicate that only one controller supported */
+	uint8_t buttons = 0;
 	if (console->controller != NULL) {
 		struct nes_emulator_controller_backend *backend;
 		backend = console->controller;
-		return backend->controller1_read(backend->pointer);
+		buttons = backend->controller1_read(backend->pointer);
+		if ((buttons & ~previous) != 0
+		    && backend->controller1_timestamp != NULL) {
+			timestamp = backend->controller1_timestamp(
+				backend->pointer);
+		}
 	}
 
+	/* The keyboard still works with a gamepad backend */
 	for (size_t i = 0; i < PPU_BACKENDS_MAX; ++i) {
 		struct nes_emulator_ppu_backend *backend;
 		backend = console->ppu.backends[i];
-		if (backend != NULL) {
-			return backend->joypad1_read(backend->pointer);
+		if (backend == NULL || backend->joypad1_read == NULL) {
+			continue;
+		}
+		uint8_t joypad1 = backend->joypad1_read(backend->pointer);
+		if ((joypad1 & ~previous) != 0
+		    && backend->joypad1_timestamp != NULL) {
+			int64_t joypad1_timestamp =
+				backend->joypad1_timestamp(backend->pointer);
+			if (timestamp == 0 || joypad1_timestamp < timestamp) {
+				timestamp = joypad1_timestamp;
+			}
+		}
+		buttons |= joypad1;
+		break;
+	}
+
+	if (timestamp != 0 && console->frame_input_nsec == 0) {
+		console->frame_input_nsec = timestamp;
+	}
+	return buttons;
+}
+
+uint8_t controller_read(struct nes_emulator_console *console)
+{
+	/* Frames run ahead see the input of the frame they started from */
+	if (console->is_running_ahead) {
+		return console->run_ahead_buttons;
+	}
+
+	uint8_t previous = console->cpu.controller_status;
+	uint8_t buttons;
+	if (console->movie == NULL || !movie_buttons(console, &buttons)) {
+		buttons = read_backends(console, previous);
+		if (console->movie != NULL) {
+			movie_record_buttons(console, buttons);
 		}
 	}
-	return 0;
+
+	if (console->is_frame_input_read && buttons != previous) {
+		console->is_frame_input_mixed = true;
+	}
+	console->is_frame_input_read = true;
+	return buttons;
 }
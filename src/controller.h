@@ -22,9 +22,12 @@ extern "C" {
 
 #include <stdint.h>
 
+/* controller1_timestamp, which may be NULL, is when the buttons last
+   changed on CLOCK_MONOTONIC in nanoseconds */
 struct nes_emulator_controller_backend {
 	void *pointer;
 	uint8_t (*controller1_read)(void *);
+	int64_t (*controller1_timestamp)(void *);
 };
 
 #ifdef __cpluscplus
@@ -2625,6 +2625,13 @@ uint8_t cpu_step(struct nes_emulator_console *console)
 	return execute_instruction(console, &console->cpu_step_cycles);
 }
 
+bool cpu_is_state_valid(const uint8_t *state)
+{
+	return CONSOLE_STATE_IS_BOOL(state, cpu.nmi_queued)
+	       && CONSOLE_STATE_IS_BOOL(state, cpu.nmi_delay)
+	       && CONSOLE_STATE_IS_BOOL(state, cpu.controller_latch);
+}
+
 void cpu_generate_nmi(struct nes_emulator_console *console)
 {
 	console->cpu.nmi_queued = true;
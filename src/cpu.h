@@ -54,6 +54,8 @@ void cpu_init(struct nes_emulator_console *console);
 void cpu_reset(struct nes_emulator_console *console);
 uint8_t cpu_step(struct nes_emulator_console *console);
 void cpu_generate_nmi(struct nes_emulator_console *console);
+/* Whether a loaded copy of the state holds values the CPU can run */
+bool cpu_is_state_valid(const uint8_t *state);
 
 #ifdef __cpluscplus
 }
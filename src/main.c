@@ -21,11 +21,97 @@
 #include "backend/wayland.h"
 #include "backend/alsa.h"
 #include "backend/evdev.h"
+#include "backend/headless.h"
+#include "backend/pacing.h"
+#include "backend/scale.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+static uint8_t load_state(struct nes_emulator_console *console,
+                          const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+
+	uint8_t exit_code = 0;
+	long size = -1;
+	if (fseek(file, 0, SEEK_END) == 0) {
+		size = ftell(file);
+	}
+	uint8_t *data = NULL;
+	if (size < 0 || fseek(file, 0, SEEK_SET) != 0) {
+		exit_code = EXIT_CODE_OS_ERROR_BIT;
+	}
+	else {
+		data = malloc(size > 0 ? size : 1);
+		if (data == NULL || fread(data, 1, size, file) != (size_t) size) {
+			exit_code = EXIT_CODE_OS_ERROR_BIT;
+		}
+	}
+	if (exit_code == 0) {
+		exit_code = nes_emulator_console_load_state(console, data, size);
+	}
+
+	free(data);
+	if (fclose(file) != 0) {
+		exit_code |= EXIT_CODE_OS_ERROR_BIT;
+	}
+	return exit_code;
+}
+
+static uint8_t write_file(const char *path, const uint8_t *data, size_t size)
+{
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+
+	uint8_t exit_code = 0;
+	if (fwrite(data, 1, size, file) != size) {
+		exit_code = EXIT_CODE_OS_ERROR_BIT;
+	}
+	if (fclose(file) != 0) {
+		exit_code = EXIT_CODE_OS_ERROR_BIT;
+	}
+	return exit_code;
+}
+
+static uint8_t save_state(struct nes_emulator_console *console,
+                          const char *path)
+{
+	size_t size = nes_emulator_console_state_size();
+	uint8_t *data = malloc(size);
+	if (data == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	nes_emulator_console_save_state(console, data);
+
+	uint8_t exit_code = write_file(path, data, size);
+	free(data);
+	return exit_code;
+}
+
+static uint8_t save_movie(struct nes_emulator_console *console,
+                          const char *path)
+{
+	uint8_t *data;
+	size_t size;
+	uint8_t exit_code = nes_emulator_console_stop_movie(console, &data,
+	                                                    &size);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+
+	exit_code = write_file(path, data, size);
+	free(data);
+	return exit_code;
+}
+
 int main(int argc, char **argv)
 {
 	for (int i = 0; i < argc; ++i) {
@@ -35,6 +121,163 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* Options follow the ROM path */
+	uint8_t scale = 2;
+	enum pacing_mode pacing_mode = PACING_MODE_DEADLINE;
+	bool is_pacing_spinning = false;
+	bool is_hud_visible = false;
+	bool is_pausing_occluded = false;
+	bool is_headless = false;
+	bool is_throttled = true;
+	bool is_reporting = false;
+	enum nes_emulator_render_mode render_mode;
+	render_mode = NES_EMULATOR_RENDER_MODE_FULL;
+	uint8_t render_workers = 0;
+	long long frames = 0;
+	uint8_t run_ahead_frames = 0;
+	uint8_t speculation_branches = 0;
+	size_t rewind_mib = 0;
+	const char *latency_log_path = NULL;
+	const char *load_state_path = NULL;
+	const char *save_state_path = NULL;
+	const char *record_path = NULL;
+	const char *play_path = NULL;
+	uint32_t keyframe_interval = 600;
+	long long seek_frame = -1;
+	for (int i = 2; i < argc; ++i) {
+		if (strcmp("--scale", argv[i]) == 0 && i + 1 < argc) {
+			int value = atoi(argv[++i]);
+			if (value < 1 || value > SCALE_MAX) {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+			scale = value;
+		}
+		else if (strcmp("--pacing", argv[i]) == 0 && i + 1 < argc) {
+			const char *value = argv[++i];
+			if (strcmp("deadline", value) == 0) {
+				pacing_mode = PACING_MODE_DEADLINE;
+			}
+			else if (strcmp("frame-callback", value) == 0) {
+				pacing_mode = PACING_MODE_FRAME_CALLBACK;
+			}
+			else if (strcmp("presentation", value) == 0) {
+				pacing_mode = PACING_MODE_PRESENTATION;
+			}
+			else {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+		}
+		else if (strcmp("--render", argv[i]) == 0 && i + 1 < argc) {
+			const char *value = argv[++i];
+			if (strcmp("full", value) == 0) {
+				render_mode = NES_EMULATOR_RENDER_MODE_FULL;
+			}
+			else if (strcmp("none", value) == 0) {
+				render_mode = NES_EMULATOR_RENDER_MODE_NONE;
+			}
+			else if (strcmp("deferred", value) == 0) {
+				render_mode = NES_EMULATOR_RENDER_MODE_DEFERRED;
+			}
+			else if (strcmp("parallel", value) == 0) {
+				render_mode = NES_EMULATOR_RENDER_MODE_PARALLEL;
+			}
+			else {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+		}
+		else if (strcmp("--render-workers", argv[i]) == 0
+		         && i + 1 < argc) {
+			int value = atoi(argv[++i]);
+			if (value < 1 || value > UINT8_MAX) {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+			render_workers = value;
+		}
+		else if (strcmp("--spin", argv[i]) == 0) {
+			is_pacing_spinning = true;
+		}
+		else if (strcmp("--hud", argv[i]) == 0) {
+			is_hud_visible = true;
+		}
+		else if (strcmp("--pause-hidden", argv[i]) == 0) {
+			is_pausing_occluded = true;
+		}
+		else if (strcmp("--headless", argv[i]) == 0) {
+			is_headless = true;
+		}
+		else if (strcmp("--frames", argv[i]) == 0 && i + 1 < argc) {
+			frames = atoll(argv[++i]);
+			if (frames < 1) {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+		}
+		else if (strcmp("--unthrottled", argv[i]) == 0) {
+			is_throttled = false;
+		}
+		else if (strcmp("--report", argv[i]) == 0) {
+			is_reporting = true;
+		}
+		else if (strcmp("--run-ahead", argv[i]) == 0 && i + 1 < argc) {
+			int value = atoi(argv[++i]);
+			/* The console reports frames beyond its limit */
+			if (value < 1 || value > UINT8_MAX) {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+			run_ahead_frames = value;
+		}
+		else if (strcmp("--speculate", argv[i]) == 0 && i + 1 < argc) {
+			int value = atoi(argv[++i]);
+			if (value < 1 || value > UINT8_MAX) {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+			speculation_branches = value;
+		}
+		else if (strcmp("--latency-log", argv[i]) == 0
+		         && i + 1 < argc) {
+			latency_log_path = argv[++i];
+		}
+		else if (strcmp("--rewind", argv[i]) == 0 && i + 1 < argc) {
+			int value = atoi(argv[++i]);
+			if (value < 1 || value > 1024) {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+			rewind_mib = value;
+		}
+		else if (strcmp("--load-state", argv[i]) == 0 && i + 1 < argc) {
+			load_state_path = argv[++i];
+		}
+		else if (strcmp("--save-state", argv[i]) == 0 && i + 1 < argc) {
+			save_state_path = argv[++i];
+		}
+		else if (strcmp("--record", argv[i]) == 0 && i + 1 < argc) {
+			record_path = argv[++i];
+		}
+		else if (strcmp("--keyframe-interval", argv[i]) == 0
+		         && i + 1 < argc) {
+			int value = atoi(argv[++i]);
+			if (value < 1) {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+			keyframe_interval = value;
+		}
+		else if (strcmp("--play", argv[i]) == 0 && i + 1 < argc) {
+			play_path = argv[++i];
+		}
+		else if (strcmp("--seek", argv[i]) == 0 && i + 1 < argc) {
+			seek_frame = atoll(argv[++i]);
+			if (seek_frame < 0) {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+		}
+		else {
+			return EXIT_CODE_ARG_ERROR_BIT;
+		}
+	}
+	/* Seeking is within the movie being played */
+	if (seek_frame >= 0 && play_path == NULL) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+
 	struct nes_emulator_console *console;
 	struct nes_emulator_cartridge *cartridge;
 	struct memory_mapping mm;
@@ -66,8 +309,17 @@ int main(int argc, char **argv)
 		return exit_code;
 	}
 
+	/* Headless runs need no display server and take no input */
 	struct nes_emulator_ppu_backend *ppu_backend;
-	exit_code = nes_emulator_ppu_backend_wayland_init(&ppu_backend);
+	if (is_headless) {
+		exit_code = nes_emulator_ppu_backend_headless_init(
+			&ppu_backend, is_throttled);
+	}
+	else {
+		exit_code = nes_emulator_ppu_backend_wayland_init(
+			&ppu_backend, scale, pacing_mode, is_pacing_spinning,
+			is_hud_visible, is_pausing_occluded, latency_log_path);
+	}
 	if (exit_code != 0) {
 		nes_emulator_cartridge_fini(&cartridge);
 		nes_emulator_console_fini(&console);
@@ -76,26 +328,88 @@ int main(int argc, char **argv)
 	}
 	nes_emulator_console_add_ppu_backend(console, ppu_backend);
 
-	struct nes_emulator_controller_backend *controller_backend;
-	exit_code = nes_emulator_backend_evdev_init(&controller_backend);
-	if (exit_code == 0) {
+	struct nes_emulator_controller_backend *controller_backend = NULL;
+	if (!is_headless
+	    && nes_emulator_backend_evdev_init(&controller_backend) == 0) {
 		nes_emulator_console_add_controller_backend(console,
 		                                            controller_backend);
 	}
-	else {
-		exit_code = 0;
-	}
 
 	nes_emulator_console_insert_cartridge(console, cartridge);
+	if (load_state_path != NULL) {
+		exit_code = load_state(console, load_state_path);
+	}
+	nes_emulator_console_set_profiling(console, is_reporting);
+	/* A render thread rules out run-ahead, rewind and seeking, the
+	   console reports them after it starts */
+	nes_emulator_console_set_render_workers(console, render_workers);
+	if (exit_code == 0) {
+		exit_code = nes_emulator_console_set_render_mode(console,
+		                                                 render_mode);
+	}
+	if (exit_code == 0) {
+		exit_code = nes_emulator_console_set_run_ahead(
+			console, run_ahead_frames);
+	}
+	if (exit_code == 0 && speculation_branches != 0) {
+		exit_code = nes_emulator_console_set_speculation(
+			console, speculation_branches);
+	}
+	if (exit_code == 0 && rewind_mib != 0) {
+		exit_code = nes_emulator_console_set_rewind(
+			console, rewind_mib << 20);
+	}
+	/* Played straight from the file, which stays mapped until the end */
+	struct memory_mapping movie_mm = {NULL, 0};
+	if (exit_code == 0 && play_path != NULL) {
+		exit_code = init_memory_mapping_from_path(play_path, &movie_mm);
+		if (exit_code == 0) {
+			exit_code = nes_emulator_console_play_movie(
+				console, movie_mm.data, movie_mm.size);
+		}
+		if (exit_code == 0 && seek_frame > 0) {
+			exit_code = nes_emulator_console_seek_movie(
+				console, seek_frame);
+		}
+	}
+	if (exit_code == 0 && record_path != NULL) {
+		exit_code = nes_emulator_console_record_movie(
+			console, keyframe_interval);
+	}
 
-	while (exit_code == 0) {
+	/* A played movie ends the run at its last frame */
+	while (exit_code == 0
+	       && (frames == 0
+	           || nes_emulator_console_frames(console) < (uint64_t) frames)
+	       && (play_path == NULL
+	           || nes_emulator_console_is_movie_playing(console))) {
 		exit_code = nes_emulator_console_step(console);
 	}
+	/* Only a run that stops after its frames ends cleanly */
+	if (exit_code == 0 && save_state_path != NULL) {
+		exit_code = save_state(console, save_state_path);
+	}
+	if (exit_code == 0 && record_path != NULL) {
+		exit_code = save_movie(console, record_path);
+	}
 
+	/* Stops the render thread, which delivers its last frames to the
+	   backends first */
+	nes_emulator_console_fini(&console);
 	exit_code |= nes_emulator_backend_evdev_fini(&controller_backend);
-	exit_code |= nes_emulator_ppu_backend_wayland_fini(&ppu_backend);
+	if (is_headless) {
+		if (is_reporting) {
+			nes_emulator_ppu_backend_headless_report(ppu_backend);
+		}
+		exit_code |= nes_emulator_ppu_backend_headless_fini(&ppu_backend);
+	}
+	else {
+		exit_code |= nes_emulator_ppu_backend_wayland_fini(&ppu_backend);
+	}
 	nes_emulator_cartridge_fini(&cartridge);
-	nes_emulator_console_fini(&console);
+	if (movie_mm.data != NULL) {
+		exit_code |= fini_memory_mapping(&movie_mm);
+	}
 	exit_code |= fini_memory_mapping(&mm);
 	return exit_code;
 }
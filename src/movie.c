@@ -0,0 +1,538 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "movie.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "exit_code.h"
+
+/* The file is a header, then each keyframe's save state followed by the
+   input of every frame up to the next keyframe, then the index, all in
+   the host's byte order. A frame is its buttons and its events, the index
+   has the first frame and file offset of each keyframe, so a mapped file
+   plays in place and seeking reads one keyframe. The first keyframe is
+   where the movie starts, from power on or a loaded state. */
+#define MOVIE_VERSION 1
+#define MOVIE_MAGIC_SIZE 4
+#define MOVIE_HEADER_SIZE 48
+#define MOVIE_FRAME_SIZE 2
+#define MOVIE_INDEX_ENTRY_SIZE 16
+#define MOVIE_INITIAL_CAPACITY 0x40000 /* 256 KiB */
+
+#define MOVIE_VERSION_OFFSET      4
+#define MOVIE_HASH_OFFSET         8
+#define MOVIE_FRAMES_OFFSET       16
+#define MOVIE_INTERVAL_OFFSET     24
+#define MOVIE_KEYFRAMES_OFFSET    28
+#define MOVIE_STATE_SIZE_OFFSET   32
+#define MOVIE_RESERVED_OFFSET     36
+#define MOVIE_INDEX_OFFSET_OFFSET 40
+
+#define MOVIE_EVENT_RESET 0x01
+
+static const char MAGIC[MOVIE_MAGIC_SIZE] = {'N', 'E', 'S', 'M'};
+
+struct movie_keyframe {
+	uint64_t frame;
+	uint64_t offset;
+};
+
+struct movie {
+	bool is_recording;
+	/* The file as given to play, or built while recording */
+	const uint8_t *data;
+	uint8_t *recording;
+	size_t size;
+	size_t capacity;
+	size_t state_size;
+
+	uint64_t frames;
+	uint32_t keyframe_interval;
+	struct movie_keyframe *keyframes;
+	uint32_t keyframe_count;
+	uint32_t keyframe_capacity;
+
+	/* The frame being emulated, its keyframe and, while playing, where
+	   its input is */
+	uint64_t frame;
+	uint32_t keyframe;
+	size_t frame_offset;
+	uint8_t buttons;
+	uint8_t events;
+	bool is_frame_read;
+	bool is_reset_pending;
+};
+
+static void free_movie(struct movie *movie)
+{
+	free(movie->recording);
+	free(movie->keyframes);
+	free(movie);
+}
+
+void movie_stop(struct nes_emulator_console *console)
+{
+	free_movie(console->movie);
+	console->movie = NULL;
+}
+
+static uint8_t reserve(struct movie *movie, size_t size)
+{
+	size_t capacity = movie->capacity;
+	while (capacity - movie->size < size) {
+		capacity *= 2;
+	}
+	if (capacity == movie->capacity) {
+		return 0;
+	}
+	uint8_t *recording = realloc(movie->recording, capacity);
+	if (recording == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	movie->recording = recording;
+	movie->data = recording;
+	movie->capacity = capacity;
+	return 0;
+}
+
+/* The state at the start of the frame about to be emulated */
+static uint8_t record_keyframe(struct nes_emulator_console *console)
+{
+	struct movie *movie = console->movie;
+	if (movie->keyframe_count == movie->keyframe_capacity) {
+		uint32_t capacity = movie->keyframe_capacity * 2;
+		struct movie_keyframe *keyframes = realloc(movie->keyframes,
+			capacity * sizeof(struct movie_keyframe));
+		if (keyframes == NULL) {
+			return EXIT_CODE_OS_ERROR_BIT;
+		}
+		movie->keyframes = keyframes;
+		movie->keyframe_capacity = capacity;
+	}
+	uint8_t exit_code = reserve(movie, movie->state_size);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+
+	movie->keyframe = movie->keyframe_count++;
+	movie->keyframes[movie->keyframe].frame = movie->frame;
+	movie->keyframes[movie->keyframe].offset = movie->size;
+	nes_emulator_console_save_state(console,
+	                                movie->recording + movie->size);
+	movie->size += movie->state_size;
+	return 0;
+}
+
+/* Events happen as the frame starts, after its keyframe is taken */
+static void start_frame(struct nes_emulator_console *console)
+{
+	struct movie *movie = console->movie;
+	movie->is_frame_read = false;
+	if (movie->is_recording) {
+		movie->events = 0;
+		if (movie->is_reset_pending) {
+			movie->is_reset_pending = false;
+			movie->events |= MOVIE_EVENT_RESET;
+			console_reset(console);
+		}
+		return;
+	}
+
+	if (movie->frame == movie->frames) {
+		return;
+	}
+	movie->buttons = movie->data[movie->frame_offset];
+	movie->events = movie->data[movie->frame_offset + 1];
+	if ((movie->events & MOVIE_EVENT_RESET) != 0) {
+		console_reset(console);
+	}
+}
+
+/* While playing, finds the keyframe a frame runs from and its input */
+static void find_frame(struct movie *movie, uint64_t frame)
+{
+	uint32_t low = 0;
+	uint32_t high = movie->keyframe_count;
+	while (high - low > 1) {
+		uint32_t middle = low + (high - low) / 2;
+		if (movie->keyframes[middle].frame <= frame) {
+			low = middle;
+		}
+		else {
+			high = middle;
+		}
+	}
+	const struct movie_keyframe *keyframe = &movie->keyframes[low];
+	movie->frame = frame;
+	movie->keyframe = low;
+	movie->frame_offset = keyframe->offset + movie->state_size
+	                      + (frame - keyframe->frame) * MOVIE_FRAME_SIZE;
+}
+
+uint8_t movie_frame(struct nes_emulator_console *console)
+{
+	struct movie *movie = console->movie;
+	if (!movie->is_recording) {
+		if (movie->frame == movie->frames) {
+			return 0;
+		}
+		++movie->frame;
+		uint32_t next = movie->keyframe + 1;
+		if (next < movie->keyframe_count
+		    && movie->keyframes[next].frame == movie->frame) {
+			movie->keyframe = next;
+			movie->frame_offset = movie->keyframes[next].offset
+			                      + movie->state_size;
+		}
+		else {
+			movie->frame_offset += MOVIE_FRAME_SIZE;
+		}
+		start_frame(console);
+		return 0;
+	}
+
+	uint8_t frame[MOVIE_FRAME_SIZE] = {movie->buttons, movie->events};
+	uint8_t exit_code = reserve(movie, MOVIE_FRAME_SIZE);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+	memcpy(movie->recording + movie->size, frame, MOVIE_FRAME_SIZE);
+	movie->size += MOVIE_FRAME_SIZE;
+	++movie->frames;
+	++movie->frame;
+	if (movie->frame % movie->keyframe_interval == 0) {
+		exit_code = record_keyframe(console);
+		if (exit_code != 0) {
+			return exit_code;
+		}
+	}
+	start_frame(console);
+	return 0;
+}
+
+bool movie_buttons(struct nes_emulator_console *console, uint8_t *buttons)
+{
+	struct movie *movie = console->movie;
+	if (movie->is_recording) {
+		if (!movie->is_frame_read) {
+			return false;
+		}
+	}
+	else if (movie->frame == movie->frames) {
+		return false;
+	}
+	*buttons = movie->buttons;
+	return true;
+}
+
+void movie_record_buttons(struct nes_emulator_console *console,
+                          uint8_t buttons)
+{
+	struct movie *movie = console->movie;
+	if (movie->is_recording) {
+		movie->buttons = buttons;
+		movie->is_frame_read = true;
+	}
+}
+
+void movie_reset(struct nes_emulator_console *console)
+{
+	struct movie *movie = console->movie;
+	if (movie->is_recording) {
+		movie->is_reset_pending = true;
+	}
+	/* Once played back the console takes resets again */
+	else if (movie->frame == movie->frames) {
+		console_reset(console);
+	}
+}
+
+bool movie_is_recording(struct nes_emulator_console *console)
+{
+	return console->movie != NULL && console->movie->is_recording;
+}
+
+static struct movie *new_movie(void)
+{
+	struct movie *movie = malloc(sizeof(struct movie));
+	if (movie == NULL) {
+		return NULL;
+	}
+	movie->is_recording = false;
+	movie->data = NULL;
+	movie->recording = NULL;
+	movie->size = 0;
+	movie->capacity = 0;
+	movie->state_size = nes_emulator_console_state_size();
+	movie->frames = 0;
+	movie->keyframe_interval = 0;
+	movie->keyframes = NULL;
+	movie->keyframe_count = 0;
+	movie->keyframe_capacity = 0;
+	movie->frame = 0;
+	movie->keyframe = 0;
+	movie->frame_offset = 0;
+	movie->buttons = 0;
+	movie->events = 0;
+	movie->is_frame_read = false;
+	movie->is_reset_pending = false;
+	return movie;
+}
+
+uint8_t nes_emulator_console_record_movie(
+	struct nes_emulator_console *console,
+	uint32_t keyframe_interval)
+{
+	if (keyframe_interval == 0 || console->cartridge == NULL
+	    || console->rewind != NULL) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+	if (console->movie != NULL) {
+		movie_stop(console);
+	}
+
+	struct movie *movie = new_movie();
+	if (movie == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	movie->is_recording = true;
+	movie->keyframe_interval = keyframe_interval;
+	movie->capacity = MOVIE_INITIAL_CAPACITY;
+	movie->recording = malloc(movie->capacity);
+	movie->keyframe_capacity = 16;
+	movie->keyframes = malloc(movie->keyframe_capacity
+	                          * sizeof(struct movie_keyframe));
+	if (movie->recording == NULL || movie->keyframes == NULL) {
+		free_movie(movie);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	movie->data = movie->recording;
+	/* The header is filled in when the recording stops */
+	movie->size = MOVIE_HEADER_SIZE;
+	/* The first frame records whatever was last held if it never reads */
+	movie->buttons = console->cpu.controller_status;
+
+	console->movie = movie;
+	uint8_t exit_code = record_keyframe(console);
+	if (exit_code != 0) {
+		movie_stop(console);
+		return exit_code;
+	}
+	start_frame(console);
+	return 0;
+}
+
+static uint64_t read_u64(const uint8_t *data)
+{
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static uint32_t read_u32(const uint8_t *data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+/* Checks every keyframe's input lies before the next keyframe, so frames
+   are read without any more checks */
+static uint8_t read_index(struct nes_emulator_console *console,
+                          struct movie *movie)
+{
+	const uint8_t *data = movie->data;
+	if (movie->size < MOVIE_HEADER_SIZE
+	    || memcmp(data, MAGIC, MOVIE_MAGIC_SIZE) != 0
+	    || read_u32(data + MOVIE_VERSION_OFFSET) != MOVIE_VERSION
+	    || read_u64(data + MOVIE_HASH_OFFSET) != console->cartridge->hash
+	    || read_u32(data + MOVIE_STATE_SIZE_OFFSET) != movie->state_size) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+	movie->frames = read_u64(data + MOVIE_FRAMES_OFFSET);
+	movie->keyframe_interval = read_u32(data + MOVIE_INTERVAL_OFFSET);
+	uint32_t count = read_u32(data + MOVIE_KEYFRAMES_OFFSET);
+	uint64_t index_offset = read_u64(data + MOVIE_INDEX_OFFSET_OFFSET);
+	if (count == 0 || index_offset < MOVIE_HEADER_SIZE
+	    || index_offset > movie->size
+	    || (movie->size - index_offset) / MOVIE_INDEX_ENTRY_SIZE < count) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+
+	movie->keyframes = malloc(count * sizeof(struct movie_keyframe));
+	if (movie->keyframes == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	movie->keyframe_count = count;
+	movie->keyframe_capacity = count;
+
+	uint64_t start = MOVIE_HEADER_SIZE;
+	for (uint32_t i = 0; i < count; ++i) {
+		const uint8_t *entry = data + index_offset
+		                       + i * MOVIE_INDEX_ENTRY_SIZE;
+		struct movie_keyframe *keyframe = &movie->keyframes[i];
+		keyframe->frame = read_u64(entry);
+		keyframe->offset = read_u64(entry + sizeof(uint64_t));
+		if ((i == 0 && keyframe->frame != 0)
+		    || (i != 0 && keyframe->frame <= keyframe[-1].frame)
+		    || keyframe->frame > movie->frames
+		    || keyframe->offset < start
+		    || keyframe->offset > index_offset) {
+			return EXIT_CODE_ARG_ERROR_BIT;
+		}
+		start = keyframe->offset;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		const struct movie_keyframe *keyframe = &movie->keyframes[i];
+		uint64_t end = i + 1 < count ? keyframe[1].offset : index_offset;
+		uint64_t frames = (i + 1 < count ? keyframe[1].frame
+		                                 : movie->frames)
+		                  - keyframe->frame;
+		if (end - keyframe->offset < movie->state_size
+		    || (end - keyframe->offset - movie->state_size)
+		       / MOVIE_FRAME_SIZE < frames) {
+			return EXIT_CODE_ARG_ERROR_BIT;
+		}
+	}
+	return 0;
+}
+
+uint8_t nes_emulator_console_play_movie(struct nes_emulator_console *console,
+                                        const uint8_t *data,
+                                        size_t size)
+{
+	if (console->cartridge == NULL || console->rewind != NULL) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+	if (console->movie != NULL) {
+		movie_stop(console);
+	}
+
+	struct movie *movie = new_movie();
+	if (movie == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	movie->data = data;
+	movie->size = size;
+	uint8_t exit_code = read_index(console, movie);
+	if (exit_code != 0) {
+		free_movie(movie);
+		return exit_code;
+	}
+
+	console->movie = movie;
+	uint64_t replay_frames;
+	exit_code = movie_seek(console, 0, &replay_frames);
+	if (exit_code != 0) {
+		movie_stop(console);
+	}
+	return exit_code;
+}
+
+uint8_t movie_seek(struct nes_emulator_console *console,
+                   uint64_t frame,
+                   uint64_t *replay_frames)
+{
+	struct movie *movie = console->movie;
+	if (movie->is_recording || frame > movie->frames) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+
+	/* A keyframe is checked like any loaded state, a rejected one leaves
+	   the movie where the console still is */
+	uint64_t previous = movie->frame;
+	find_frame(movie, frame);
+	const struct movie_keyframe *keyframe =
+		&movie->keyframes[movie->keyframe];
+	uint8_t exit_code = nes_emulator_console_load_state(
+		console, movie->data + keyframe->offset, movie->state_size);
+	if (exit_code != 0) {
+		find_frame(movie, previous);
+		return exit_code;
+	}
+	*replay_frames = frame - keyframe->frame;
+	find_frame(movie, keyframe->frame);
+	start_frame(console);
+	return 0;
+}
+
+bool nes_emulator_console_is_movie_playing(
+	struct nes_emulator_console *console)
+{
+	struct movie *movie = console->movie;
+	return movie != NULL && !movie->is_recording
+	       && movie->frame != movie->frames;
+}
+
+uint8_t nes_emulator_console_stop_movie(struct nes_emulator_console *console,
+                                        uint8_t **data,
+                                        size_t *size)
+{
+	struct movie *movie = console->movie;
+	if (movie == NULL) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+	if (!movie->is_recording) {
+		movie_stop(console);
+		return 0;
+	}
+
+	uint64_t index_offset = movie->size;
+	uint8_t exit_code = reserve(movie, movie->keyframe_count
+	                                   * MOVIE_INDEX_ENTRY_SIZE);
+	if (exit_code != 0) {
+		movie_stop(console);
+		return exit_code;
+	}
+	for (uint32_t i = 0; i < movie->keyframe_count; ++i) {
+		uint8_t *entry = movie->recording + movie->size;
+		memcpy(entry, &movie->keyframes[i].frame, sizeof(uint64_t));
+		memcpy(entry + sizeof(uint64_t), &movie->keyframes[i].offset,
+		       sizeof(uint64_t));
+		movie->size += MOVIE_INDEX_ENTRY_SIZE;
+	}
+
+	uint8_t *header = movie->recording;
+	uint32_t version = MOVIE_VERSION;
+	uint32_t state_size = movie->state_size;
+	uint32_t reserved = 0;
+	memcpy(header, MAGIC, MOVIE_MAGIC_SIZE);
+	memcpy(header + MOVIE_VERSION_OFFSET, &version, sizeof(version));
+	memcpy(header + MOVIE_HASH_OFFSET, &console->cartridge->hash,
+	       sizeof(uint64_t));
+	memcpy(header + MOVIE_FRAMES_OFFSET, &movie->frames, sizeof(uint64_t));
+	memcpy(header + MOVIE_INTERVAL_OFFSET, &movie->keyframe_interval,
+	       sizeof(uint32_t));
+	memcpy(header + MOVIE_KEYFRAMES_OFFSET, &movie->keyframe_count,
+	       sizeof(uint32_t));
+	memcpy(header + MOVIE_STATE_SIZE_OFFSET, &state_size,
+	       sizeof(state_size));
+	memcpy(header + MOVIE_RESERVED_OFFSET, &reserved,
+	       sizeof(reserved));
+	memcpy(header + MOVIE_INDEX_OFFSET_OFFSET, &index_offset,
+	       sizeof(index_offset));
+
+	/* The caller frees the file */
+	*data = movie->recording;
+	*size = movie->size;
+	movie->recording = NULL;
+	movie_stop(console);
+	return 0;
+}
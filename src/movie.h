@@ -0,0 +1,53 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct nes_emulator_console;
+
+void movie_stop(struct nes_emulator_console *console);
+
+/* Loads the keyframe at or before a frame of the movie being played,
+   giving how many frames have to be replayed from it */
+uint8_t movie_seek(struct nes_emulator_console *console,
+                   uint64_t frame,
+                   uint64_t *replay_frames);
+bool movie_is_recording(struct nes_emulator_console *console);
+
+/* While playing, gives the frame's buttons; while recording, the ones
+   the frame already read, a frame only ever reads one input */
+bool movie_buttons(struct nes_emulator_console *console, uint8_t *buttons);
+void movie_record_buttons(struct nes_emulator_console *console,
+                          uint8_t buttons);
+/* A reset while recording happens at the start of the next frame */
+void movie_reset(struct nes_emulator_console *console);
+
+/* At the vertical blank ending a frame, records it or moves on to the
+   next one's input */
+uint8_t movie_frame(struct nes_emulator_console *console);
+
+#ifdef __cpluscplus
+}
+#endif
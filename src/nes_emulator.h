@@ -20,9 +20,24 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/* FULL produces every pixel; NONE skips pixel production but still
+   reports sprite 0 hits and sprite overflow at the correct cycle;
+   DEFERRED emulates like NONE while a render thread replays each frame
+   to produce its pixels, so the backends are called from that thread;
+   PARALLEL is DEFERRED with the frame split into bands of scan lines
+   rendered by worker threads. The console renders as NONE while all its
+   PPU backends report being occluded, then returns to the set mode. */
+enum nes_emulator_render_mode {
+	NES_EMULATOR_RENDER_MODE_FULL,
+	NES_EMULATOR_RENDER_MODE_NONE,
+	NES_EMULATOR_RENDER_MODE_DEFERRED,
+	NES_EMULATOR_RENDER_MODE_PARALLEL,
+};
+
 struct nes_emulator_cartridge;
 struct nes_emulator_console;
 struct nes_emulator_ppu_backend;
@@ -39,10 +54,75 @@ void nes_emulator_console_insert_cartridge(
 void nes_emulator_console_add_ppu_backend(
 	struct nes_emulator_console *console,
 	struct nes_emulator_ppu_backend *ppu_backend);
+uint8_t nes_emulator_console_set_render_mode(
+	struct nes_emulator_console *console,
+	enum nes_emulator_render_mode render_mode);
+void nes_emulator_console_set_render_workers(
+	struct nes_emulator_console *console,
+	uint8_t workers);
 void nes_emulator_console_add_controller_backend(
 	struct nes_emulator_console *console,
 	struct nes_emulator_controller_backend *controller_backend);
 uint8_t nes_emulator_console_step(struct nes_emulator_console *console);
+/* Records the state of each frame into a history of the given size, a
+   few MiB hold minutes, so a backend can rewind it. Needs a FULL or NONE
+   render mode, 0 turns it off. */
+uint8_t nes_emulator_console_set_rewind(struct nes_emulator_console *console,
+                                        size_t bytes);
+/* A versioned save state of everything the console emulates, tied to
+   the inserted ROM. Loading needs a FULL or NONE render mode. */
+size_t nes_emulator_console_state_size(void);
+void nes_emulator_console_save_state(struct nes_emulator_console *console,
+                                     uint8_t *data);
+uint8_t nes_emulator_console_load_state(struct nes_emulator_console *console,
+                                        const uint8_t *data,
+                                        size_t size);
+/* Presses reset. While a movie records it happens as the next frame
+   starts, while one plays only the movie's resets happen. */
+void nes_emulator_console_reset(struct nes_emulator_console *console);
+/* Records from the current state the buttons each frame reads, which
+   stay the same for the rest of the frame, and the resets, with a save
+   state keyframe every given number of frames. Not with rewind. */
+uint8_t nes_emulator_console_record_movie(
+	struct nes_emulator_console *console,
+	uint32_t keyframe_interval);
+/* Plays a movie from memory kept until it stops, such as a mapped file,
+   its buttons replacing the controllers' until its last frame. Needs the
+   ROM it was recorded on and a FULL or NONE render mode, not with
+   rewind. */
+uint8_t nes_emulator_console_play_movie(struct nes_emulator_console *console,
+                                        const uint8_t *data,
+                                        size_t size);
+/* Goes to the start of a frame of the playing movie, replaying from the
+   keyframe before it without rendering */
+uint8_t nes_emulator_console_seek_movie(struct nes_emulator_console *console,
+                                        uint64_t frame);
+bool nes_emulator_console_is_movie_playing(
+	struct nes_emulator_console *console);
+/* Stops the movie, a recording gives its file for the caller to free */
+uint8_t nes_emulator_console_stop_movie(struct nes_emulator_console *console,
+                                        uint8_t **data,
+                                        size_t *size);
+/* Shows each frame as it would be the given number of frames later, 1 to
+   4, with the buttons held now, hiding that many frames of the game's own
+   input lag. Needs a cartridge and a FULL or NONE render mode, 0 turns it
+   off. */
+uint8_t nes_emulator_console_set_run_ahead(
+	struct nes_emulator_console *console,
+	uint8_t frames);
+/* Runs ahead on up to 8 threads, each guessing the buttons the next frame
+   reads: those held now, none, then other recent ones. A frame that read
+   a guessed input is shown without running ahead again. Needs run-ahead,
+   0 runs ahead serially. */
+uint8_t nes_emulator_console_set_speculation(
+	struct nes_emulator_console *console,
+	uint8_t branches);
+/* Frames emulated so far */
+uint64_t nes_emulator_console_frames(struct nes_emulator_console *console);
+/* Adds estimated CPU and PPU times to the frame stats, which a PPU backend
+   can also ask for while it shows them */
+void nes_emulator_console_set_profiling(struct nes_emulator_console *console,
+                                        bool is_profiling);
 void nes_emulator_console_fini(struct nes_emulator_console **console);
 
 #ifdef __cpluscplus
@@ -18,8 +18,13 @@
 
 #include "cartridge.h"
 #include "console.h"
+#include "exit_code.h"
+#include "render_thread.h"
 
-#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 void nes_emulator_console_add_ppu_backend(
 	struct nes_emulator_console *console,
@@ -32,31 +37,201 @@ void nes_emulator_console_add_ppu_backend(
 		}
 	}
 }
+
+static uint8_t switch_render_mode(struct nes_emulator_console *console,
+                                  enum nes_emulator_render_mode render_mode)
+{
+	if (console->ppu.render_mode == render_mode) {
+		return 0;
+	}
+
+	if (console->ppu.render_thread != NULL) {
+		render_thread_stop(console);
+	}
+	/* The backends may have seen frames from the render thread since
+	   this console last delivered a line */
+	memset(console->ppu.is_line_changed, true,
+	       sizeof(console->ppu.is_line_changed));
+	if (render_mode == NES_EMULATOR_RENDER_MODE_DEFERRED) {
+		uint8_t exit_code = render_thread_start(console, 0);
+		if (exit_code != 0) {
+			console->ppu.render_mode = NES_EMULATOR_RENDER_MODE_FULL;
+			return exit_code;
+		}
+	}
+	else if (render_mode == NES_EMULATOR_RENDER_MODE_PARALLEL) {
+		uint8_t workers = console->ppu.render_workers;
+		if (workers == 0) {
+			long online = sysconf(_SC_NPROCESSORS_ONLN);
+			workers = online > 0 && online < UINT8_MAX ? online : 1;
+		}
+		uint8_t exit_code = render_thread_start(console, workers);
+		if (exit_code != 0) {
+			console->ppu.render_mode = NES_EMULATOR_RENDER_MODE_FULL;
+			return exit_code;
+		}
+	}
+
+	console->ppu.render_mode = render_mode;
+	return 0;
+}
+
+uint8_t nes_emulator_console_set_render_mode(
+	struct nes_emulator_console *console,
+	enum nes_emulator_render_mode render_mode)
+{
+	if (render_mode == NES_EMULATOR_RENDER_MODE_DEFERRED
+	    || render_mode == NES_EMULATOR_RENDER_MODE_PARALLEL) {
+		/* Run-ahead and rewind restore snapshots under the render
+		   thread */
+		if (console->cartridge == NULL
+		    || console->run_ahead_frames != 0
+		    || console->rewind != NULL) {
+			return EXIT_CODE_ARG_ERROR_BIT;
+		}
+	}
+
+	console->ppu.requested_render_mode = render_mode;
+	if (console->ppu.is_render_suspended) {
+		return 0;
+	}
+	return switch_render_mode(console, render_mode);
+}
+
+void ppu_update_occlusion(struct nes_emulator_console *console)
+{
+	console->ppu.is_render_suspended = console->ppu.is_occluded;
+	/* A render thread that fails to start falls back to FULL */
+	if (console->ppu.is_render_suspended) {
+		switch_render_mode(console, NES_EMULATOR_RENDER_MODE_NONE);
+	}
+	else {
+		switch_render_mode(console, console->ppu.requested_render_mode);
+	}
+}
+
+/* Every backend has to be hidden, and there has to be one */
+static bool is_occluded(struct nes_emulator_console *console)
+{
+	bool is_occluded = false;
+	for (size_t i = 0; i < PPU_BACKENDS_MAX; ++i) {
+		struct nes_emulator_ppu_backend *backend;
+		backend = console->ppu.backends[i];
+		if (backend == NULL) {
+			continue;
+		}
+		if (backend->is_occluded == NULL
+		    || !backend->is_occluded(backend->pointer)) {
+			return false;
+		}
+		is_occluded = true;
+	}
+	return is_occluded;
+}
+
+static bool is_profiling(struct nes_emulator_console *console)
+{
+	if (console->is_profiling_requested) {
+		return true;
+	}
+	for (size_t i = 0; i < PPU_BACKENDS_MAX; ++i) {
+		struct nes_emulator_ppu_backend *backend;
+		backend = console->ppu.backends[i];
+		if (backend != NULL && backend->is_profiling != NULL
+		    && backend->is_profiling(backend->pointer)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Takes effect the next time parallel rendering starts */
+void nes_emulator_console_set_render_workers(
+	struct nes_emulator_console *console,
+	uint8_t workers)
+{
+	console->ppu.render_workers = workers;
+}
+
 static void render_pixel(struct nes_emulator_console *console,
                          uint8_t x,
                          uint8_t y,
                          uint8_t c)
 {
+	console->ppu.framebuffer[y][x] = c;
+}
+
+void ppu_deliver_scan_line(struct nes_emulator_console *console, uint8_t y)
+{
+	const uint8_t *line = console->ppu.framebuffer[y];
+	uint8_t *previous = console->ppu.previous_framebuffer[y];
+	if (memcmp(line, previous, PPU_SCREEN_WIDTH) != 0) {
+		memcpy(previous, line, PPU_SCREEN_WIDTH);
+		console->ppu.is_line_changed[y] = true;
+	}
+
 	for (size_t i = 0; i < PPU_BACKENDS_MAX; ++i) {
 		struct nes_emulator_ppu_backend *backend;
 		backend = console->ppu.backends[i];
-		if (backend != NULL) {
-			backend->render_pixel(backend->pointer, x, y, c);
+		if (backend == NULL) {
+			continue;
+		}
+		if (backend->scanline_ready != NULL) {
+			backend->scanline_ready(backend->pointer, y, line);
+		}
+		else if (backend->render_pixel != NULL) {
+			for (uint16_t x = 0; x < PPU_SCREEN_WIDTH; ++x) {
+				backend->render_pixel(backend->pointer,
+				                      x, y, line[x]);
+			}
 		}
 	}
 }
 
-static void vertical_blank(struct nes_emulator_console *console)
+uint64_t ppu_now_nsec(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void ppu_deliver_frame(struct nes_emulator_console *console)
 {
 	for (size_t i = 0; i < PPU_BACKENDS_MAX; ++i) {
 		struct nes_emulator_ppu_backend *backend;
 		backend = console->ppu.backends[i];
-		if (backend != NULL) {
+		if (backend != NULL && backend->frame_stats != NULL) {
+			backend->frame_stats(backend->pointer,
+			                     &console->ppu.frame_stats);
+		}
+		if (backend != NULL && backend->frame_ready != NULL) {
+			backend->frame_ready(backend->pointer,
+			                     &console->ppu.framebuffer[0][0],
+			                     console->ppu.is_line_changed);
+		}
+	}
+	memset(console->ppu.is_line_changed, false,
+	       sizeof(console->ppu.is_line_changed));
+	for (size_t i = 0; i < PPU_BACKENDS_MAX; ++i) {
+		struct nes_emulator_ppu_backend *backend;
+		backend = console->ppu.backends[i];
+		if (backend != NULL && backend->vertical_blank != NULL) {
 			backend->vertical_blank(backend->pointer);
 		}
 	}
 }
 
+static void vertical_blank(struct nes_emulator_console *console)
+{
+	/* The render thread calls the backends once it replays the frame */
+	if (console->ppu.render_thread != NULL
+	    || console->ppu.is_render_skipped) {
+		return;
+	}
+
+	ppu_deliver_frame(console);
+}
+
 static uint16_t get_tile_address(struct nes_emulator_console *console)
 {
 	uint16_t v = console->ppu.internal_registers.v;
@@ -137,27 +312,11 @@ static bool is_rendering_disabled(struct nes_emulator_console *console)
 	return (console->ppu.mask & 0x18) == 0x00;
 }
 
-static bool mask_show_leftmost_background(struct nes_emulator_console *console)
-{
-	return (console->ppu.mask & 0x02) == 0x02;
-}
-
-static bool mask_show_leftmost_sprites(struct nes_emulator_console *console)
-{
-	return (console->ppu.mask & 0x04) == 0x04;
-}
-
 static bool mask_show_background(struct nes_emulator_console *console)
 {
 	return (console->ppu.mask & 0x08) == 0x08;
 }
 
-static bool mask_show_sprites(struct nes_emulator_console *console)
-{
-	return (console->ppu.mask & 0x10) == 0x10;
-}
-
-/* TODO: Assume horizontal arrangement / vertical mirroring (64x30 tilemap) */
 /* Each nametable is 1024 bytes (0x400) */
 /* It consists of 960 8x8 tiles to form the background */
 /* Each of these tiles are a byte */
@@ -165,112 +324,123 @@ static bool mask_show_sprites(struct nes_emulator_console *console)
 /* There are 64 bytes remaining */
 /* Screen is divided into 64 32x32 tiles called attribute tiles */
 
-static uint8_t palette_ppu_bus_read(struct nes_emulator_console *console,
-                                    uint16_t address)
+/* The backdrop entries of the sprite palettes mirror the background ones */
+static const uint8_t PALETTE_INDEX[PPU_PALETTE_SIZE] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+	0x00, 0x11, 0x12, 0x13, 0x04, 0x15, 0x16, 0x17,
+	0x08, 0x19, 0x1A, 0x1B, 0x0C, 0x1D, 0x1E, 0x1F,
+};
+
+static uint8_t page_read(struct nes_emulator_console *console,
+                         uint16_t address)
 {
-	uint8_t i = address - 0x3F00;
-	switch (i) {
-	case 0x00:
-	case 0x10:
-		return console->ppu.palette[0x00];
-	case 0x04:
-	case 0x14:
-		return console->ppu.palette[0x04];
-	case 0x08:
-	case 0x18:
-		return console->ppu.palette[0x08];
-	case 0x0C:
-	case 0x1C:
-		return console->ppu.palette[0x0C];
-	default:
-		return console->ppu.palette[i];
+	return console->ppu.pages[address >> 10][address & 0x03FF];
+}
+
+static uint8_t palette_read(struct nes_emulator_console *console,
+                            uint8_t index)
+{
+	return console->ppu.palette[PALETTE_INDEX[index & 0x1F]];
+}
+
+static void invalidate_background_cache(struct nes_emulator_console *console)
+{
+	console->ppu.is_background_cache_dirty = true;
+}
+
+/* Marks the tiles using the byte at offset in page, for every nametable
+   the page is mapped to */
+static void invalidate_background_tiles(struct nes_emulator_console *console,
+                                        const uint8_t *page,
+                                        uint16_t offset)
+{
+	for (uint8_t nametable = 0; nametable < 4; ++nametable) {
+		if (console->ppu.pages[8 + nametable] != page) {
+			continue;
+		}
+		uint8_t tile_x = (nametable & 0x01) * 32;
+		uint8_t tile_y = (nametable >> 1) * 30;
+		if (offset < 0x03C0) {
+			tile_x += offset % 32;
+			tile_y += offset / 32;
+			console->ppu.is_background_tile_dirty[tile_y][tile_x] =
+				true;
+			continue;
+		}
+		/* Each attribute byte covers 4x4 tiles */
+		uint8_t attribute = offset - 0x03C0;
+		uint8_t coarse_x = (attribute % 8) * 4;
+		uint8_t coarse_y = (attribute / 8) * 4;
+		for (uint8_t y = coarse_y; y < coarse_y + 4 && y < 30; ++y) {
+			for (uint8_t x = coarse_x; x < coarse_x + 4; ++x) {
+				console->ppu.is_background_tile_dirty
+					[tile_y + y][tile_x + x] = true;
+			}
+		}
 	}
 }
 
-static void palette_ppu_bus_write(struct nes_emulator_console *console,
-                                  uint16_t address,
-                                  uint8_t value)
+void ppu_update_pages(struct nes_emulator_console *console)
 {
-	uint8_t i = address - 0x3F00;
-	switch (i) {
-	case 0x00:
-	case 0x10:
-		console->ppu.palette[0x00] = value;
+	struct nes_emulator_cartridge *cartridge = console->cartridge;
+	for (uint8_t i = 0; i < 8; ++i) {
+		console->ppu.pages[i] = console->chr + i * PPU_PAGE_SIZE;
+	}
+
+	uint8_t *lower = console->ppu.ram;
+	uint8_t *upper = console->ppu.ram + PPU_PAGE_SIZE;
+	uint8_t *nametables[4];
+	switch (cartridge->mirroring) {
+	case CARTRIDGE_MIRRORING_HORIZONTAL:
+		nametables[0] = lower;
+		nametables[1] = lower;
+		nametables[2] = upper;
+		nametables[3] = upper;
 		break;
-	case 0x04:
-	case 0x14:
-		console->ppu.palette[0x04] = value;
+	case CARTRIDGE_MIRRORING_VERTICAL:
+		nametables[0] = lower;
+		nametables[1] = upper;
+		nametables[2] = lower;
+		nametables[3] = upper;
 		break;
-	case 0x08:
-	case 0x18:
-		console->ppu.palette[0x08] = value;
+	case CARTRIDGE_MIRRORING_SINGLE_SCREEN_LOWER:
+		nametables[0] = lower;
+		nametables[1] = lower;
+		nametables[2] = lower;
+		nametables[3] = lower;
 		break;
-	case 0x0C:
-	case 0x1C:
-		console->ppu.palette[0x0C] = value;
+	case CARTRIDGE_MIRRORING_SINGLE_SCREEN_UPPER:
+		nametables[0] = upper;
+		nametables[1] = upper;
+		nametables[2] = upper;
+		nametables[3] = upper;
 		break;
+	case CARTRIDGE_MIRRORING_FOUR_SCREEN:
 	default:
-		console->ppu.palette[i] = value;
+		nametables[0] = lower;
+		nametables[1] = upper;
+		nametables[2] = console->vram;
+		nametables[3] = console->vram + PPU_PAGE_SIZE;
 		break;
 	}
-}
 
-static uint16_t get_mirror_index(struct nes_emulator_console *console,
-                                 uint16_t address)
-{
-	assert(address >=0x2800 && address < 0x3000);
-	uint16_t index;
-	switch (console->cartridge->mirroring) {
-	case 0:
-		if (address < 0x2C00) {
-			index = address - 0x2000;
-		}
-		else {
-			index = address - 0x2C00;
-		}
-		break;
-	case 1:
-		index = address - 0x2800;
-		break;
-	default:
-		return 0;
+	/* $2000-$2FFF, mirrored at $3000-$3FFF */
+	for (uint8_t i = 0; i < 8; ++i) {
+		console->ppu.pages[8 + i] = nametables[i % 4];
 	}
-	return index;
+
+	invalidate_background_cache(console);
 }
 
 uint8_t ppu_bus_read(struct nes_emulator_console *console,
                      uint16_t address)
 {
-	if (address < 0x2000) {
-		return cartridge_ppu_bus_read(console, address);
-	}
-	else if (address < 0x2800) {
-		return console->ppu.ram[address - 0x2000];
-	}
-	else if (address < 0x3000) {
-		/* Mirroring */
-		uint16_t index = get_mirror_index(console, address);
-		return console->ppu.ram[index];
-	}
-	else if (address < 0x3F00) {
-		return ppu_bus_read(console, address - 0x1000);
-	}
-	else if (address < 0x3F20) {
-		return palette_ppu_bus_read(console, address);
-	}
-	else if (address < 0x4000) {
-		uint16_t mirrored_address = (address % 0x20) + 0x3F00;
-		return palette_ppu_bus_read(console, mirrored_address);
-	}
-	else if (address < 0x8000) {
-		return ppu_bus_read(console, address - 0x4000);
-	}
-	else if (address < 0xC000) {
-		return ppu_bus_read(console, address - 0x8000);
-	}
-	else {
-		return ppu_bus_read(console, address - 0xC000);
+	address &= 0x3FFF;
+	if (address >= 0x3F00) {
+		return palette_read(console, address);
 	}
+	return page_read(console, address);
 }
 
 void ppu_bus_write(struct nes_emulator_console *console,
@@ -284,34 +454,33 @@ void ppu_bus_write(struct nes_emulator_console *console,
 		}
 	}
 
-	if (address < 0x2000) {
-		cartridge_ppu_bus_write(console, address, value);
-	}
-	else if (address < 0x2800) {
-		console->ppu.ram[address - 0x2000] = value;
-	}
-	else if (address < 0x3000) {
-		uint16_t index = get_mirror_index(console, address);
-		console->ppu.ram[index] = value;
-	}
-	else if (address < 0x3F00) {
-		ppu_bus_write(console, address - 0x1000, value);
-	}
-	else if (address < 0x3F20) {
-		palette_ppu_bus_write(console, address, value);
-	}
-	else if (address < 0x4000) {
-		uint16_t mirrored_address = (address % 0x20) + 0x3F00;
-		palette_ppu_bus_write(console, mirrored_address, value);
+	if (console->ppu.render_mode == NES_EMULATOR_RENDER_MODE_PARALLEL) {
+		render_thread_log(console, RENDER_THREAD_ENTRY_MEMORY_WRITE,
+		                  address, value);
 	}
-	else if (address < 0x8000) {
-		ppu_bus_write(console, address - 0x4000, value);
+	ppu_memory_write(console, address, value);
+}
+
+/* A write that is known to take effect */
+void ppu_memory_write(struct nes_emulator_console *console,
+                      uint16_t address,
+                      uint8_t value)
+{
+	address &= 0x3FFF;
+	if (address >= 0x3F00) {
+		console->ppu.palette[PALETTE_INDEX[address & 0x1F]] = value;
+		return;
 	}
-	else if (address < 0xC000) {
-		ppu_bus_write(console, address - 0x8000, value);
+
+	console->ppu.pages[address >> 10][address & 0x03FF] = value;
+	if (address >= 0x2000) {
+		invalidate_background_tiles(console,
+		                            console->ppu.pages[address >> 10],
+		                            address & 0x03FF);
 	}
-	else {
-		ppu_bus_write(console, address - 0xC000, value);
+	else if ((address & 0x1000)
+	         == console->ppu.background_cache_address) {
+		invalidate_background_cache(console);
 	}
 }
 
@@ -330,10 +499,16 @@ void ppu_init(struct nes_emulator_console *console)
 		console->ppu.secondary_oam[i] = 0;
 	}
 	console->ppu.secondary_oam_entries = 0;
+	console->ppu.is_sprite_index_dirty = true;
+	for (int i = 0; i < PPU_PAGES; ++i) {
+		console->ppu.pages[i] = NULL;
+	}
+	console->ppu.is_background_cache_dirty = true;
 
 	console->ppu.computed_address_increment = 1;
 	console->ppu.oam_address = 0;
 	console->ppu.background_address = 0x1000;
+	console->ppu.background_cache_address = 0x1000;
 	console->ppu.sprite_address = 0x0000;
 	console->ppu.nametable_address = 0x2000;
 	console->ppu.nmi_output = false;
@@ -343,6 +518,22 @@ void ppu_init(struct nes_emulator_console *console)
 	console->ppu.status = 0;
 	console->ppu.read_buffer = 0;
 	console->ppu.mask = 0;
+	memset(console->ppu.framebuffer, 0, sizeof(console->ppu.framebuffer));
+	memset(console->ppu.previous_framebuffer, 0,
+	       sizeof(console->ppu.previous_framebuffer));
+	memset(console->ppu.is_line_changed, true,
+	       sizeof(console->ppu.is_line_changed));
+	console->ppu.render_mode = NES_EMULATOR_RENDER_MODE_FULL;
+	console->ppu.requested_render_mode = NES_EMULATOR_RENDER_MODE_FULL;
+	console->ppu.is_occluded = false;
+	console->ppu.is_render_suspended = false;
+	console->ppu.render_workers = 0;
+	console->ppu.render_thread = NULL;
+	console->ppu.is_replaying = false;
+	console->ppu.is_render_skipped = false;
+	console->ppu.vertical_blanks = 0;
+	memset(&console->ppu.frame_stats, 0, sizeof(console->ppu.frame_stats));
+	console->ppu.frame_start_nsec = ppu_now_nsec();
 	console->ppu.cycle = 0;
 	console->ppu.scan_line = 241;
 	for (size_t i = 0; i < PPU_BACKENDS_MAX; ++i) {
@@ -355,44 +546,119 @@ void ppu_init(struct nes_emulator_console *console)
 	console->ppu.current_x = 0;
 }
 
-static void populate_secondary_oam(struct nes_emulator_console *console,
-                                   uint8_t y)
+static void build_sprite_index(struct nes_emulator_console *console)
 {
-	uint8_t entries = 0;
-	console->ppu.is_sprite_0_in_secondary = false;
-	for (uint8_t i = 0; i < 64; ++i) {
-		uint8_t offset = i * 4;
-		uint8_t y_top = console->ppu.oam[offset];
+	uint8_t sprite_height = 8;
+	if (control_sprite_size_8_x_16(console)) {
+		sprite_height = 16;
+	}
+
+	for (uint8_t y = 0; y < PPU_VISIBLE_SCAN_LINES; ++y) {
+		console->ppu.sprite_index_entries[y] = 0;
+	}
+
+	for (uint8_t i = 0; i < PPU_SPRITES; ++i) {
+		uint8_t y_top = console->ppu.oam[i * 4];
 		/* Check would overflow */
 		if (y_top >= 0xF8) {
 			continue;
 		}
-		uint8_t sprite_height = 8;
-		if (control_sprite_size_8_x_16(console)) {
-			sprite_height = 16;
-		}
-		if (y >= y_top && y <= (y_top + (sprite_height - 1))) {
-			/* Copy bytes to Secondary OAM */
-			if (entries < 8) {
-				for (uint8_t j = 0; j < 4; ++j) {
-					console->ppu.secondary_oam[entries * 4 + j] =
-						console->ppu.oam[offset + j];
-				}
+		uint16_t y_bottom = y_top + sprite_height;
+		if (y_bottom > PPU_VISIBLE_SCAN_LINES) {
+			y_bottom = PPU_VISIBLE_SCAN_LINES;
+		}
+		for (uint16_t y = y_top; y < y_bottom; ++y) {
+			uint8_t entries = console->ppu.sprite_index_entries[y];
+			if (entries < PPU_SPRITES_PER_LINE) {
+				console->ppu.sprite_index[y][entries] = i;
 			}
-			if (i == 0) {
-				console->ppu.is_sprite_0_in_secondary = true;
+			if (entries <= PPU_SPRITES_PER_LINE) {
+				console->ppu.sprite_index_entries[y] = entries + 1;
 			}
-			++entries;
 		}
 	}
 
-	if (entries > 8) {
+	console->ppu.is_sprite_index_dirty = false;
+}
+
+static void populate_secondary_oam(struct nes_emulator_console *console,
+                                   uint8_t y)
+{
+	if (console->ppu.is_sprite_index_dirty) {
+		build_sprite_index(console);
+	}
+
+	uint8_t entries = console->ppu.sprite_index_entries[y];
+	if (entries > PPU_SPRITES_PER_LINE) {
 		console->ppu.is_sprite_overflow = true;
-		console->ppu.secondary_oam_entries = 8;
+		entries = PPU_SPRITES_PER_LINE;
 	}
-	else {
-		console->ppu.secondary_oam_entries = entries;
+
+	/* Copy bytes to Secondary OAM */
+	const uint8_t *sprites = console->ppu.sprite_index[y];
+	for (uint8_t i = 0; i < entries; ++i) {
+		uint8_t offset = sprites[i] * 4;
+		for (uint8_t j = 0; j < 4; ++j) {
+			console->ppu.secondary_oam[i * 4 + j] =
+				console->ppu.oam[offset + j];
+		}
+	}
+
+	console->ppu.is_sprite_0_in_secondary = entries > 0 && sprites[0] == 0;
+	console->ppu.secondary_oam_entries = entries;
+}
+
+static uint8_t sprite_pattern_value(struct nes_emulator_console *console,
+                                    const uint8_t *sprite,
+                                    uint8_t x,
+                                    uint8_t y)
+{
+	uint8_t y_top = sprite[0];
+	uint8_t y_offset = y - y_top;
+
+	uint8_t attribute = sprite[2];
+	bool flip_vertical = attribute & 0x80;
+	bool flip_horizontal = attribute & 0x40;
+
+	uint8_t x_left = sprite[3];
+	uint8_t x_offset = x - x_left;
+
+	uint8_t tile_index = sprite[1];
+	uint16_t sprite_address = console->ppu.sprite_address;
+
+	if (control_sprite_size_8_x_16(console)) {
+		sprite_address = 0x0000;
+	}
+	if (flip_vertical) {
+		y_offset = 7 - y_offset;
+	}
+	if (flip_horizontal) {
+		x_offset = 7 - x_offset;
+	}
+	uint8_t pixel_index = y_offset * 8 + x_offset;
+	uint8_t pixel_byte_offset = pixel_index / 8;
+	uint8_t pixel_bit_position = 7 - pixel_index % 8;
+
+	/* TODO: Refactor */
+	const uint8_t BYTES_PER_TILE = 16;
+	uint16_t low_byte_address = sprite_address
+	                            + tile_index * BYTES_PER_TILE
+	                            + pixel_byte_offset;
+	const uint8_t HIGH_BYTE_OFFSET = 8;
+	uint16_t high_byte_address = sprite_address
+	                             + tile_index * BYTES_PER_TILE
+	                             + pixel_byte_offset
+	                             + HIGH_BYTE_OFFSET;
+	uint8_t low_byte = page_read(console, low_byte_address);
+	uint8_t high_byte = page_read(console, high_byte_address);
+	uint8_t pixel_value = 0;
+	if (low_byte & (1 << pixel_bit_position)) {
+		pixel_value |= 0x01;
 	}
+	if (high_byte & (1 << pixel_bit_position)) {
+		pixel_value |= 0x02;
+	}
+	return pixel_value;
 }
 
 static void sprite_pixel(struct nes_emulator_console *console,
@@ -411,56 +677,16 @@ static void sprite_pixel(struct nes_emulator_console *console,
 
 	*is_sprite_0_hit = false;
 	for (uint8_t i = 0; i < console->ppu.secondary_oam_entries; ++i) {
-		uint8_t offset = i * 4;
-		uint8_t y_top = console->ppu.secondary_oam[offset];
-		uint8_t y_offset = y - y_top;
-
-		uint8_t attribute = console->ppu.secondary_oam[offset + 2];
-		bool flip_vertical = attribute & 0x80;
-		bool flip_horizontal = attribute & 0x40;
+		const uint8_t *sprite = console->ppu.secondary_oam + i * 4;
+		uint8_t attribute = sprite[2];
 
-		uint8_t x_left = console->ppu.secondary_oam[offset + 3];
+		uint8_t x_left = sprite[3];
 		if (!(x >= x_left && x <= (x_left + 7))) {
 			continue;
 		}
-		uint8_t x_offset = x - x_left;
 
 		/* This tile is within range */
-		uint8_t tile_index = console->ppu.secondary_oam[offset + 1];
-		uint16_t sprite_address = console->ppu.sprite_address;
-
-		if (control_sprite_size_8_x_16(console)) {
-			sprite_address = 0x0000;
-		}
-		if (flip_vertical) {
-			y_offset = 7 - y_offset;
-		}
-		if (flip_horizontal) {
-			x_offset = 7 - x_offset;
-		}
-		uint8_t pixel_index = pixel_index = y_offset * 8 + x_offset;
-		uint8_t pixel_byte_offset = pixel_index / 8;
-		uint8_t pixel_bit_position = 7 - pixel_index % 8;
-
-		/* TODO: Refactor */
-		const uint8_t BYTES_PER_TILE = 16;
-		uint16_t low_byte_address = sprite_address
-		                            + tile_index * BYTES_PER_TILE
-		                            + pixel_byte_offset;
-		const uint8_t HIGH_BYTE_OFFSET = 8;
-		uint16_t high_byte_address = sprite_address
-		                             + tile_index * BYTES_PER_TILE
-		                             + pixel_byte_offset
-		                             + HIGH_BYTE_OFFSET;
-		uint8_t low_byte = ppu_bus_read(console, low_byte_address);
-		uint8_t high_byte = ppu_bus_read(console, high_byte_address);
-		*pixel_value = 0;
-		if (low_byte & (1 << pixel_bit_position)) {
-			*pixel_value |= 0x01;
-		}
-		if (high_byte & (1 << pixel_bit_position)) {
-			*pixel_value |= 0x02;
-		}
+		*pixel_value = sprite_pattern_value(console, sprite, x, y);
 		if (*pixel_value == 0) {
 			continue;
 		}
@@ -472,8 +698,9 @@ static void sprite_pixel(struct nes_emulator_console *console,
 
 		/* Lookup palette */
 		uint8_t palette_index = attribute & 0x03;
-		uint16_t palette_address = 0x3F10 + 4 * palette_index + *pixel_value;
-		*pixel_colour = ppu_bus_read(console, palette_address);
+		*pixel_colour = palette_read(console,
+		                             0x10 + 4 * palette_index
+		                             + *pixel_value);
 		return;
 	}
 }
@@ -485,7 +712,7 @@ static uint8_t background_pixel_value(
 	uint8_t fine_x = console->ppu.current_x;
 	uint16_t v = console->ppu.internal_registers.v;
 	uint8_t fine_y = (v & 0x7000) >> 12;
-	uint8_t tile_index = ppu_bus_read(console, tile_address);
+	uint8_t tile_index = page_read(console, tile_address);
 
 	const uint8_t TILE_PIXELS_PER_ROW = 8;
 	uint8_t pixel_index = fine_y * TILE_PIXELS_PER_ROW + fine_x;
@@ -500,8 +727,8 @@ static uint8_t background_pixel_value(
 	const uint8_t HIGH_BYTE_OFFSET = 8;
 	uint16_t high_byte_address = low_byte_address
 	                             + HIGH_BYTE_OFFSET;
-	uint8_t low_byte = ppu_bus_read(console, low_byte_address);
-	uint8_t high_byte = ppu_bus_read(console, high_byte_address);
+	uint8_t low_byte = page_read(console, low_byte_address);
+	uint8_t high_byte = page_read(console, high_byte_address);
 	uint8_t pixel_value = 0;
 	if (low_byte & (1 << pixel_bit_position)) {
 		pixel_value |= 0x01;
@@ -512,31 +739,134 @@ static uint8_t background_pixel_value(
 	return pixel_value;
 }
 
-static uint8_t background_pixel_colour(struct nes_emulator_console *console,
-                                       uint8_t pixel_value)
+static uint8_t background_attribute_value(
+	struct nes_emulator_console *console)
 {
-	/* Default background colour */
-	if (pixel_value == 0) {
-		return ppu_bus_read(console, 0x3F00);
-	}
-
 	/* Lookup attribute */
 	uint16_t attribute_address = get_attribute_address(console);
-	uint8_t attribute_byte = ppu_bus_read(console, attribute_address);
+	uint8_t attribute_byte = page_read(console, attribute_address);
 
 	uint16_t v = console->ppu.internal_registers.v;
 	uint8_t shift = (v & 0x0040) >> 4 | (v & 0x0002);
 	uint8_t mask = 0x03 << shift;
-	uint8_t attribute_value = (attribute_byte & mask) >> shift;
+	return (attribute_byte & mask) >> shift;
+}
+
+static void decode_background_tile(struct nes_emulator_console *console,
+                                   uint8_t tile_x,
+                                   uint8_t tile_y)
+{
+	uint8_t nametable = (tile_y / 30) * 2 + tile_x / 32;
+	uint8_t coarse_x = tile_x % 32;
+	uint8_t coarse_y = tile_y % 30;
+	const uint8_t *page = console->ppu.pages[8 + nametable];
+
+	uint8_t tile_index = page[coarse_y * 32 + coarse_x];
+	uint8_t attribute_byte = page[0x03C0 + (coarse_y / 4) * 8
+	                              + coarse_x / 4];
+	uint8_t shift = (coarse_y & 0x02) << 1 | (coarse_x & 0x02);
+	uint8_t attribute_value = (attribute_byte >> shift) & 0x03;
+
+	const uint8_t BYTES_PER_TILE = 16;
+	const uint8_t HIGH_BYTE_OFFSET = 8;
+	uint16_t tile_address = console->ppu.background_address
+	                        + tile_index * BYTES_PER_TILE;
+	for (uint8_t fine_y = 0; fine_y < 8; ++fine_y) {
+		uint8_t low_byte = page_read(console, tile_address + fine_y);
+		uint8_t high_byte = page_read(console, tile_address + fine_y
+		                                       + HIGH_BYTE_OFFSET);
+		uint8_t *row = console->ppu.background_cache[tile_y * 8 + fine_y]
+		               + tile_x * 8;
+		for (uint8_t fine_x = 0; fine_x < 8; ++fine_x) {
+			uint8_t bit = 7 - fine_x;
+			uint8_t pixel_value = ((low_byte >> bit) & 0x01)
+			                      | (((high_byte >> bit) & 0x01) << 1);
+			row[fine_x] = attribute_value << 2 | pixel_value;
+		}
+	}
+
+	console->ppu.is_background_tile_dirty[tile_y][tile_x] = false;
+}
+
+/* Palette index of the background pixel at v and the current fine x */
+static uint8_t background_pixel(struct nes_emulator_console *console)
+{
+	uint16_t v = console->ppu.internal_registers.v;
+	uint8_t coarse_y = (v & 0x03E0) >> 5;
+
+	/* Rows 30 and 31 fetch attribute bytes as tiles, and a pattern table
+	   switch since the start of the frame leaves the cache stale */
+	if (coarse_y >= 30 || console->ppu.background_address
+	                      != console->ppu.background_cache_address) {
+		uint8_t pixel_value = background_pixel_value(console);
+		if (pixel_value == 0) {
+			return 0;
+		}
+		return background_attribute_value(console) << 2 | pixel_value;
+	}
 
-	const uint8_t ENTRY_SIZE = 4;
-	uint8_t palette_index = ENTRY_SIZE * attribute_value + pixel_value;
-	return console->ppu.palette[palette_index];
+	if (console->ppu.is_background_cache_dirty) {
+		memset(console->ppu.is_background_tile_dirty, true,
+		       sizeof(console->ppu.is_background_tile_dirty));
+		console->ppu.is_background_cache_dirty = false;
+	}
+
+	uint8_t nametable = (v & 0x0C00) >> 10;
+	uint8_t tile_x = (nametable & 0x01) * 32 + (v & 0x001F);
+	uint8_t tile_y = (nametable >> 1) * 30 + coarse_y;
+	if (console->ppu.is_background_tile_dirty[tile_y][tile_x]) {
+		decode_background_tile(console, tile_x, tile_y);
+	}
+
+	uint8_t fine_y = (v & 0x7000) >> 12;
+	return console->ppu.background_cache[tile_y * 8 + fine_y]
+	                                    [tile_x * 8 + console->ppu.current_x];
+}
+
+static uint8_t background_pixel_colour(struct nes_emulator_console *console,
+                                       uint8_t pixel)
+{
+	/* Default background colour */
+	if ((pixel & 0x03) == 0) {
+		return console->ppu.palette[0x00];
+	}
+	return console->ppu.palette[pixel];
+}
+
+static void finish_frame_stats(struct nes_emulator_console *console)
+{
+	struct nes_emulator_frame_stats *stats = &console->ppu.frame_stats;
+	uint64_t elapsed = ppu_now_nsec() - console->ppu.frame_start_nsec;
+	if (console->ppu.is_replaying) {
+		stats->render_nsec = elapsed;
+		return;
+	}
+	++stats->frame;
+	stats->cpu_instructions = console->frame_cpu_instructions;
+	stats->input_nsec = console->frame_input_nsec;
+	stats->emulation_nsec = elapsed;
+	/* The samples only give the split, scaling them up misses what the
+	   untimed steps cost, so the parts add up to the measured total */
+	uint64_t sampled_nsec = console->profile_cpu_nsec
+	                        + console->profile_ppu_nsec;
+	if (sampled_nsec != 0) {
+		stats->cpu_nsec = (uint64_t) ((double) elapsed
+		                              * console->profile_cpu_nsec
+		                              / sampled_nsec);
+		stats->ppu_nsec = elapsed - stats->cpu_nsec;
+	}
+	else {
+		stats->cpu_nsec = 0;
+		stats->ppu_nsec = 0;
+	}
+	stats->render_nsec = 0;
 }
 
 static void ppu_vertical_blank_start(struct nes_emulator_console *console)
 {
+	finish_frame_stats(console);
 	vertical_blank(console);
+	++console->ppu.vertical_blanks;
 
 	console->ppu.nmi_occurred = true;
 
@@ -548,6 +878,24 @@ static void ppu_vertical_blank_start(struct nes_emulator_console *console)
 	if (console->ppu.nmi_output) {
 		cpu_generate_nmi(console);
 	}
+
+	/* The frame log ends after this cycle, 241 1 */
+	if (console->ppu.render_thread != NULL) {
+		console->ppu.scan_line = 241;
+		console->ppu.cycle = 2;
+		render_thread_submit(console);
+	}
+
+	if (!console->ppu.is_replaying) {
+		console->ppu.is_occluded = is_occluded(console);
+		console->is_profiling = is_profiling(console);
+		console->ppu.frame_start_nsec = ppu_now_nsec();
+		console->frame_cpu_instructions = 0;
+		console->frame_input_nsec = 0;
+		console->profile_cpu_nsec = 0;
+		console->profile_ppu_nsec = 0;
+		console->profile_ppu_start_nsec = console->ppu.frame_start_nsec;
+	}
 }
 
 static void ppu_vertical_blank_end(struct nes_emulator_console *console)
@@ -573,45 +921,34 @@ static void copy_vertical(struct nes_emulator_console *console)
 	console->ppu.internal_registers.v = v;
 }
 
-static void handle_pixel(struct nes_emulator_console *console,
-                         uint8_t x,
-                         uint8_t y)
+/* Always inlined into the pixel pipelines, which pass constant layers */
+static inline __attribute__((always_inline))
+void handle_pixel(struct nes_emulator_console *console,
+                  uint8_t x,
+                  uint8_t y,
+                  bool show_background_layer,
+                  bool show_sprite_layer)
 {
-	uint8_t bg_pixel_value = 0;
-	uint8_t bg_pixel_colour = ppu_bus_read(console, 0x3F00);
+	uint8_t bg_pixel = 0;
 
 	uint8_t sprite_pixel_value = 0;
 	uint8_t sprite_pixel_colour;
 	bool is_sprite_0_hit;
 	bool is_sprite_behind_background;
 
-	if (x < 8) {
-		if (mask_show_leftmost_background(console)) {
-			bg_pixel_value = background_pixel_value(console);
-			bg_pixel_colour = background_pixel_colour(
-				console, bg_pixel_value);
-		}
-		if (mask_show_leftmost_sprites(console)) {
-			sprite_pixel(console, x, y,
-			             &sprite_pixel_value, &sprite_pixel_colour,
-			             &is_sprite_0_hit,
-			             &is_sprite_behind_background);
-		}
+	if (show_background_layer) {
+		bg_pixel = background_pixel(console);
 	}
-	else {
-		if (mask_show_background(console)) {
-			bg_pixel_value = background_pixel_value(console);
-			bg_pixel_colour = background_pixel_colour(
-				console, bg_pixel_value);
-		}
-		if (mask_show_sprites(console)) {
-			sprite_pixel(console, x, y,
-			             &sprite_pixel_value, &sprite_pixel_colour,
-			             &is_sprite_0_hit,
-			             &is_sprite_behind_background);
-		}
+	if (show_sprite_layer) {
+		sprite_pixel(console, x, y,
+		             &sprite_pixel_value, &sprite_pixel_colour,
+		             &is_sprite_0_hit,
+		             &is_sprite_behind_background);
 	}
 
+	uint8_t bg_pixel_value = bg_pixel & 0x03;
+	uint8_t bg_pixel_colour = background_pixel_colour(console, bg_pixel);
+
 	if (sprite_pixel_value != 0) {
 		if (bg_pixel_value != 0 && x != 255 && is_sprite_0_hit
 		    && ((console->ppu.status & 0x40) != 0x40)) {
@@ -643,6 +980,15 @@ static void ppu_scan_line_prerender(struct nes_emulator_console *console,
 		         timing is wrong */
 		console->ppu.status = 0;
 		console->ppu.is_sprite_overflow = false;
+
+		/* Start caching the pattern table this frame begins with */
+		uint16_t background_address = console->ppu.background_address;
+		if (console->ppu.background_cache_address
+		    != background_address) {
+			console->ppu.background_cache_address =
+				background_address;
+			invalidate_background_cache(console);
+		}
 	}
 	else if (cycle == 2) {
 		ppu_vertical_blank_end(console);
@@ -657,12 +1003,46 @@ static void ppu_scan_line_prerender(struct nes_emulator_console *console,
 	}
 }
 
+static void check_sprite_0_hit(struct nes_emulator_console *console,
+                               uint8_t x,
+                               uint8_t y)
+{
+	if (y == 0 || x == 255 || (console->ppu.status & 0x40) == 0x40) {
+		return;
+	}
+	if (console->ppu.secondary_oam_entries == 0
+	    || !console->ppu.is_sprite_0_in_secondary) {
+		return;
+	}
+
+	/* Only the columns covered by sprite 0 can hit */
+	const uint8_t *sprite = console->ppu.secondary_oam;
+	uint8_t x_left = sprite[3];
+	if (!(x >= x_left && x <= (x_left + 7))) {
+		return;
+	}
+
+	if (sprite_pattern_value(console, sprite, x, y - 1) == 0) {
+		return;
+	}
+	if ((background_pixel(console) & 0x03) == 0) {
+		return;
+	}
+	console->ppu.status |= 0x40;
+}
+
 static void ppu_scan_line_visible(struct nes_emulator_console *console,
                                   int16_t scan_line,
                                   uint16_t cycle)
 {
-	/* Draw the pixel */
 	uint8_t y = scan_line;
+	if (cycle == 0
+	    && console->ppu.render_mode == NES_EMULATOR_RENDER_MODE_PARALLEL) {
+		console->ppu.scan_line = scan_line;
+		console->ppu.cycle = cycle;
+		render_thread_scan_line(console);
+	}
+
 	if (y != 0 && cycle == 0) {
 		/* TODO: might need +1? */
 		if (is_rendering_disabled(console)) {
@@ -672,7 +1052,35 @@ static void ppu_scan_line_visible(struct nes_emulator_console *console,
 			populate_secondary_oam(console, y - 1);
 		}
 	}
-	else if (cycle >= 1 && cycle <= 256) {
+	else if (cycle >= 257 && cycle <= 340) {
+		if (mask_show_background(console)) {
+			reset_horizontal(console);
+		}
+	}
+}
+
+/* Pixels from cycle up to end with the layers fixed for the whole run,
+   the leftmost 8 pixels are a run of their own */
+static inline __attribute__((always_inline))
+void pixel_run(struct nes_emulator_console *console,
+               uint8_t y,
+               uint16_t cycle,
+               uint16_t end,
+               bool is_render_free,
+               bool show_background_layer,
+               bool show_sprite_layer,
+               bool is_scrolling)
+{
+	if (is_render_free && !is_scrolling
+	    && !(show_background_layer && show_sprite_layer)) {
+		/* Nothing but the fine x reload is visible */
+		if ((cycle - 1) % 8 == 0 || (cycle - 1) / 8 != (end - 2) / 8) {
+			console->ppu.current_x = console->ppu.internal_registers.x;
+		}
+		return;
+	}
+
+	for (; cycle < end; ++cycle) {
 		uint8_t x = cycle - 1;
 
 		if (x % 8 == 0) {
@@ -680,32 +1088,123 @@ static void ppu_scan_line_visible(struct nes_emulator_console *console,
 				console->ppu.internal_registers.x;
 		}
 
-		handle_pixel(console, x, y);
+		/* Draw the pixel */
+		if (is_render_free) {
+			if (show_background_layer && show_sprite_layer) {
+				check_sprite_0_hit(console, x, y);
+			}
+		}
+		else if (!show_background_layer && !show_sprite_layer) {
+			render_pixel(console, x, y, console->ppu.palette[0x00]);
+		}
+		else {
+			handle_pixel(console, x, y,
+			             show_background_layer, show_sprite_layer);
+		}
 
-		if (mask_show_background(console)) {
+		if (is_scrolling) {
 			fine_x_increment(console);
 			if (cycle == 256) {
 				fine_y_increment(console);
 			}
 		}
 	}
-	else if (cycle >= 257 && cycle <= 340) {
-		if (mask_show_background(console)) {
-			reset_horizontal(console);
-		}
+}
+
+/* Masks out of PPUMASK, the leftmost bits only apply to pixels 0-7 */
+#define PIXEL_PIPELINE(render_free, mask)                                    \
+static void pixel_pipeline_##render_free##_##mask(                           \
+	struct nes_emulator_console *console,                                \
+	uint8_t y,                                                           \
+	uint16_t cycle,                                                      \
+	uint16_t end)                                                        \
+{                                                                            \
+	uint16_t left_end = end < 9 ? end : 9;                               \
+	if (cycle < left_end) {                                              \
+		pixel_run(console, y, cycle, left_end, render_free,          \
+		          (mask) & 0x02, (mask) & 0x04, (mask) & 0x08);      \
+		cycle = left_end;                                            \
+	}                                                                    \
+	if (cycle < end) {                                                   \
+		pixel_run(console, y, cycle, end, render_free,               \
+		          (mask) & 0x08, (mask) & 0x10, (mask) & 0x08);      \
+	}                                                                    \
+}
+
+#define PIXEL_PIPELINES(render_free)                                         \
+	PIXEL_PIPELINE(render_free, 0x00) PIXEL_PIPELINE(render_free, 0x02)  \
+	PIXEL_PIPELINE(render_free, 0x04) PIXEL_PIPELINE(render_free, 0x06)  \
+	PIXEL_PIPELINE(render_free, 0x08) PIXEL_PIPELINE(render_free, 0x0A)  \
+	PIXEL_PIPELINE(render_free, 0x0C) PIXEL_PIPELINE(render_free, 0x0E)  \
+	PIXEL_PIPELINE(render_free, 0x10) PIXEL_PIPELINE(render_free, 0x12)  \
+	PIXEL_PIPELINE(render_free, 0x14) PIXEL_PIPELINE(render_free, 0x16)  \
+	PIXEL_PIPELINE(render_free, 0x18) PIXEL_PIPELINE(render_free, 0x1A)  \
+	PIXEL_PIPELINE(render_free, 0x1C) PIXEL_PIPELINE(render_free, 0x1E)
+
+PIXEL_PIPELINES(0)
+PIXEL_PIPELINES(1)
+
+#define PIXEL_PIPELINE_TABLE(render_free) {                                  \
+	pixel_pipeline_##render_free##_0x00,                                 \
+	pixel_pipeline_##render_free##_0x02,                                 \
+	pixel_pipeline_##render_free##_0x04,                                 \
+	pixel_pipeline_##render_free##_0x06,                                 \
+	pixel_pipeline_##render_free##_0x08,                                 \
+	pixel_pipeline_##render_free##_0x0A,                                 \
+	pixel_pipeline_##render_free##_0x0C,                                 \
+	pixel_pipeline_##render_free##_0x0E,                                 \
+	pixel_pipeline_##render_free##_0x10,                                 \
+	pixel_pipeline_##render_free##_0x12,                                 \
+	pixel_pipeline_##render_free##_0x14,                                 \
+	pixel_pipeline_##render_free##_0x16,                                 \
+	pixel_pipeline_##render_free##_0x18,                                 \
+	pixel_pipeline_##render_free##_0x1A,                                 \
+	pixel_pipeline_##render_free##_0x1C,                                 \
+	pixel_pipeline_##render_free##_0x1E,                                 \
+}
+
+/* Indexed by whether pixels are produced, then PPUMASK bits 1-4 */
+static void (*const PIXEL_PIPELINES[2][16])(struct nes_emulator_console *,
+                                            uint8_t,
+                                            uint16_t,
+                                            uint16_t) = {
+	PIXEL_PIPELINE_TABLE(0),
+	PIXEL_PIPELINE_TABLE(1),
+};
+
+/* Cycles 1-256 of a visible scan line, one pixel each. PPUMASK can only
+   change between runs, so the pipeline is picked once per run. */
+static void ppu_scan_line_pixels(struct nes_emulator_console *console,
+                                 int16_t scan_line,
+                                 uint16_t cycle,
+                                 uint16_t count)
+{
+	bool is_render_free =
+		console->ppu.render_mode != NES_EMULATOR_RENDER_MODE_FULL
+		|| console->ppu.is_render_skipped;
+	uint8_t mask = (console->ppu.mask & 0x1E) >> 1;
+	PIXEL_PIPELINES[is_render_free][mask](console, scan_line,
+	                                      cycle, cycle + count);
+
+	if (!is_render_free && cycle + count == 257) {
+		ppu_deliver_scan_line(console, scan_line);
 	}
 }
 
+static const int16_t SCAN_LINE_PRERENDER = -1;
+static const int16_t SCAN_LINE_VISIBLE_START = 0;
+static const int16_t SCAN_LINE_VISIBLE_END = 239;
+static const int16_t SCAN_LINE_POST_RENDER = 240;
+static const int16_t SCAN_LINE_VERTICAL_BLANK_START = 241;
+static const int16_t SCAN_LINE_LAST = 260;
+
+static const uint16_t CYCLES_PER_SCAN_LINE = 341;
+static const uint16_t SCAN_LINES_PER_FRAME = 262;
+
 static void ppu_single_cycle(struct nes_emulator_console *console,
                              int16_t scan_line,
                              uint16_t cycle)
 {
-	const int16_t SCAN_LINE_PRERENDER = -1;
-	const int16_t SCAN_LINE_VISIBLE_START = 0;
-	const int16_t SCAN_LINE_VISIBLE_END = 239;
-	const int16_t SCAN_LINE_POST_RENDER = 240;
-	const int16_t SCAN_LINE_VERTICAL_BLANK_START = 241;
-
 	if (scan_line == SCAN_LINE_PRERENDER) {
 		ppu_scan_line_prerender(console, cycle);
 	}
@@ -721,21 +1220,74 @@ static void ppu_single_cycle(struct nes_emulator_console *console,
 	}
 }
 
-uint8_t ppu_step(struct nes_emulator_console *console)
+/* Number of cycles from this one to the next cycle that has any effect,
+   every cycle in between is a no-op (or repeats what this one did) */
+static uint32_t cycles_to_next_event(int16_t scan_line, uint16_t cycle)
 {
-	uint16_t cycle = console->ppu.cycle;
-	int16_t scan_line = console->ppu.scan_line;
-	for (uint16_t i = 0; i < console->cpu_step_cycles * 3; ++i) {
+	uint32_t to_next_scan_line = CYCLES_PER_SCAN_LINE - cycle;
+	uint32_t to_next_frame = (SCAN_LINE_LAST - scan_line)
+	                         * CYCLES_PER_SCAN_LINE
+	                         + to_next_scan_line;
 
-		ppu_single_cycle(console, scan_line, cycle);
+	if (scan_line == SCAN_LINE_PRERENDER) {
+		if (cycle < 2) {
+			return 2 - cycle;
+		}
+		else if (cycle < 257) {
+			return 257 - cycle;
+		}
+		else if (cycle < 280) {
+			return 280 - cycle;
+		}
+		return to_next_scan_line;
+	}
+	else if (scan_line <= SCAN_LINE_VISIBLE_END) {
+		/* Horizontal resets after the last pixel are idempotent */
+		if (cycle < 257) {
+			return 1;
+		}
+		return to_next_scan_line;
+	}
+	else if (scan_line == SCAN_LINE_POST_RENDER) {
+		return to_next_scan_line + 1;
+	}
+	else if (scan_line == SCAN_LINE_VERTICAL_BLANK_START && cycle < 1) {
+		return 1 - cycle;
+	}
+	return to_next_frame;
+}
 
-		cycle += 1;
-		if (cycle > 340) {
-			cycle = 0;
-			scan_line += 1;
-			if (scan_line > 260) {
-				scan_line = -1;
+void ppu_run(struct nes_emulator_console *console, uint32_t cycles)
+{
+	uint16_t cycle = console->ppu.cycle;
+	int16_t scan_line = console->ppu.scan_line;
+	uint32_t remaining = cycles;
+	while (remaining > 0) {
+
+		uint32_t skip;
+		if (scan_line >= SCAN_LINE_VISIBLE_START
+		    && scan_line <= SCAN_LINE_VISIBLE_END
+		    && cycle >= 1 && cycle <= 256) {
+			skip = 257 - cycle;
+			if (skip > remaining) {
+				skip = remaining;
 			}
+			ppu_scan_line_pixels(console, scan_line, cycle, skip);
+		}
+		else {
+			ppu_single_cycle(console, scan_line, cycle);
+			skip = cycles_to_next_event(scan_line, cycle);
+			if (skip > remaining) {
+				skip = remaining;
+			}
+		}
+		remaining -= skip;
+
+		uint32_t next_cycle = cycle + skip;
+		scan_line += next_cycle / CYCLES_PER_SCAN_LINE;
+		cycle = next_cycle % CYCLES_PER_SCAN_LINE;
+		if (scan_line > SCAN_LINE_LAST) {
+			scan_line -= SCAN_LINES_PER_FRAME;
 		}
 
 		/* Even odd frames? */
@@ -748,5 +1300,137 @@ uint8_t ppu_step(struct nes_emulator_console *console)
 	}
 	console->ppu.cycle = cycle;
 	console->ppu.scan_line = scan_line;
+}
+
+uint8_t ppu_step(struct nes_emulator_console *console)
+{
+	ppu_run(console, console->cpu_step_cycles * 3);
 	return 0;
 }
+
+/* Cycles since the start of the prerender scan line */
+uint32_t ppu_frame_cycle(struct nes_emulator_console *console)
+{
+	return (console->ppu.scan_line - SCAN_LINE_PRERENDER)
+	       * CYCLES_PER_SCAN_LINE + console->ppu.cycle;
+}
+
+void ppu_oam_write(struct nes_emulator_console *console,
+                   uint8_t address,
+                   uint8_t value)
+{
+	console->ppu.oam[address] = value;
+	console->ppu.is_sprite_index_dirty = true;
+}
+
+/* Nametables are compared a page at a time, most are unchanged */
+static void invalidate_changed_tiles(struct nes_emulator_console *console,
+                                     uint8_t *memory,
+                                     const uint8_t *state,
+                                     uint16_t size)
+{
+	for (uint16_t page = 0; page < size; page += PPU_PAGE_SIZE) {
+		if (memcmp(memory + page, state + page, PPU_PAGE_SIZE) == 0) {
+			continue;
+		}
+		for (uint16_t i = 0; i < PPU_PAGE_SIZE; ++i) {
+			if (memory[page + i] != state[page + i]) {
+				invalidate_background_tiles(console,
+				                            memory + page, i);
+			}
+		}
+	}
+}
+
+/* Only the caches affected by memory that differs from a console state
+   about to be loaded are invalidated */
+void ppu_invalidate_state(struct nes_emulator_console *console,
+                          const uint8_t *state)
+{
+	const uint8_t *ram = state
+	                     + offsetof(struct nes_emulator_console, ppu.ram);
+	const uint8_t *chr = state + offsetof(struct nes_emulator_console, chr);
+	const uint8_t *vram = state
+	                      + offsetof(struct nes_emulator_console, vram);
+
+	invalidate_changed_tiles(console, console->ppu.ram, ram, PPU_RAM_SIZE);
+	invalidate_changed_tiles(console, console->vram, vram,
+	                         CARTRIDGE_VRAM_SIZE);
+	uint16_t address = console->ppu.background_cache_address;
+	if (memcmp(console->chr + address, chr + address, 0x1000) != 0) {
+		invalidate_background_cache(console);
+	}
+	console->ppu.is_sprite_index_dirty = true;
+}
+
+bool ppu_is_state_valid(const uint8_t *state)
+{
+	uint8_t secondary_oam_entries;
+	uint8_t computed_address_increment;
+	uint16_t background_address;
+	uint16_t sprite_address;
+	uint16_t nametable_address;
+	uint16_t cycle;
+	int16_t scan_line;
+	struct ppu_internal_registers internal_registers;
+	uint8_t current_x;
+	CONSOLE_STATE_READ(secondary_oam_entries, state,
+	                   ppu.secondary_oam_entries);
+	CONSOLE_STATE_READ(computed_address_increment, state,
+	                   ppu.computed_address_increment);
+	CONSOLE_STATE_READ(background_address, state, ppu.background_address);
+	CONSOLE_STATE_READ(sprite_address, state, ppu.sprite_address);
+	CONSOLE_STATE_READ(nametable_address, state, ppu.nametable_address);
+	CONSOLE_STATE_READ(cycle, state, ppu.cycle);
+	CONSOLE_STATE_READ(scan_line, state, ppu.scan_line);
+	CONSOLE_STATE_READ(internal_registers, state, ppu.internal_registers);
+	CONSOLE_STATE_READ(current_x, state, ppu.current_x);
+
+	/* The addresses are the ones a control write sets */
+	if ((background_address != 0x0000 && background_address != 0x1000)
+	    || (sprite_address != 0x0000 && sprite_address != 0x1000)
+	    || nametable_address < 0x2000 || nametable_address > 0x2C00
+	    || (nametable_address & 0x03FF) != 0
+	    || (computed_address_increment != 1
+	        && computed_address_increment != 32)) {
+		return false;
+	}
+	if (secondary_oam_entries > PPU_SPRITES_PER_LINE
+	    || cycle >= CYCLES_PER_SCAN_LINE
+	    || scan_line < SCAN_LINE_PRERENDER || scan_line > SCAN_LINE_LAST) {
+		return false;
+	}
+	/* v and t are 15 bits, x is the 3 bit fine scroll */
+	if (internal_registers.v > 0x7FFF || internal_registers.t > 0x7FFF
+	    || internal_registers.x > 7 || internal_registers.w > 1
+	    || current_x > 7) {
+		return false;
+	}
+	return CONSOLE_STATE_IS_BOOL(state, ppu.is_sprite_0_in_secondary)
+	       && CONSOLE_STATE_IS_BOOL(state, ppu.is_sprite_overflow)
+	       && CONSOLE_STATE_IS_BOOL(state, ppu.nmi_output)
+	       && CONSOLE_STATE_IS_BOOL(state, ppu.nmi_occurred);
+}
+
+void ppu_save_registers(struct nes_emulator_console *console,
+                        uint8_t *registers)
+{
+	memcpy(registers, (uint8_t *) &console->ppu + PPU_REGISTERS_OFFSET,
+	       PPU_REGISTERS_SIZE);
+}
+
+/* Also starts caching the pattern table in use, there is no prerender
+   scan line to do it when replaying from the middle of a frame */
+void ppu_load_registers(struct nes_emulator_console *console,
+                        const uint8_t *registers)
+{
+	memcpy((uint8_t *) &console->ppu + PPU_REGISTERS_OFFSET, registers,
+	       PPU_REGISTERS_SIZE);
+	console->ppu.is_sprite_index_dirty = true;
+
+	uint16_t background_address = console->ppu.background_address;
+	if (console->ppu.background_cache_address != background_address) {
+		console->ppu.background_cache_address = background_address;
+		invalidate_background_cache(console);
+	}
+}
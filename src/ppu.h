@@ -21,21 +21,79 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-struct nes_emulator_console;
+#include "nes_emulator.h"
 
 #define PPU_RAM_SIZE           0x0800 /*   2 KiB */
 #define PPU_PALETTE_SIZE       0x0020 /*  32 B   */
 #define PPU_OAM_SIZE           0x0100 /* 256 B   */
 #define PPU_SECONDARY_OAM_SIZE 0x0020 /*  32 B   */
+#define PPU_SPRITES            64
+#define PPU_SPRITES_PER_LINE   8
+#define PPU_VISIBLE_SCAN_LINES 240
+#define PPU_SCREEN_WIDTH       256
+#define PPU_PAGE_SIZE          0x0400 /*   1 KiB */
+#define PPU_PAGES              16
+#define PPU_CYCLES_PER_SCAN_LINE 341
+#define PPU_CYCLES_PER_FRAME   (PPU_CYCLES_PER_SCAN_LINE * 262)
+
+/* All four nametables side by side, 64x60 tiles */
+#define PPU_BACKGROUND_CACHE_WIDTH  512
+#define PPU_BACKGROUND_CACHE_HEIGHT 480
+#define PPU_BACKGROUND_CACHE_TILES_X 64
+#define PPU_BACKGROUND_CACHE_TILES_Y 60
 #define PPU_BACKENDS_MAX 3
 
+/* Measured for each frame delivered to the backends */
+struct nes_emulator_frame_stats {
+	uint64_t frame;
+	uint32_t cpu_instructions;
+	/* When the first button press the game read during the frame
+	   happened, on CLOCK_MONOTONIC, 0 for none */
+	int64_t input_nsec;
+	/* Wall time emulating the frame, not counting the time the backends
+	   took with the previous one */
+	uint64_t emulation_nsec;
+	/* The emulation time split by sampled steps while profiling,
+	   otherwise 0 */
+	uint64_t cpu_nsec;
+	uint64_t ppu_nsec;
+	/* Wall time the render thread took to replay the frame, 0 when the
+	   pixels are produced during emulation */
+	uint64_t render_nsec;
+};
+
+/* Pixels are palette indices. Each finished scan line goes to
+   scanline_ready, or one render_pixel call per pixel for backends without
+   it; frame_ready gets the whole 256x240 frame before vertical_blank, with
+   a flag per line set if it changed since the last frame, and frame_stats
+   gets its timings just before that. Any of them may be NULL.
+
+   joypad1_timestamp is when the joypad1_read buttons last changed, like
+   a controller backend's.
+
+   is_occluded says nothing the backend gets is being shown. While every
+   backend says so the console renders as NONE.
+
+   is_rewinding is asked at each vertical blank while the console records
+   its history, any backend saying so plays it backwards.
+
+   is_profiling is asked at each vertical blank, while any backend says
+   so the frame stats get sampled CPU and PPU times. */
 struct nes_emulator_ppu_backend {
 	void *pointer;
 	void (*render_pixel)(void *, uint8_t, uint8_t, uint8_t);
 	void (*vertical_blank)(void *);
 	uint8_t (*joypad1_read)(void *);
+	int64_t (*joypad1_timestamp)(void *);
+	void (*scanline_ready)(void *, uint8_t, const uint8_t *);
+	void (*frame_ready)(void *, const uint8_t *, const bool *);
+	void (*frame_stats)(void *, const struct nes_emulator_frame_stats *);
+	bool (*is_occluded)(void *);
+	bool (*is_rewinding)(void *);
+	bool (*is_profiling)(void *);
 };
 
 struct ppu_internal_registers {
@@ -45,7 +103,10 @@ struct ppu_internal_registers {
 	uint8_t w;
 };
 
+struct render_thread;
+
 struct ppu {
+	/* Emulation state, everything up to pages is copied by a snapshot */
 	uint8_t ram[PPU_RAM_SIZE];
 	uint8_t palette[PPU_PALETTE_SIZE];
 	uint8_t oam[PPU_OAM_SIZE];
@@ -79,11 +140,81 @@ struct ppu {
 	struct ppu_internal_registers internal_registers;
 	uint8_t current_x;
 
+	/* Pattern tables, then the four logical nametables (repeated for the
+	   $3000 mirror); set whenever the cartridge mapping changes */
+	uint8_t *pages[PPU_PAGES];
+
+	/* Sprites in range of each scan line, in OAM order, rebuilt when OAM
+	   or the sprite size changes. Entries saturate at 9 so the overflow
+	   flag can still be derived. */
+	uint8_t sprite_index[PPU_VISIBLE_SCAN_LINES][PPU_SPRITES_PER_LINE];
+	uint8_t sprite_index_entries[PPU_VISIBLE_SCAN_LINES];
+	bool is_sprite_index_dirty;
+
+	/* Decoded background, each pixel is its palette index (attribute in
+	   bits 2-3, pattern value in bits 0-1). Tiles are decoded on first
+	   use after their nametable, attribute or pattern bytes change. */
+	uint8_t background_cache[PPU_BACKGROUND_CACHE_HEIGHT]
+	                        [PPU_BACKGROUND_CACHE_WIDTH];
+	bool is_background_tile_dirty[PPU_BACKGROUND_CACHE_TILES_Y]
+	                             [PPU_BACKGROUND_CACHE_TILES_X];
+	bool is_background_cache_dirty;
+	uint16_t background_cache_address;
+
+	uint8_t framebuffer[PPU_VISIBLE_SCAN_LINES][PPU_SCREEN_WIDTH];
+	/* Lines as the backends last got them, to flag what changed */
+	uint8_t previous_framebuffer[PPU_VISIBLE_SCAN_LINES][PPU_SCREEN_WIDTH];
+	bool is_line_changed[PPU_VISIBLE_SCAN_LINES];
+
+	uint8_t render_mode;
+	/* The mode to go back to once the backends are shown again */
+	uint8_t requested_render_mode;
+	/* Reported at the last vertical blank, applied before the next step */
+	bool is_occluded;
+	bool is_render_suspended;
+	uint8_t render_workers;
+	struct render_thread *render_thread;
+	/* Set on the render thread's consoles, their frames come with stats
+	   from the emulating console and only the render time is measured */
+	bool is_replaying;
+	/* Frames emulated for their effects only, rendered as NONE and not
+	   delivered to the backends */
+	bool is_render_skipped;
+	/* Every vertical blank start, whether or not the frame is counted */
+	uint32_t vertical_blanks;
+
+	struct nes_emulator_frame_stats frame_stats;
+	uint64_t frame_start_nsec;
+
 	struct nes_emulator_ppu_backend *backends[PPU_BACKENDS_MAX];
 };
 
+/* The registers are the part of the state after the memory, which is
+   all a scan line snapshot needs */
+#define PPU_REGISTERS_OFFSET offsetof(struct ppu, secondary_oam)
+#define PPU_REGISTERS_SIZE   (offsetof(struct ppu, pages) \
+                              - PPU_REGISTERS_OFFSET)
+
 void ppu_init(struct nes_emulator_console *console);
+void ppu_update_pages(struct nes_emulator_console *console);
 uint8_t ppu_step(struct nes_emulator_console *console);
+void ppu_run(struct nes_emulator_console *console, uint32_t cycles);
+uint32_t ppu_frame_cycle(struct nes_emulator_console *console);
+
+void ppu_invalidate_state(struct nes_emulator_console *console,
+                          const uint8_t *state);
+/* Whether a loaded copy of the state only holds values the PPU can
+   reach, several of them index memory */
+bool ppu_is_state_valid(const uint8_t *state);
+void ppu_deliver_scan_line(struct nes_emulator_console *console, uint8_t y);
+void ppu_deliver_frame(struct nes_emulator_console *console);
+uint64_t ppu_now_nsec(void);
+void ppu_update_occlusion(struct nes_emulator_console *console);
+
+void ppu_save_registers(struct nes_emulator_console *console,
+                        uint8_t *registers);
+void ppu_load_registers(struct nes_emulator_console *console,
+                        const uint8_t *registers);
 
 uint8_t ppu_cpu_bus_read(struct nes_emulator_console *console,
                          uint16_t address);
@@ -95,6 +226,12 @@ uint8_t ppu_bus_read(struct nes_emulator_console *console, uint16_t address);
 void ppu_bus_write(struct nes_emulator_console *console,
                    uint16_t address,
                    uint8_t value);
+void ppu_memory_write(struct nes_emulator_console *console,
+                      uint16_t address,
+                      uint8_t value);
+void ppu_oam_write(struct nes_emulator_console *console,
+                   uint8_t address,
+                   uint8_t value);
 
 uint8_t controller_read(struct nes_emulator_console *console);
 
@@ -17,6 +17,7 @@
 #include "ppu.h"
 
 #include "console.h"
+#include "render_thread.h"
 
 #include <stdio.h>
 
@@ -100,6 +101,11 @@ static void ppu_register_ctrl_write(struct nes_emulator_console *console,
 	t += (n << 10);
 	console->ppu.internal_registers.t = t;
 
+	/* Sprite size (0: 8x8 pixels; 1: 8x16 pixels) */
+	if ((value ^ console->ppu.control) & 0x20) {
+		console->ppu.is_sprite_index_dirty = true;
+	}
+
 	console->ppu.control = value;
 }
 
@@ -154,8 +160,13 @@ static uint8_t ppu_register_oam_data_read(struct nes_emulator_console *console)
 static void ppu_register_oam_data_write(struct nes_emulator_console *console,
                                         uint8_t value)
 {
-	console->ppu.oam[console->ppu.oam_address] = value;
-	console->ppu.oam_address += 1;
+	uint8_t address = console->ppu.oam_address;
+	if (console->ppu.render_mode == NES_EMULATOR_RENDER_MODE_PARALLEL) {
+		render_thread_log(console, RENDER_THREAD_ENTRY_OAM_WRITE,
+		                  address, value);
+	}
+	ppu_oam_write(console, address, value);
+	console->ppu.oam_address = address + 1;
 }
 
 static void ppu_register_scroll_write(struct nes_emulator_console *console,
@@ -244,6 +255,13 @@ static void ppu_register_data_write(struct nes_emulator_console *console,
 uint8_t ppu_cpu_bus_read(struct nes_emulator_console *console,
                          uint16_t address)
 {
+	/* Only the status and data reads have side effects to replay */
+	if (console->ppu.render_thread != NULL
+	    && (address % 8 == 2 || address % 8 == 7)) {
+		render_thread_log(console, RENDER_THREAD_ENTRY_REGISTER_READ,
+		                  address % 8, 0);
+	}
+
 	switch (address % 8) {
 	case 2:
 		return ppu_register_status_read(console);
@@ -260,6 +278,11 @@ void ppu_cpu_bus_write(struct nes_emulator_console *console,
                        uint16_t address,
                        uint8_t value)
 {
+	if (console->ppu.render_thread != NULL) {
+		render_thread_log(console, RENDER_THREAD_ENTRY_REGISTER_WRITE,
+		                  address % 8, value);
+	}
+
 	switch (address % 8) {
 	case 0:
 		ppu_register_ctrl_write(console, value);
@@ -0,0 +1,539 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "render_thread.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cartridge.h"
+#include "console.h"
+#include "exit_code.h"
+#include "snapshot.h"
+#include "spsc_queue.h"
+
+/* The most a frame logs is OAM DMA after OAM DMA from the PPU's own
+   page: 256 writes to $2004, the 256 OAM writes they resolve to and 64
+   reads of $2002 and $2007 mirrors, every 4 + 513 CPU cycles. The log
+   holds as many of those as can start in a frame, plus an entry a cycle
+   for whatever else runs between them; anything more splits the frame. */
+#define RENDER_THREAD_DMA_ENTRIES 576
+#define RENDER_THREAD_DMA_CYCLES 517
+#define RENDER_THREAD_FRAME_CPU_CYCLES (PPU_CYCLES_PER_FRAME / 3 + 1)
+#define RENDER_THREAD_ENTRIES_MAX \
+	((RENDER_THREAD_FRAME_CPU_CYCLES / RENDER_THREAD_DMA_CYCLES + 1) \
+	 * RENDER_THREAD_DMA_ENTRIES + RENDER_THREAD_DMA_CYCLES)
+/* A register access is logged with room for the OAM or memory write it
+   resolves to, so a full log ends between accesses */
+#define RENDER_THREAD_ENTRIES_RESERVED 2
+#define RENDER_THREAD_FRAMES 3
+
+struct render_thread_entry {
+	uint32_t cycle; /* Since the start of the frame */
+	uint16_t address; /* Register 0-7, PPU bus or OAM address */
+	uint8_t type;
+	uint8_t value;
+};
+
+/* Everything needed to replay the PPU for one frame: its state at the
+   start and every register access made during it */
+struct render_thread_frame {
+	struct snapshot snapshot;
+	struct nes_emulator_ppu_backend *backends[PPU_BACKENDS_MAX];
+
+	uint32_t start_cycle;
+	uint32_t cycles;
+	/* Part of a frame whose log filled up, replayed whole on the render
+	   thread's console so the next part carries on from its pixels */
+	bool is_split;
+	struct nes_emulator_frame_stats stats;
+
+	uint32_t entries_size;
+	struct render_thread_entry entries[RENDER_THREAD_ENTRIES_MAX];
+
+	/* Registers at cycle 0 of each visible scan line, for parallel
+	   rendering; lines before first_line started before the log did */
+	int16_t first_line;
+	int16_t lines_end;
+	uint32_t line_cycles[PPU_VISIBLE_SCAN_LINES];
+	uint8_t lines[PPU_VISIBLE_SCAN_LINES][PPU_REGISTERS_SIZE];
+};
+
+/* A console the frames are replayed on, its CHR and nametables are part
+   of the state each frame loads */
+struct render_thread_replica {
+	struct nes_emulator_console *console;
+};
+
+struct render_thread_worker {
+	pthread_t thread;
+	struct render_thread *render_thread;
+	struct render_thread_replica replica;
+	sem_t start;
+	int16_t first_line;
+	int16_t lines_end;
+};
+
+struct render_thread {
+	pthread_t thread;
+
+	struct spsc_queue frames;      /* Emulation to render thread */
+	struct spsc_queue free_frames; /* Render to emulation thread */
+
+	/* Being logged by the emulation thread */
+	struct render_thread_frame *frame;
+
+	/* Replays whole frames without workers, or collects the bands each
+	   worker rendered into its framebuffer */
+	struct render_thread_replica replica;
+	uint8_t workers_size;
+	struct render_thread_worker *workers;
+	const struct render_thread_frame *replaying;
+	bool is_stopping;
+	sem_t done;
+
+	struct render_thread_frame storage[RENDER_THREAD_FRAMES];
+};
+
+static uint8_t replica_init(struct render_thread_replica *replica,
+                            struct nes_emulator_cartridge *cartridge)
+{
+	uint8_t exit_code = nes_emulator_console_init(&replica->console);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+
+	/* The state is overwritten by the first frame */
+	replica->console->cartridge = cartridge;
+	replica->console->ppu.is_replaying = true;
+	ppu_update_pages(replica->console);
+	return 0;
+}
+
+static void replica_fini(struct render_thread_replica *replica)
+{
+	nes_emulator_console_fini(&replica->console);
+}
+
+static void begin_frame(struct nes_emulator_console *console)
+{
+	struct render_thread *render_thread = console->ppu.render_thread;
+
+	/* Waits if the render thread is a whole queue of frames behind */
+	struct render_thread_frame *frame;
+	frame = spsc_queue_pop(&render_thread->free_frames);
+
+	snapshot_save(console, &frame->snapshot);
+	frame->start_cycle = ppu_frame_cycle(console);
+	frame->cycles = 0;
+	frame->entries_size = 0;
+	frame->is_split = false;
+	frame->first_line = PPU_VISIBLE_SCAN_LINES;
+	frame->lines_end = PPU_VISIBLE_SCAN_LINES;
+	render_thread->frame = frame;
+}
+
+static uint32_t frame_cycle(struct nes_emulator_console *console,
+                            const struct render_thread_frame *frame)
+{
+	return (ppu_frame_cycle(console) + PPU_CYCLES_PER_FRAME
+	        - frame->start_cycle) % PPU_CYCLES_PER_FRAME;
+}
+
+static void replay_entry(struct nes_emulator_console *console,
+                         const struct render_thread_entry *entry)
+{
+	uint16_t address = 0x2000 | entry->address;
+	switch (entry->type) {
+	case RENDER_THREAD_ENTRY_REGISTER_READ:
+		ppu_cpu_bus_read(console, address);
+		break;
+	case RENDER_THREAD_ENTRY_REGISTER_WRITE:
+		ppu_cpu_bus_write(console, address, entry->value);
+		break;
+	default:
+		break;
+	}
+}
+
+static void replay_frame(struct nes_emulator_console *console,
+                         const struct render_thread_frame *frame)
+{
+	snapshot_load(console, &frame->snapshot);
+	for (size_t i = 0; i < PPU_BACKENDS_MAX; ++i) {
+		console->ppu.backends[i] = frame->backends[i];
+	}
+	console->ppu.frame_stats = frame->stats;
+	console->ppu.frame_start_nsec = ppu_now_nsec();
+
+	uint32_t cycle = 0;
+	for (uint32_t i = 0; i < frame->entries_size; ++i) {
+		const struct render_thread_entry *entry = &frame->entries[i];
+		ppu_run(console, entry->cycle - cycle);
+		cycle = entry->cycle;
+		replay_entry(console, entry);
+	}
+	ppu_run(console, frame->cycles - cycle);
+}
+
+/* Renders the scan lines from first_line up to lines_end. Memory writes
+   before the band are applied directly and the registers come from the
+   snapshot of its first line, so only the band itself is emulated. */
+static void replay_band(struct nes_emulator_console *console,
+                        const struct render_thread_frame *frame,
+                        int16_t first_line,
+                        int16_t lines_end)
+{
+	snapshot_load(console, &frame->snapshot);
+
+	uint32_t band_start = frame->line_cycles[first_line];
+	uint32_t band_end = frame->line_cycles[lines_end - 1]
+	                    + PPU_CYCLES_PER_SCAN_LINE;
+
+	/* Accesses on the first cycle are already in the snapshot */
+	uint32_t i = 0;
+	for (; i < frame->entries_size; ++i) {
+		const struct render_thread_entry *entry = &frame->entries[i];
+		if (entry->cycle > band_start) {
+			break;
+		}
+		if (entry->type == RENDER_THREAD_ENTRY_MEMORY_WRITE) {
+			ppu_memory_write(console, entry->address, entry->value);
+		}
+		else if (entry->type == RENDER_THREAD_ENTRY_OAM_WRITE) {
+			ppu_oam_write(console, entry->address, entry->value);
+		}
+	}
+
+	ppu_load_registers(console, frame->lines[first_line]);
+
+	uint32_t cycle = band_start;
+	for (; i < frame->entries_size; ++i) {
+		const struct render_thread_entry *entry = &frame->entries[i];
+		if (entry->cycle >= band_end) {
+			break;
+		}
+		ppu_run(console, entry->cycle - cycle);
+		cycle = entry->cycle;
+		replay_entry(console, entry);
+	}
+	ppu_run(console, band_end - cycle);
+}
+
+static void *worker_main(void *pointer)
+{
+	struct render_thread_worker *worker = pointer;
+	struct render_thread *render_thread = worker->render_thread;
+	for (;;) {
+		while (sem_wait(&worker->start) == -1) {
+			/* Interrupted by a signal */
+		}
+		if (render_thread->is_stopping) {
+			break;
+		}
+		if (worker->first_line < worker->lines_end) {
+			replay_band(worker->replica.console,
+			            render_thread->replaying,
+			            worker->first_line, worker->lines_end);
+		}
+		sem_post(&render_thread->done);
+	}
+	return NULL;
+}
+
+/* Splits the frame into one band per worker, then hands the lines to the
+   backends in the same order the serial renderer does */
+static void render_frame(struct render_thread *render_thread,
+                         const struct render_thread_frame *frame)
+{
+	uint64_t start_nsec = ppu_now_nsec();
+	int16_t lines = frame->lines_end - frame->first_line;
+	int16_t band_lines = (lines + render_thread->workers_size - 1)
+	                     / render_thread->workers_size;
+
+	render_thread->replaying = frame;
+	int16_t line = frame->first_line;
+	for (uint8_t i = 0; i < render_thread->workers_size; ++i) {
+		struct render_thread_worker *worker;
+		worker = &render_thread->workers[i];
+		worker->first_line = line;
+		line += band_lines;
+		if (line > frame->lines_end) {
+			line = frame->lines_end;
+		}
+		worker->lines_end = line;
+		sem_post(&worker->start);
+	}
+	for (uint8_t i = 0; i < render_thread->workers_size; ++i) {
+		while (sem_wait(&render_thread->done) == -1) {
+			/* Interrupted by a signal */
+		}
+	}
+
+	struct nes_emulator_console *console = render_thread->replica.console;
+	for (uint8_t i = 0; i < render_thread->workers_size; ++i) {
+		struct render_thread_worker *worker;
+		worker = &render_thread->workers[i];
+		struct ppu *ppu = &worker->replica.console->ppu;
+		for (int16_t y = worker->first_line; y < worker->lines_end; ++y) {
+			memcpy(console->ppu.framebuffer[y], ppu->framebuffer[y],
+			       PPU_SCREEN_WIDTH);
+		}
+	}
+
+	for (size_t i = 0; i < PPU_BACKENDS_MAX; ++i) {
+		console->ppu.backends[i] = frame->backends[i];
+	}
+	console->ppu.frame_stats = frame->stats;
+	console->ppu.frame_stats.render_nsec = ppu_now_nsec() - start_nsec;
+	for (int16_t y = frame->first_line; y < frame->lines_end; ++y) {
+		ppu_deliver_scan_line(console, y);
+	}
+	ppu_deliver_frame(console);
+}
+
+static void *render_thread_main(void *pointer)
+{
+	struct render_thread *render_thread = pointer;
+	struct render_thread_frame *frame;
+	while ((frame = spsc_queue_pop(&render_thread->frames)) != NULL) {
+		if (render_thread->workers_size == 0 || frame->is_split) {
+			replay_frame(render_thread->replica.console, frame);
+		}
+		else {
+			render_frame(render_thread, frame);
+		}
+		spsc_queue_push(&render_thread->free_frames, frame);
+	}
+	return NULL;
+}
+
+static void stop_workers(struct render_thread *render_thread, uint8_t size)
+{
+	render_thread->is_stopping = true;
+	for (uint8_t i = 0; i < size; ++i) {
+		struct render_thread_worker *worker;
+		worker = &render_thread->workers[i];
+		sem_post(&worker->start);
+		pthread_join(worker->thread, NULL);
+		sem_destroy(&worker->start);
+		replica_fini(&worker->replica);
+	}
+	free(render_thread->workers);
+}
+
+static uint8_t start_workers(struct render_thread *render_thread,
+                             struct nes_emulator_cartridge *cartridge)
+{
+	render_thread->workers = malloc(render_thread->workers_size
+	                                * sizeof(struct render_thread_worker));
+	if (render_thread->workers == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+
+	for (uint8_t i = 0; i < render_thread->workers_size; ++i) {
+		struct render_thread_worker *worker;
+		worker = &render_thread->workers[i];
+		worker->render_thread = render_thread;
+
+		uint8_t exit_code = replica_init(&worker->replica, cartridge);
+		if (exit_code != 0) {
+			stop_workers(render_thread, i);
+			return exit_code;
+		}
+		if (sem_init(&worker->start, 0, 0) == -1) {
+			replica_fini(&worker->replica);
+			stop_workers(render_thread, i);
+			return EXIT_CODE_OS_ERROR_BIT;
+		}
+		if (pthread_create(&worker->thread, NULL,
+		                   worker_main, worker) != 0) {
+			sem_destroy(&worker->start);
+			replica_fini(&worker->replica);
+			stop_workers(render_thread, i);
+			return EXIT_CODE_OS_ERROR_BIT;
+		}
+	}
+	return 0;
+}
+
+static void render_thread_free(struct render_thread *render_thread)
+{
+	if (render_thread->workers_size > 0) {
+		stop_workers(render_thread, render_thread->workers_size);
+	}
+	sem_destroy(&render_thread->done);
+	spsc_queue_fini(&render_thread->free_frames);
+	spsc_queue_fini(&render_thread->frames);
+	replica_fini(&render_thread->replica);
+	free(render_thread);
+}
+
+/* Without workers each frame is replayed whole on the render thread */
+uint8_t render_thread_start(struct nes_emulator_console *console,
+                            uint8_t workers)
+{
+	struct render_thread *render_thread;
+	uint8_t exit_code;
+
+	render_thread = malloc(sizeof(struct render_thread));
+	if (render_thread == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	render_thread->workers_size = 0;
+	render_thread->is_stopping = false;
+
+	exit_code = replica_init(&render_thread->replica, console->cartridge);
+	if (exit_code != 0) {
+		free(render_thread);
+		return exit_code;
+	}
+
+	exit_code = spsc_queue_init(&render_thread->frames);
+	if (exit_code != 0) {
+		replica_fini(&render_thread->replica);
+		free(render_thread);
+		return exit_code;
+	}
+	exit_code = spsc_queue_init(&render_thread->free_frames);
+	if (exit_code != 0) {
+		spsc_queue_fini(&render_thread->frames);
+		replica_fini(&render_thread->replica);
+		free(render_thread);
+		return exit_code;
+	}
+	if (sem_init(&render_thread->done, 0, 0) == -1) {
+		spsc_queue_fini(&render_thread->free_frames);
+		spsc_queue_fini(&render_thread->frames);
+		replica_fini(&render_thread->replica);
+		free(render_thread);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+
+	if (workers > 0) {
+		render_thread->workers_size = workers;
+		exit_code = start_workers(render_thread, console->cartridge);
+		if (exit_code != 0) {
+			render_thread->workers_size = 0;
+			render_thread_free(render_thread);
+			return exit_code;
+		}
+	}
+
+	for (uint8_t i = 0; i < RENDER_THREAD_FRAMES; ++i) {
+		spsc_queue_push(&render_thread->free_frames,
+		                &render_thread->storage[i]);
+	}
+
+	if (pthread_create(&render_thread->thread, NULL,
+	                   render_thread_main, render_thread) != 0) {
+		render_thread_free(render_thread);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+
+	console->ppu.render_thread = render_thread;
+	begin_frame(console);
+	return 0;
+}
+
+/* Frames already submitted are still rendered, the partial one is not */
+void render_thread_stop(struct nes_emulator_console *console)
+{
+	struct render_thread *render_thread = console->ppu.render_thread;
+
+	spsc_queue_push(&render_thread->frames, NULL);
+	pthread_join(render_thread->thread, NULL);
+
+	render_thread_free(render_thread);
+	console->ppu.render_thread = NULL;
+}
+
+static void push_frame(struct render_thread *render_thread,
+                       struct nes_emulator_console *console)
+{
+	struct render_thread_frame *frame = render_thread->frame;
+	for (size_t i = 0; i < PPU_BACKENDS_MAX; ++i) {
+		frame->backends[i] = console->ppu.backends[i];
+	}
+	frame->stats = console->ppu.frame_stats;
+	spsc_queue_push(&render_thread->frames, frame);
+}
+
+/* Ends the part logged so far where it is and starts the next from the
+   current state, before the access that did not fit */
+static void split_frame(struct nes_emulator_console *console)
+{
+	struct render_thread *render_thread = console->ppu.render_thread;
+	render_thread->frame->cycles = frame_cycle(console,
+	                                           render_thread->frame);
+	render_thread->frame->is_split = true;
+	push_frame(render_thread, console);
+	begin_frame(console);
+	render_thread->frame->is_split = true;
+}
+
+void render_thread_log(struct nes_emulator_console *console,
+                       uint8_t type,
+                       uint16_t address,
+                       uint8_t value)
+{
+	struct render_thread_frame *frame = console->ppu.render_thread->frame;
+	if ((type == RENDER_THREAD_ENTRY_REGISTER_READ
+	     || type == RENDER_THREAD_ENTRY_REGISTER_WRITE)
+	    && frame->entries_size + RENDER_THREAD_ENTRIES_RESERVED
+	       > RENDER_THREAD_ENTRIES_MAX) {
+		split_frame(console);
+		frame = console->ppu.render_thread->frame;
+	}
+
+	struct render_thread_entry *entry;
+	entry = &frame->entries[frame->entries_size];
+	entry->cycle = frame_cycle(console, frame);
+	entry->address = address;
+	entry->type = type;
+	entry->value = value;
+	frame->entries_size += 1;
+}
+
+/* Called at cycle 0 of each visible scan line, before it runs */
+void render_thread_scan_line(struct nes_emulator_console *console)
+{
+	struct render_thread_frame *frame = console->ppu.render_thread->frame;
+
+	int16_t y = console->ppu.scan_line;
+	if (frame->first_line == PPU_VISIBLE_SCAN_LINES) {
+		frame->first_line = y;
+	}
+	frame->lines_end = y + 1;
+	frame->line_cycles[y] = frame_cycle(console, frame);
+	ppu_save_registers(console, frame->lines[y]);
+}
+
+void render_thread_submit(struct nes_emulator_console *console)
+{
+	struct render_thread *render_thread = console->ppu.render_thread;
+	struct render_thread_frame *frame = render_thread->frame;
+
+	/* Ending where it started is a whole frame */
+	frame->cycles = frame_cycle(console, frame);
+	if (frame->cycles == 0) {
+		frame->cycles = PPU_CYCLES_PER_FRAME;
+	}
+	push_frame(render_thread, console);
+	begin_frame(console);
+}
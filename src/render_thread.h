@@ -0,0 +1,50 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct nes_emulator_console;
+
+enum render_thread_entry_type {
+	RENDER_THREAD_ENTRY_REGISTER_READ,
+	RENDER_THREAD_ENTRY_REGISTER_WRITE,
+	/* Resolved effects of register writes, only logged for parallel
+	   rendering so a band can catch up without running the PPU */
+	RENDER_THREAD_ENTRY_MEMORY_WRITE,
+	RENDER_THREAD_ENTRY_OAM_WRITE,
+};
+
+uint8_t render_thread_start(struct nes_emulator_console *console,
+                            uint8_t workers);
+void render_thread_stop(struct nes_emulator_console *console);
+
+void render_thread_log(struct nes_emulator_console *console,
+                       uint8_t type,
+                       uint16_t address,
+                       uint8_t value);
+void render_thread_scan_line(struct nes_emulator_console *console);
+void render_thread_submit(struct nes_emulator_console *console);
+
+#ifdef __cpluscplus
+}
+#endif
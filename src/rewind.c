@@ -0,0 +1,365 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rewind.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "exit_code.h"
+#include "snapshot.h"
+#include "speculation.h"
+#include "spsc_queue.h"
+
+/* States waiting for the helper thread, a frame is not recorded while
+   they are all in use rather than stalling emulation */
+#define REWIND_PENDING 4
+/* Over 18 minutes at 60 frames per second */
+#define REWIND_FRAMES_MAX 65536
+/* Equal bytes that end a run of changed ones */
+#define REWIND_LITERAL_END 8
+
+struct rewind_entry {
+	size_t offset;
+	size_t size;
+};
+
+/* Each entry is the XOR of a recorded state with the one before it, as
+   runs of unchanged bytes and changed bytes. Only the newest state is
+   kept whole, applying the newest entry to it gives the state before, so
+   going back a frame costs the same however long the history is. */
+struct rewind {
+	pthread_t thread;
+	struct spsc_queue states;
+	sem_t done;
+
+	/* Owned by the emulation thread */
+	struct snapshot pending[REWIND_PENDING];
+	uint32_t pending_next;
+	uint32_t in_flight;
+
+	/* Owned by the helper thread, or the emulation thread once nothing
+	   is in flight */
+	struct snapshot newest;
+	bool has_newest;
+	uint8_t *encoded;
+
+	/* Entries are laid out in the order they are written, wrapping to the
+	   start when the next does not fit, so the oldest are the first ones
+	   at or after end */
+	uint8_t *ring;
+	size_t capacity;
+	size_t end;
+	struct rewind_entry *entries;
+	uint32_t oldest;
+	uint32_t count;
+};
+
+static void write_size(uint8_t **out, size_t size)
+{
+	while (size >= 0x80) {
+		*(*out)++ = (size & 0x7F) | 0x80;
+		size >>= 7;
+	}
+	*(*out)++ = size;
+}
+
+static size_t read_size(const uint8_t **in)
+{
+	size_t size = 0;
+	for (uint32_t shift = 0; ; shift += 7) {
+		uint8_t byte = *(*in)++;
+		size |= (size_t) (byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			return size;
+		}
+	}
+}
+
+/* Unchanged bytes are skipped eight at a time */
+static size_t skip_equal(const uint8_t *a, const uint8_t *b, size_t i)
+{
+	while (i + sizeof(uint64_t) <= CONSOLE_STATE_SIZE) {
+		uint64_t x;
+		uint64_t y;
+		memcpy(&x, a + i, sizeof(x));
+		memcpy(&y, b + i, sizeof(y));
+		if (x != y) {
+			break;
+		}
+		i += sizeof(uint64_t);
+	}
+	while (i < CONSOLE_STATE_SIZE && a[i] == b[i]) {
+		++i;
+	}
+	return i;
+}
+
+static size_t encode(uint8_t *out,
+                     const uint8_t *state,
+                     const uint8_t *previous)
+{
+	uint8_t *start = out;
+	size_t i = 0;
+	while (i < CONSOLE_STATE_SIZE) {
+		size_t changed = skip_equal(state, previous, i);
+		if (changed == CONSOLE_STATE_SIZE) {
+			break;
+		}
+		size_t literal_end = changed;
+		size_t equal = 0;
+		while (literal_end < CONSOLE_STATE_SIZE
+		       && equal < REWIND_LITERAL_END) {
+			if (state[literal_end] == previous[literal_end]) {
+				++equal;
+			}
+			else {
+				equal = 0;
+			}
+			++literal_end;
+		}
+		literal_end -= equal;
+
+		write_size(&out, changed - i);
+		write_size(&out, literal_end - changed);
+		for (size_t j = changed; j < literal_end; ++j) {
+			*out++ = state[j] ^ previous[j];
+		}
+		i = literal_end;
+	}
+	return out - start;
+}
+
+/* Applying an entry to either state gives the other */
+static void apply(uint8_t *state, const uint8_t *in, size_t size)
+{
+	const uint8_t *end = in + size;
+	size_t i = 0;
+	while (in < end) {
+		i += read_size(&in);
+		size_t literal = read_size(&in);
+		for (size_t j = 0; j < literal; ++j) {
+			state[i + j] ^= in[j];
+		}
+		in += literal;
+		i += literal;
+	}
+}
+
+static void drop_oldest(struct rewind *rewind)
+{
+	rewind->oldest = (rewind->oldest + 1) % REWIND_FRAMES_MAX;
+	--rewind->count;
+}
+
+static bool overlaps_oldest(struct rewind *rewind, size_t size)
+{
+	const struct rewind_entry *entry = &rewind->entries[rewind->oldest];
+	return entry->offset < rewind->end + size
+	       && rewind->end < entry->offset + entry->size;
+}
+
+static void record(struct rewind *rewind, const struct snapshot *snapshot)
+{
+	if (!rewind->has_newest) {
+		rewind->newest = *snapshot;
+		rewind->has_newest = true;
+		return;
+	}
+	size_t size = encode(rewind->encoded, snapshot->state,
+	                     rewind->newest.state);
+	rewind->newest = *snapshot;
+
+	/* The history before a state that cannot be stored is unreachable */
+	if (size > rewind->capacity) {
+		rewind->count = 0;
+		rewind->end = 0;
+		return;
+	}
+	if (rewind->count == REWIND_FRAMES_MAX) {
+		drop_oldest(rewind);
+	}
+	if (size > rewind->capacity - rewind->end) {
+		while (rewind->count > 0
+		       && rewind->entries[rewind->oldest].offset >= rewind->end) {
+			drop_oldest(rewind);
+		}
+		rewind->end = 0;
+	}
+	while (rewind->count > 0 && overlaps_oldest(rewind, size)) {
+		drop_oldest(rewind);
+	}
+
+	memcpy(rewind->ring + rewind->end, rewind->encoded, size);
+	struct rewind_entry *entry = &rewind->entries[
+		(rewind->oldest + rewind->count) % REWIND_FRAMES_MAX];
+	entry->offset = rewind->end;
+	entry->size = size;
+	++rewind->count;
+	rewind->end += size;
+}
+
+static void *rewind_main(void *pointer)
+{
+	struct rewind *rewind = pointer;
+	struct snapshot *snapshot;
+	while ((snapshot = spsc_queue_pop(&rewind->states)) != NULL) {
+		record(rewind, snapshot);
+		sem_post(&rewind->done);
+	}
+	return NULL;
+}
+
+static void wait_recorded(struct rewind *rewind)
+{
+	for (; rewind->in_flight > 0; --rewind->in_flight) {
+		while (sem_wait(&rewind->done) == -1) {
+			/* Interrupted by a signal */
+		}
+	}
+}
+
+static void capture(struct nes_emulator_console *console)
+{
+	struct rewind *rewind = console->rewind;
+	while (rewind->in_flight > 0 && sem_trywait(&rewind->done) == 0) {
+		--rewind->in_flight;
+	}
+	if (rewind->in_flight == REWIND_PENDING) {
+		return;
+	}
+
+	struct snapshot *snapshot = &rewind->pending[rewind->pending_next];
+	rewind->pending_next = (rewind->pending_next + 1) % REWIND_PENDING;
+	snapshot_save(console, snapshot);
+	spsc_queue_push(&rewind->states, snapshot);
+	++rewind->in_flight;
+}
+
+static bool pop(struct rewind *rewind)
+{
+	if (rewind->count == 0) {
+		return false;
+	}
+	const struct rewind_entry *entry = &rewind->entries[
+		(rewind->oldest + rewind->count - 1) % REWIND_FRAMES_MAX];
+	apply(rewind->newest.state, rewind->ring + entry->offset, entry->size);
+	rewind->end = entry->offset;
+	--rewind->count;
+	return true;
+}
+
+static bool is_rewinding(struct nes_emulator_console *console)
+{
+	for (size_t i = 0; i < PPU_BACKENDS_MAX; ++i) {
+		struct nes_emulator_ppu_backend *backend;
+		backend = console->ppu.backends[i];
+		if (backend != NULL && backend->is_rewinding != NULL
+		    && backend->is_rewinding(backend->pointer)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void rewind_frame(struct nes_emulator_console *console)
+{
+	struct rewind *rewind = console->rewind;
+	capture(console);
+	if (!is_rewinding(console)) {
+		return;
+	}
+
+	wait_recorded(rewind);
+	if (!pop(rewind) || !pop(rewind)) {
+		return;
+	}
+	if (console->speculation != NULL) {
+		speculation_cancel(console);
+	}
+	snapshot_load(console, &rewind->newest);
+}
+
+uint8_t rewind_start(struct nes_emulator_console *console, size_t capacity)
+{
+	struct rewind *rewind = malloc(sizeof(struct rewind));
+	if (rewind == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	rewind->pending_next = 0;
+	rewind->in_flight = 0;
+	rewind->has_newest = false;
+	rewind->capacity = capacity;
+	rewind->end = 0;
+	rewind->oldest = 0;
+	rewind->count = 0;
+
+	/* Runs of changed bytes are at least eight apart, so their lengths
+	   add less than the state itself */
+	rewind->encoded = malloc(2 * CONSOLE_STATE_SIZE);
+	rewind->ring = malloc(capacity);
+	rewind->entries = malloc(REWIND_FRAMES_MAX
+	                         * sizeof(struct rewind_entry));
+	if (rewind->encoded == NULL || rewind->ring == NULL
+	    || rewind->entries == NULL) {
+		free(rewind->entries);
+		free(rewind->ring);
+		free(rewind->encoded);
+		free(rewind);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+
+	uint8_t exit_code = spsc_queue_init(&rewind->states);
+	if (exit_code == 0 && sem_init(&rewind->done, 0, 0) == -1) {
+		spsc_queue_fini(&rewind->states);
+		exit_code = EXIT_CODE_OS_ERROR_BIT;
+	}
+	if (exit_code == 0
+	    && pthread_create(&rewind->thread, NULL, rewind_main, rewind) != 0) {
+		sem_destroy(&rewind->done);
+		spsc_queue_fini(&rewind->states);
+		exit_code = EXIT_CODE_OS_ERROR_BIT;
+	}
+	if (exit_code != 0) {
+		free(rewind->entries);
+		free(rewind->ring);
+		free(rewind->encoded);
+		free(rewind);
+		return exit_code;
+	}
+
+	console->rewind = rewind;
+	return 0;
+}
+
+void rewind_stop(struct nes_emulator_console *console)
+{
+	struct rewind *rewind = console->rewind;
+
+	spsc_queue_push(&rewind->states, NULL);
+	pthread_join(rewind->thread, NULL);
+
+	sem_destroy(&rewind->done);
+	spsc_queue_fini(&rewind->states);
+	free(rewind->entries);
+	free(rewind->ring);
+	free(rewind->encoded);
+	free(rewind);
+	console->rewind = NULL;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct nes_emulator_console;
+
+uint8_t rewind_start(struct nes_emulator_console *console, size_t capacity);
+void rewind_stop(struct nes_emulator_console *console);
+
+/* At the vertical blank ending a frame, records the state, then goes two
+   frames back while a backend asks to rewind, so the next frame shown is
+   the one before the last */
+void rewind_frame(struct nes_emulator_console *console);
+
+#ifdef __cpluscplus
+}
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cartridge.h"
+#include "cpu.h"
+#include "exit_code.h"
+#include "movie.h"
+#include "speculation.h"
+
+/* The file is a header, then sections of a tag, a size and their bytes,
+   in the host's byte order. ROM holds the cartridge hash, every other
+   section is one part of the state copied as the compiler lays it out, so
+   changing any of them bumps the version. Values the console could not
+   have reached are rejected, several index memory. */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_TAG_SIZE 4
+#define SNAPSHOT_HEADER_SIZE 12
+#define SNAPSHOT_SECTION_HEADER_SIZE 8
+#define SNAPSHOT_SECTIONS 5
+
+static const char MAGIC[SNAPSHOT_TAG_SIZE] = {'N', 'E', 'S', 'S'};
+static const char ROM_TAG[SNAPSHOT_TAG_SIZE] = {'R', 'O', 'M', ' '};
+
+/* Each part runs up to the start of the next */
+static const struct {
+	char tag[SNAPSHOT_TAG_SIZE];
+	size_t offset;
+} SECTIONS[SNAPSHOT_SECTIONS + 1] = {
+	{{'C', 'P', 'U', ' '}, offsetof(struct nes_emulator_console, cpu)},
+	{{'A', 'P', 'U', ' '}, offsetof(struct nes_emulator_console, apu)},
+	{{'C', 'H', 'R', ' '}, offsetof(struct nes_emulator_console, chr)},
+	{{'V', 'R', 'A', 'M'}, offsetof(struct nes_emulator_console, vram)},
+	{{'P', 'P', 'U', ' '}, offsetof(struct nes_emulator_console, ppu)},
+	{{0}, CONSOLE_STATE_SIZE},
+};
+
+/* The layout SNAPSHOT_VERSION was written with, a change to it needs a new
+   version and these updated */
+_Static_assert(offsetof(struct nes_emulator_console, apu) == 2068,
+               "the CPU section changed, bump SNAPSHOT_VERSION");
+_Static_assert(offsetof(struct nes_emulator_console, chr) == 2069,
+               "the APU section changed, bump SNAPSHOT_VERSION");
+_Static_assert(offsetof(struct nes_emulator_console, vram) == 10261,
+               "the CHR section changed, bump SNAPSHOT_VERSION");
+_Static_assert(offsetof(struct nes_emulator_console, ppu) == 12312,
+               "the VRAM section changed, bump SNAPSHOT_VERSION");
+_Static_assert(CONSOLE_STATE_SIZE == 14712,
+               "the PPU section changed, bump SNAPSHOT_VERSION");
+_Static_assert(sizeof(bool) == 1, "bools are saved as one byte");
+
+void snapshot_save(struct nes_emulator_console *console,
+                   struct snapshot *snapshot)
+{
+	memcpy(snapshot->state, console, CONSOLE_STATE_SIZE);
+}
+
+void snapshot_load(struct nes_emulator_console *console,
+                   const struct snapshot *snapshot)
+{
+	ppu_invalidate_state(console, snapshot->state);
+	memcpy(console, snapshot->state, CONSOLE_STATE_SIZE);
+}
+
+static uint8_t *write_section_header(uint8_t *data,
+                                     const char *tag,
+                                     uint32_t size)
+{
+	memcpy(data, tag, SNAPSHOT_TAG_SIZE);
+	memcpy(data + SNAPSHOT_TAG_SIZE, &size, sizeof(size));
+	return data + SNAPSHOT_SECTION_HEADER_SIZE;
+}
+
+size_t nes_emulator_console_state_size(void)
+{
+	return SNAPSHOT_HEADER_SIZE
+	       + SNAPSHOT_SECTION_HEADER_SIZE + sizeof(uint64_t)
+	       + SNAPSHOT_SECTIONS * SNAPSHOT_SECTION_HEADER_SIZE
+	       + CONSOLE_STATE_SIZE;
+}
+
+void nes_emulator_console_save_state(struct nes_emulator_console *console,
+                                     uint8_t *data)
+{
+	uint32_t version = SNAPSHOT_VERSION;
+	uint32_t sections = SNAPSHOT_SECTIONS + 1;
+	memcpy(data, MAGIC, SNAPSHOT_TAG_SIZE);
+	memcpy(data + 4, &version, sizeof(version));
+	memcpy(data + 8, &sections, sizeof(sections));
+	data += SNAPSHOT_HEADER_SIZE;
+
+	data = write_section_header(data, ROM_TAG, sizeof(uint64_t));
+	memcpy(data, &console->cartridge->hash, sizeof(uint64_t));
+	data += sizeof(uint64_t);
+
+	const uint8_t *state = (const uint8_t *) console;
+	for (size_t i = 0; i < SNAPSHOT_SECTIONS; ++i) {
+		uint32_t size = SECTIONS[i + 1].offset - SECTIONS[i].offset;
+		data = write_section_header(data, SECTIONS[i].tag, size);
+		memcpy(data, state + SECTIONS[i].offset, size);
+		data += size;
+	}
+}
+
+/* Sections may come in any order, unknown ones are skipped */
+static uint8_t read_sections(struct nes_emulator_console *console,
+                             struct snapshot *snapshot,
+                             const uint8_t *data,
+                             size_t size)
+{
+	uint32_t version;
+	uint32_t sections;
+	if (size < SNAPSHOT_HEADER_SIZE
+	    || memcmp(data, MAGIC, SNAPSHOT_TAG_SIZE) != 0) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+	memcpy(&version, data + 4, sizeof(version));
+	memcpy(&sections, data + 8, sizeof(sections));
+	if (version != SNAPSHOT_VERSION) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+
+	bool has_rom = false;
+	bool has_section[SNAPSHOT_SECTIONS] = {false};
+	size_t offset = SNAPSHOT_HEADER_SIZE;
+	for (uint32_t i = 0; i < sections; ++i) {
+		if (size - offset < SNAPSHOT_SECTION_HEADER_SIZE) {
+			return EXIT_CODE_ARG_ERROR_BIT;
+		}
+		const uint8_t *tag = data + offset;
+		uint32_t section_size;
+		memcpy(&section_size, data + offset + SNAPSHOT_TAG_SIZE,
+		       sizeof(section_size));
+		offset += SNAPSHOT_SECTION_HEADER_SIZE;
+		if (size - offset < section_size) {
+			return EXIT_CODE_ARG_ERROR_BIT;
+		}
+		const uint8_t *bytes = data + offset;
+		offset += section_size;
+
+		if (memcmp(tag, ROM_TAG, SNAPSHOT_TAG_SIZE) == 0) {
+			uint64_t hash;
+			if (section_size != sizeof(hash)) {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+			memcpy(&hash, bytes, sizeof(hash));
+			if (hash != console->cartridge->hash) {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+			has_rom = true;
+			continue;
+		}
+		for (size_t j = 0; j < SNAPSHOT_SECTIONS; ++j) {
+			if (memcmp(tag, SECTIONS[j].tag, SNAPSHOT_TAG_SIZE) != 0) {
+				continue;
+			}
+			if (section_size
+			    != SECTIONS[j + 1].offset - SECTIONS[j].offset) {
+				return EXIT_CODE_ARG_ERROR_BIT;
+			}
+			memcpy(snapshot->state + SECTIONS[j].offset, bytes,
+			       section_size);
+			has_section[j] = true;
+		}
+	}
+
+	if (!has_rom) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+	for (size_t j = 0; j < SNAPSHOT_SECTIONS; ++j) {
+		if (!has_section[j]) {
+			return EXIT_CODE_ARG_ERROR_BIT;
+		}
+	}
+	if (!cpu_is_state_valid(snapshot->state)
+	    || !ppu_is_state_valid(snapshot->state)) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+	return 0;
+}
+
+uint8_t nes_emulator_console_load_state(struct nes_emulator_console *console,
+                                        const uint8_t *data,
+                                        size_t size)
+{
+	/* A render thread's frame started from the state being replaced, a
+	   recording movie would not get back to it */
+	if (console->cartridge == NULL || console->ppu.render_thread != NULL
+	    || movie_is_recording(console)) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+
+	struct snapshot *snapshot = malloc(sizeof(struct snapshot));
+	if (snapshot == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	uint8_t exit_code = read_sections(console, snapshot, data, size);
+	if (exit_code == 0) {
+		if (console->speculation != NULL) {
+			speculation_cancel(console);
+		}
+		snapshot_load(console, snapshot);
+	}
+	free(snapshot);
+	return exit_code;
+}
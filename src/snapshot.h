@@ -0,0 +1,40 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "console.h"
+
+/* A copy of the console's emulation state */
+struct snapshot {
+	uint8_t state[CONSOLE_STATE_SIZE];
+};
+
+void snapshot_save(struct nes_emulator_console *console,
+                   struct snapshot *snapshot);
+/* Invalidates only the caches for memory that differs */
+void snapshot_load(struct nes_emulator_console *console,
+                   const struct snapshot *snapshot);
+
+#ifdef __cpluscplus
+}
+#endif
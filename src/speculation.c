@@ -0,0 +1,277 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "speculation.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "exit_code.h"
+#include "snapshot.h"
+
+/* Distinct buttons the game read recently, most recent first */
+#define SPECULATION_RECENT 8
+
+/* Each branch emulates the next frame and the frames run ahead of it on
+   its own console, as if the buttons held for all of them */
+struct speculation_branch {
+	pthread_t thread;
+	struct speculation *speculation;
+	struct nes_emulator_console *console;
+	sem_t start;
+
+	uint8_t buttons;
+	uint8_t exit_code;
+};
+
+struct speculation {
+	/* Read by every branch until they are joined */
+	struct snapshot snapshot;
+	uint8_t frames;
+
+	uint8_t branches_size;
+	struct speculation_branch *branches;
+	/* Branches started by the last fork */
+	uint8_t forked;
+	bool is_stopping;
+	sem_t done;
+
+	uint8_t recent[SPECULATION_RECENT];
+	uint8_t recent_size;
+};
+
+static void *branch_main(void *pointer)
+{
+	struct speculation_branch *branch = pointer;
+	struct speculation *speculation = branch->speculation;
+	for (;;) {
+		while (sem_wait(&branch->start) == -1) {
+			/* Interrupted by a signal */
+		}
+		if (speculation->is_stopping) {
+			break;
+		}
+		snapshot_load(branch->console, &speculation->snapshot);
+		branch->console->run_ahead_buttons = branch->buttons;
+		branch->exit_code = console_run_frames(branch->console,
+		                                       speculation->frames);
+		sem_post(&speculation->done);
+	}
+	return NULL;
+}
+
+/* The state is overwritten by the first fork */
+static uint8_t branch_init(struct speculation_branch *branch,
+                           struct nes_emulator_cartridge *cartridge)
+{
+	uint8_t exit_code = nes_emulator_console_init(&branch->console);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+	branch->console->cartridge = cartridge;
+	branch->console->ppu.is_replaying = true;
+	branch->console->is_running_ahead = true;
+	ppu_update_pages(branch->console);
+
+	if (sem_init(&branch->start, 0, 0) == -1) {
+		nes_emulator_console_fini(&branch->console);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	if (pthread_create(&branch->thread, NULL, branch_main, branch) != 0) {
+		sem_destroy(&branch->start);
+		nes_emulator_console_fini(&branch->console);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	return 0;
+}
+
+static void stop_branches(struct speculation *speculation, uint8_t size)
+{
+	speculation->is_stopping = true;
+	for (uint8_t i = 0; i < size; ++i) {
+		struct speculation_branch *branch = &speculation->branches[i];
+		sem_post(&branch->start);
+		pthread_join(branch->thread, NULL);
+		sem_destroy(&branch->start);
+		nes_emulator_console_fini(&branch->console);
+	}
+}
+
+uint8_t speculation_start(struct nes_emulator_console *console,
+                          uint8_t branches)
+{
+	struct speculation *speculation = malloc(sizeof(struct speculation));
+	if (speculation == NULL) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	speculation->branches = malloc(branches
+	                               * sizeof(struct speculation_branch));
+	if (speculation->branches == NULL) {
+		free(speculation);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	if (sem_init(&speculation->done, 0, 0) == -1) {
+		free(speculation->branches);
+		free(speculation);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	speculation->branches_size = branches;
+	speculation->forked = 0;
+	speculation->is_stopping = false;
+	speculation->recent_size = 0;
+
+	for (uint8_t i = 0; i < branches; ++i) {
+		struct speculation_branch *branch = &speculation->branches[i];
+		branch->speculation = speculation;
+		uint8_t exit_code = branch_init(branch, console->cartridge);
+		if (exit_code != 0) {
+			stop_branches(speculation, i);
+			sem_destroy(&speculation->done);
+			free(speculation->branches);
+			free(speculation);
+			return exit_code;
+		}
+	}
+
+	console->speculation = speculation;
+	return 0;
+}
+
+static void join_branches(struct speculation *speculation)
+{
+	for (uint8_t i = 0; i < speculation->forked; ++i) {
+		while (sem_wait(&speculation->done) == -1) {
+			/* Interrupted by a signal */
+		}
+	}
+}
+
+void speculation_stop(struct nes_emulator_console *console)
+{
+	struct speculation *speculation = console->speculation;
+
+	join_branches(speculation);
+	stop_branches(speculation, speculation->branches_size);
+	sem_destroy(&speculation->done);
+	free(speculation->branches);
+	free(speculation);
+	console->speculation = NULL;
+}
+
+/* The branch's frame is exactly the one serial run-ahead would produce if
+   every read this frame saw its buttons, which run-ahead then holds */
+static struct speculation_branch *find_branch(
+	struct nes_emulator_console *console)
+{
+	struct speculation *speculation = console->speculation;
+	if (console->is_frame_input_mixed
+	    || speculation->frames != console->run_ahead_frames + 1) {
+		return NULL;
+	}
+	for (uint8_t i = 0; i < speculation->forked; ++i) {
+		struct speculation_branch *branch = &speculation->branches[i];
+		if (branch->exit_code == 0
+		    && branch->buttons == console->cpu.controller_status) {
+			return branch;
+		}
+	}
+	return NULL;
+}
+
+bool speculation_join(struct nes_emulator_console *console)
+{
+	struct speculation *speculation = console->speculation;
+	if (speculation->forked == 0) {
+		return false;
+	}
+
+	uint64_t start_nsec = ppu_now_nsec();
+	join_branches(speculation);
+	struct speculation_branch *branch = find_branch(console);
+	speculation->forked = 0;
+	if (branch == NULL) {
+		return false;
+	}
+
+	memcpy(console->ppu.framebuffer, branch->console->ppu.framebuffer,
+	       sizeof(console->ppu.framebuffer));
+	console->ppu.frame_stats.render_nsec = ppu_now_nsec() - start_nsec;
+	for (uint8_t y = 0; y < PPU_VISIBLE_SCAN_LINES; ++y) {
+		ppu_deliver_scan_line(console, y);
+	}
+	ppu_deliver_frame(console);
+	return true;
+}
+
+void speculation_cancel(struct nes_emulator_console *console)
+{
+	join_branches(console->speculation);
+	console->speculation->forked = 0;
+}
+
+static void add_candidate(uint8_t *candidates, uint8_t *size, uint8_t buttons)
+{
+	for (uint8_t i = 0; i < *size; ++i) {
+		if (candidates[i] == buttons) {
+			return;
+		}
+	}
+	candidates[(*size)++] = buttons;
+}
+
+/* The buttons held now, none, then the other recent combinations */
+void speculation_fork(struct nes_emulator_console *console)
+{
+	struct speculation *speculation = console->speculation;
+	uint8_t buttons = console->cpu.controller_status;
+
+	uint8_t i = 0;
+	while (i < speculation->recent_size
+	       && speculation->recent[i] != buttons) {
+		++i;
+	}
+	if (i == SPECULATION_RECENT) {
+		--i;
+	}
+	else if (i == speculation->recent_size) {
+		++speculation->recent_size;
+	}
+	memmove(speculation->recent + 1, speculation->recent, i);
+	speculation->recent[0] = buttons;
+
+	uint8_t candidates[SPECULATION_RECENT + 1];
+	uint8_t size = 0;
+	add_candidate(candidates, &size, buttons);
+	add_candidate(candidates, &size, 0);
+	for (i = 1; i < speculation->recent_size; ++i) {
+		add_candidate(candidates, &size, speculation->recent[i]);
+	}
+	if (size > speculation->branches_size) {
+		size = speculation->branches_size;
+	}
+
+	snapshot_save(console, &speculation->snapshot);
+	speculation->frames = console->run_ahead_frames + 1;
+	for (i = 0; i < size; ++i) {
+		struct speculation_branch *branch = &speculation->branches[i];
+		branch->buttons = candidates[i];
+		sem_post(&branch->start);
+	}
+	speculation->forked = size;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SPECULATION_BRANCHES_MAX 8
+
+struct nes_emulator_console;
+
+uint8_t speculation_start(struct nes_emulator_console *console,
+                          uint8_t branches);
+void speculation_stop(struct nes_emulator_console *console);
+
+/* At the vertical blank ending a frame, waits for the branches forked at
+   the previous one and presents the branch that guessed the buttons the
+   frame read, false if none did */
+bool speculation_join(struct nes_emulator_console *console);
+/* Drops the branches, for a state they did not start from */
+void speculation_cancel(struct nes_emulator_console *console);
+/* Starts a branch for each likely input from the current state */
+void speculation_fork(struct nes_emulator_console *console);
+
+#ifdef __cpluscplus
+}
+#endif
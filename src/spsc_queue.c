@@ -0,0 +1,65 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spsc_queue.h"
+
+#include "exit_code.h"
+
+uint8_t spsc_queue_init(struct spsc_queue *queue)
+{
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+	if (sem_init(&queue->available, 0, 0) == -1) {
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+	return 0;
+}
+
+void spsc_queue_fini(struct spsc_queue *queue)
+{
+	sem_destroy(&queue->available);
+}
+
+/* Returns false if the queue is full */
+bool spsc_queue_push(struct spsc_queue *queue, void *item)
+{
+	uint_fast32_t tail = atomic_load_explicit(&queue->tail,
+	                                          memory_order_relaxed);
+	uint_fast32_t head = atomic_load_explicit(&queue->head,
+	                                          memory_order_acquire);
+	if (tail - head == SPSC_QUEUE_CAPACITY) {
+		return false;
+	}
+
+	queue->items[tail % SPSC_QUEUE_CAPACITY] = item;
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	sem_post(&queue->available);
+	return true;
+}
+
+/* Blocks until there is an item */
+void *spsc_queue_pop(struct spsc_queue *queue)
+{
+	while (sem_wait(&queue->available) == -1) {
+		/* Interrupted by a signal */
+	}
+
+	uint_fast32_t head = atomic_load_explicit(&queue->head,
+	                                          memory_order_relaxed);
+	void *item = queue->items[head % SPSC_QUEUE_CAPACITY];
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return item;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SPSC_QUEUE_CAPACITY 8 /* Must be a power of two */
+
+/* Single producer, single consumer ring of pointers. Pushing and popping
+   never take a lock, the semaphore only lets the consumer sleep while the
+   queue is empty. */
+struct spsc_queue {
+	void *items[SPSC_QUEUE_CAPACITY];
+	atomic_uint_fast32_t head; /* Next item to pop, owned by the consumer */
+	atomic_uint_fast32_t tail; /* Next item to push, owned by the producer */
+	sem_t available;
+};
+
+uint8_t spsc_queue_init(struct spsc_queue *queue);
+void spsc_queue_fini(struct spsc_queue *queue);
+
+bool spsc_queue_push(struct spsc_queue *queue, void *item);
+void *spsc_queue_pop(struct spsc_queue *queue);
+
+#ifdef __cpluscplus
+}
+#endif
@@ -0,0 +1,54 @@
+import os
+import subprocess
+
+EXECUTABLE = "build/nes-emulator-benchmark"
+ROM = "../ppu/sprite_hit_tests/01.basics.nes"
+FRAMES = "600"
+
+def check_build():
+	os.makedirs("build", exist_ok=True)
+	try:
+		subprocess.run(["cmake", "../src"], cwd="build", check=True)
+		subprocess.run(["make"], cwd="build", check=True)
+	except subprocess.CalledProcessError:
+		return False
+	return True
+
+def run(mode, workers=None):
+	args = [EXECUTABLE, ROM, FRAMES, mode]
+	if workers != None:
+		args.append(str(workers))
+	completed_process = subprocess.run(args, stdout=subprocess.PIPE)
+	if completed_process.returncode != 0:
+		return None
+	line = completed_process.stdout.decode().splitlines()[-1]
+	words = line.split()
+	return (float(words[5]), words[-1])
+
+def run_all():
+	full = run("full")
+	if full == None:
+		print("full: Process FAILED")
+		return False
+	print("full: {:.1f} frames/s".format(full[0]))
+
+	identical = True
+	for workers in range(1, os.cpu_count() + 1):
+		parallel = run("parallel", workers)
+		if parallel == None:
+			print("parallel {}: Process FAILED".format(workers))
+			return False
+		print("parallel {}: {:.1f} frames/s, {:.2f}x".format(
+			workers, parallel[0], parallel[0] / full[0]), end="")
+		if parallel[1] != full[1]:
+			print(", pixels DIFFER")
+			identical = False
+		else:
+			print()
+	return identical
+
+
+if __name__ == "__main__":
+	if check_build():
+		if run_all():
+			print("Output identical to the serial renderer")
@@ -0,0 +1,14 @@
+import subprocess
+
+from benchmark_render import check_build
+
+EXECUTABLE = "build/nes-emulator-benchmark-scale"
+LINES = "2000000"
+
+if __name__ == "__main__":
+	if check_build():
+		completed_process = subprocess.run([EXECUTABLE, LINES])
+		if completed_process.returncode == 0:
+			print("All kernels match the scalar output")
+		else:
+			print("Process FAILED")
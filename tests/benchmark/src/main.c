@@ -0,0 +1,150 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../../../src/args.h"
+#include "../../../src/exit_code.h"
+#include "../../../src/console.h"
+#include "../../../src/nes_emulator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* FNV-1a of every pixel, to check the modes render the same frames */
+static uint64_t hash = 14695981039346656037ULL;
+static long long frames_rendered = 0;
+
+static void frame_ready(void *pointer,
+                        const uint8_t *frame,
+                        const bool *is_line_changed)
+{
+	(void) pointer;
+	(void) is_line_changed;
+	for (int i = 0; i < 256 * 240; ++i) {
+		hash ^= frame[i];
+		hash *= 1099511628211ULL;
+	}
+}
+
+static void vertical_blank(void *pointer)
+{
+	(void) pointer;
+	++frames_rendered;
+}
+
+static double elapsed_seconds(struct timespec *start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec)
+	       + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Usage: nes-emulator-benchmark ROM FRAMES MODE [WORKERS] */
+int main(int argc, char **argv)
+{
+	struct memory_mapping mm;
+	uint8_t exit_code;
+
+	if (argc != 4 && argc != 5) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+
+	exit_code = init_memory_mapping_from_args(argc, argv, &mm);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+
+	long long frames = atoll(argv[2]);
+	enum nes_emulator_render_mode render_mode;
+	if (strcmp(argv[3], "full") == 0) {
+		render_mode = NES_EMULATOR_RENDER_MODE_FULL;
+	}
+	else if (strcmp(argv[3], "deferred") == 0) {
+		render_mode = NES_EMULATOR_RENDER_MODE_DEFERRED;
+	}
+	else if (strcmp(argv[3], "parallel") == 0) {
+		render_mode = NES_EMULATOR_RENDER_MODE_PARALLEL;
+	}
+	else {
+		exit_code = EXIT_CODE_ARG_ERROR_BIT;
+		exit_code |= fini_memory_mapping(&mm);
+		return exit_code;
+	}
+
+	struct nes_emulator_console *console;
+	exit_code = nes_emulator_console_init(&console);
+	if (exit_code != 0) {
+		exit_code |= fini_memory_mapping(&mm);
+		return exit_code;
+	}
+
+	struct nes_emulator_cartridge *cartridge;
+	exit_code = nes_emulator_cartridge_init(&cartridge, mm.data, mm.size);
+	if (exit_code != 0) {
+		nes_emulator_console_fini(&console);
+		exit_code |= fini_memory_mapping(&mm);
+		return exit_code;
+	}
+
+	nes_emulator_console_insert_cartridge(console, cartridge);
+
+	struct nes_emulator_ppu_backend ppu_backend = {
+		.pointer = NULL,
+		.vertical_blank = vertical_blank,
+		.frame_ready = frame_ready,
+	};
+	nes_emulator_console_add_ppu_backend(console, &ppu_backend);
+
+	if (argc == 5) {
+		nes_emulator_console_set_render_workers(console,
+		                                        atoi(argv[4]));
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	exit_code = nes_emulator_console_set_render_mode(console,
+	                                                 render_mode);
+
+	/* Frames are counted where emulation submits them, rendering may
+	   still be behind */
+	long long frames_emulated = 0;
+	bool was_vertical_blank = false;
+	while (exit_code == 0 && frames_emulated < frames) {
+		exit_code = nes_emulator_console_step(console);
+		bool is_vertical_blank = console->ppu.scan_line >= 241;
+		if (is_vertical_blank && !was_vertical_blank) {
+			++frames_emulated;
+		}
+		was_vertical_blank = is_vertical_blank;
+	}
+
+	/* Waits for the render thread to finish */
+	exit_code |= nes_emulator_console_set_render_mode(
+		console, NES_EMULATOR_RENDER_MODE_FULL);
+
+	double seconds = elapsed_seconds(&start);
+	printf("%lld frames in %.3f s, %.1f frames/s, hash %016llx\n",
+	       frames_rendered, seconds, frames_rendered / seconds,
+	       (unsigned long long) hash);
+
+	nes_emulator_cartridge_fini(&cartridge);
+	nes_emulator_console_fini(&console);
+	exit_code |= fini_memory_mapping(&mm);
+	return exit_code;
+}
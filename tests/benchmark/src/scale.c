@@ -0,0 +1,104 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../../../src/exit_code.h"
+#include "../../../src/backend/scale.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *KERNEL_NAMES[SCALE_KERNELS] = {
+	[SCALE_KERNEL_SCALAR] = "scalar",
+	[SCALE_KERNEL_SSE41] = "sse4.1",
+	[SCALE_KERNEL_AVX2] = "avx2",
+};
+
+static double elapsed_seconds(struct timespec *start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec)
+	       + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Usage: nes-emulator-benchmark-scale LINES
+
+   Times every supported kernel at every scale, checking each against the
+   scalar output */
+int main(int argc, char **argv)
+{
+	if (argc != 2) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+	long long lines = atoll(argv[1]);
+
+	uint32_t palette[64];
+	for (int i = 0; i < 64; ++i) {
+		palette[i] = 0xFF000000 | (i * 0x030507);
+	}
+	uint8_t line[256];
+	for (int x = 0; x < 256; ++x) {
+		line[x] = (x * 37) ^ (x >> 3);
+	}
+
+	size_t stride = 256 * SCALE_MAX;
+	size_t size = stride * SCALE_MAX * sizeof(uint32_t);
+	uint32_t *expected = malloc(size);
+	uint32_t *rows = malloc(size);
+	if (expected == NULL || rows == NULL) {
+		free(expected);
+		free(rows);
+		return EXIT_CODE_OS_ERROR_BIT;
+	}
+
+	bool is_identical = true;
+	for (uint8_t scale = 1; scale <= SCALE_MAX; ++scale) {
+		memset(expected, 0, size);
+		scale_line_kernel(SCALE_KERNEL_SCALAR, expected, stride,
+		                  line, palette, scale);
+		for (int k = 0; k < SCALE_KERNELS; ++k) {
+			if (!scale_kernel_is_supported(k)) {
+				continue;
+			}
+
+			memset(rows, 0, size);
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (long long i = 0; i < lines; ++i) {
+				line[i & 0xFF] ^= 0x40;
+				scale_line_kernel(k, rows, stride,
+				                  line, palette, scale);
+			}
+			double seconds = elapsed_seconds(&start);
+
+			const char *result = "identical";
+			if (memcmp(rows, expected, size) != 0) {
+				result = "DIFFERENT";
+				is_identical = false;
+			}
+			printf("scale %u %s: %.1f Mlines/s, %s\n",
+			       scale, KERNEL_NAMES[k], lines / seconds / 1e6,
+			       result);
+		}
+	}
+
+	free(expected);
+	free(rows);
+	return is_identical ? 0 : 1;
+}
@@ -0,0 +1,542 @@
+/*
+ * Copyright 2016 Jonathan Eyolfson
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "../../../src/args.h"
+#include "../../../src/exit_code.h"
+#include "../../../src/console.h"
+#include "../../../src/nes_emulator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAMES_MAX 4096
+#define STATE_FRAMES 120
+#define REWIND_BYTES 0x4000 /* 16 KiB */
+#define REWIND_FRAMES 1200
+#define REWIND_FRAMES_MIN 60
+#define RUN_AHEAD_FRAMES 300
+#define SPECULATION_RUN_AHEAD 2
+
+/* A save state starts with its 12 byte header and the ROM hash section,
+   then every section in the console's order behind an 8 byte header */
+#define STATE_ROM_HASH_OFFSET 20
+#define STATE_CPU_SIZE_OFFSET 32
+#define STATE_PPU_FIELD_OFFSET(field) \
+	(12 + 16 + 5 * 8 + offsetof(struct nes_emulator_console, ppu.field))
+
+/* A movie's header has where its index is, each entry of which has the
+   first frame and the offset of a keyframe's save state */
+#define MOVIE_INDEX_OFFSET_OFFSET 40
+#define MOVIE_INDEX_ENTRY_SIZE 16
+#define MOVIE_FRAMES 300
+#define MOVIE_KEYFRAME_INTERVAL 60
+
+static struct nes_emulator_console *console;
+
+/* FNV-1a of every frame the backend got, in order */
+static uint64_t hashes[FRAMES_MAX];
+static size_t frames_delivered = 0;
+
+/* The buttons are a function of the frame counted from input_start, so
+   running again from a state presses the same ones */
+#define INPUT_HOLD_FRAMES 8
+static uint64_t input_start = 0;
+static uint64_t input_seed = 1;
+
+static bool is_rewind_requested = false;
+
+static void frame_ready(void *pointer,
+                        const uint8_t *frame,
+                        const bool *is_line_changed)
+{
+	(void) pointer;
+	(void) is_line_changed;
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < 256 * 240; ++i) {
+		hash ^= frame[i];
+		hash *= 1099511628211ULL;
+	}
+	if (frames_delivered < FRAMES_MAX) {
+		hashes[frames_delivered] = hash;
+	}
+	++frames_delivered;
+}
+
+/* Random buttons, each held for a few frames */
+static uint8_t joypad1_read(void *pointer)
+{
+	(void) pointer;
+	uint64_t frame = nes_emulator_console_frames(console) - input_start;
+	uint64_t x = (frame / INPUT_HOLD_FRAMES + input_seed)
+	             * 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static bool is_rewinding(void *pointer)
+{
+	(void) pointer;
+	return is_rewind_requested;
+}
+
+/* Returns once a vertical blank starts, after the console recorded or
+   rewound the frame it ends */
+static uint8_t run_vertical_blank(void)
+{
+	uint32_t vertical_blanks = console->ppu.vertical_blanks;
+	uint8_t exit_code = 0;
+	while (exit_code == 0
+	       && console->ppu.vertical_blanks == vertical_blanks) {
+		exit_code = nes_emulator_console_step(console);
+	}
+	return exit_code;
+}
+
+static uint8_t run_frames(uint64_t frames)
+{
+	uint64_t end = nes_emulator_console_frames(console) + frames;
+	uint8_t exit_code = 0;
+	while (exit_code == 0 && nes_emulator_console_frames(console) < end) {
+		exit_code = nes_emulator_console_step(console);
+	}
+	return exit_code;
+}
+
+static bool is_same_frames(size_t start, size_t other_start, size_t frames)
+{
+	if (frames_delivered > FRAMES_MAX) {
+		return false;
+	}
+	return memcmp(&hashes[start], &hashes[other_start],
+	              frames * sizeof(uint64_t)) == 0;
+}
+
+/* Loads a copy of the state with bytes replaced */
+static bool is_load_rejected(const uint8_t *data,
+                             size_t size,
+                             size_t offset,
+                             const void *bytes,
+                             size_t bytes_size)
+{
+	uint8_t *copy = malloc(size);
+	if (copy == NULL) {
+		return false;
+	}
+	memcpy(copy, data, size);
+	memcpy(copy + offset, bytes, bytes_size);
+	uint8_t exit_code = nes_emulator_console_load_state(console, copy, size);
+	free(copy);
+	return exit_code == EXIT_CODE_ARG_ERROR_BIT;
+}
+
+/* Frames after loading a state match the ones after saving it, and a
+   state for another ROM, cut short, with a section of the wrong size or
+   with a value the PPU cannot hold is rejected */
+static bool test_save_state(void)
+{
+	if (run_frames(60) != 0) {
+		return false;
+	}
+	size_t size = nes_emulator_console_state_size();
+	uint8_t *data = malloc(size);
+	if (data == NULL) {
+		return false;
+	}
+	nes_emulator_console_save_state(console, data);
+
+	bool is_success = true;
+	size_t start = frames_delivered;
+	input_start = nes_emulator_console_frames(console);
+	if (run_frames(STATE_FRAMES) != 0) {
+		is_success = false;
+	}
+
+	uint8_t byte = data[STATE_ROM_HASH_OFFSET] ^ 0x01;
+	if (!is_load_rejected(data, size, STATE_ROM_HASH_OFFSET,
+	                      &byte, sizeof(byte))) {
+		printf("State for another ROM loaded\n");
+		is_success = false;
+	}
+	if (nes_emulator_console_load_state(console, data, size - 1)
+	    != EXIT_CODE_ARG_ERROR_BIT) {
+		printf("Truncated state loaded\n");
+		is_success = false;
+	}
+	uint32_t cpu_size;
+	memcpy(&cpu_size, data + STATE_CPU_SIZE_OFFSET, sizeof(cpu_size));
+	cpu_size -= 1;
+	if (!is_load_rejected(data, size, STATE_CPU_SIZE_OFFSET,
+	                      &cpu_size, sizeof(cpu_size))) {
+		printf("Section of the wrong size loaded\n");
+		is_success = false;
+	}
+	uint16_t background_address = 0xF000;
+	if (!is_load_rejected(data, size,
+	                      STATE_PPU_FIELD_OFFSET(background_address),
+	                      &background_address,
+	                      sizeof(background_address))) {
+		printf("Out of range pattern table address loaded\n");
+		is_success = false;
+	}
+
+	size_t loaded_start = frames_delivered;
+	if (nes_emulator_console_load_state(console, data, size) != 0) {
+		printf("State did not load\n");
+		is_success = false;
+	}
+	input_start = nes_emulator_console_frames(console);
+	if (run_frames(STATE_FRAMES) != 0
+	    || !is_same_frames(start, loaded_start, STATE_FRAMES)) {
+		printf("Frames after loading differ\n");
+		is_success = false;
+	}
+
+	free(data);
+	return is_success;
+}
+
+/* Records more frames than a small history holds, so it wraps, then
+   rewinds until the history runs out. Each vertical blank while rewinding
+   goes back two recorded states, which has to restore the earlier one
+   byte for byte. A recording skipped while the helper thread was behind
+   leaves a gap, so the match is the newest recorded state before it. */
+static bool test_rewind(void)
+{
+	if (nes_emulator_console_set_rewind(console, REWIND_BYTES) != 0) {
+		return false;
+	}
+	uint8_t (*states)[CONSOLE_STATE_SIZE] = malloc(REWIND_FRAMES
+	                                               * CONSOLE_STATE_SIZE);
+	if (states == NULL) {
+		return false;
+	}
+	bool is_success = true;
+	for (size_t i = 0; i < REWIND_FRAMES && is_success; ++i) {
+		is_success = run_vertical_blank() == 0;
+		memcpy(states[i], console, CONSOLE_STATE_SIZE);
+	}
+
+	is_rewind_requested = true;
+	size_t rewound = 0;
+	size_t newest = REWIND_FRAMES - 1;
+	while (is_success && newest > 0) {
+		is_success = run_vertical_blank() == 0;
+		size_t i = newest;
+		while (i > 0 && memcmp(console, states[i - 1],
+		                       CONSOLE_STATE_SIZE) != 0) {
+			--i;
+		}
+		if (i == 0) {
+			break;
+		}
+		newest = i - 1;
+		++rewound;
+	}
+	is_rewind_requested = false;
+
+	if (rewound < REWIND_FRAMES_MIN) {
+		printf("Rewound %zu frames\n", rewound);
+		is_success = false;
+	}
+	/* The history only reaches the first frames if it never wrapped */
+	if (newest == 0) {
+		printf("History did not wrap\n");
+		is_success = false;
+	}
+
+	free(states);
+	return is_success;
+}
+
+/* Running ahead shows the frame emulating serially shows that many
+   frames later, as long as the buttons held now stay held until then.
+   Only those frames are compared, and some of them have to change. They
+   start once the game has read the buttons, before that none are held. */
+static bool test_run_ahead(void)
+{
+	if (run_frames(60) != 0) {
+		return false;
+	}
+	size_t size = nes_emulator_console_state_size();
+	uint8_t *data = malloc(size);
+	if (data == NULL) {
+		return false;
+	}
+	nes_emulator_console_save_state(console, data);
+
+	size_t serial_start = frames_delivered;
+	input_start = nes_emulator_console_frames(console);
+	bool is_success = run_frames(RUN_AHEAD_FRAMES) == 0;
+	for (uint8_t frames = 1; frames <= 4 && is_success; ++frames) {
+		size_t start = frames_delivered;
+		if (nes_emulator_console_load_state(console, data, size) != 0
+		    || nes_emulator_console_set_run_ahead(console, frames) != 0) {
+			is_success = false;
+			break;
+		}
+		input_start = nes_emulator_console_frames(console);
+		is_success = run_frames(RUN_AHEAD_FRAMES) == 0
+		             && frames_delivered <= FRAMES_MAX;
+		nes_emulator_console_set_run_ahead(console, 0);
+
+		const uint64_t *serial = &hashes[serial_start + frames];
+		size_t changes = 0;
+		for (size_t i = 1; i + frames < RUN_AHEAD_FRAMES
+		                   && is_success; ++i) {
+			if (i / INPUT_HOLD_FRAMES
+			    != (i + frames) / INPUT_HOLD_FRAMES) {
+				continue;
+			}
+			if (hashes[start + i] != serial[i]) {
+				printf("Running %u frames ahead differs\n",
+				       frames);
+				is_success = false;
+			}
+			if (serial[i] != serial[i - 1]) {
+				++changes;
+			}
+		}
+		if (is_success && changes == 0) {
+			printf("Running %u frames ahead shows no change\n",
+			       frames);
+			is_success = false;
+		}
+	}
+
+	free(data);
+	return is_success;
+}
+
+/* Branches guessing the input replace running ahead only when one
+   guessed right, so every frame shown matches running ahead serially */
+static bool test_speculation(void)
+{
+	static const uint8_t BRANCHES[] = {1, 4, 8};
+
+	if (run_frames(60) != 0
+	    || nes_emulator_console_set_run_ahead(console,
+	                                          SPECULATION_RUN_AHEAD) != 0) {
+		return false;
+	}
+	size_t size = nes_emulator_console_state_size();
+	uint8_t *data = malloc(size);
+	if (data == NULL) {
+		return false;
+	}
+	nes_emulator_console_save_state(console, data);
+
+	size_t serial_start = frames_delivered;
+	input_start = nes_emulator_console_frames(console);
+	bool is_success = run_frames(RUN_AHEAD_FRAMES) == 0;
+	for (size_t i = 0; i < sizeof(BRANCHES) / sizeof(BRANCHES[0])
+	                   && is_success; ++i) {
+		size_t start = frames_delivered;
+		if (nes_emulator_console_load_state(console, data, size) != 0
+		    || nes_emulator_console_set_speculation(console,
+		                                            BRANCHES[i]) != 0) {
+			is_success = false;
+			break;
+		}
+		input_start = nes_emulator_console_frames(console);
+		is_success = run_frames(RUN_AHEAD_FRAMES) == 0;
+		nes_emulator_console_set_speculation(console, 0);
+		if (is_success && !is_same_frames(start, serial_start,
+		                                  RUN_AHEAD_FRAMES)) {
+			printf("Speculating on %u branches differs\n",
+			       BRANCHES[i]);
+			is_success = false;
+		}
+	}
+
+	free(data);
+	return is_success;
+}
+
+static uint8_t run_movie(void)
+{
+	uint8_t exit_code = 0;
+	while (exit_code == 0
+	       && nes_emulator_console_is_movie_playing(console)) {
+		exit_code = nes_emulator_console_step(console);
+	}
+	return exit_code;
+}
+
+static uint64_t read_u64(const uint8_t *data)
+{
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+/* Plays a recording with other buttons held, which the movie's replace,
+   seeks to frames on and around keyframes, and checks a keyframe the PPU
+   cannot run from is rejected without losing the movie's place */
+static bool test_movie(void)
+{
+	static const uint64_t SEEKS[] = {0, 1, 59, 60, 61, 150, 299};
+
+	if (run_frames(30) != 0 || nes_emulator_console_record_movie(
+		console, MOVIE_KEYFRAME_INTERVAL) != 0) {
+		return false;
+	}
+	size_t recorded_start = frames_delivered;
+	input_start = nes_emulator_console_frames(console);
+	uint8_t *data;
+	size_t size;
+	if (run_frames(MOVIE_FRAMES) != 0
+	    || nes_emulator_console_stop_movie(console, &data, &size) != 0) {
+		return false;
+	}
+
+	input_seed = 2;
+	size_t start = frames_delivered;
+	bool is_success = nes_emulator_console_play_movie(console, data,
+	                                                  size) == 0
+	                  && run_movie() == 0;
+	if (is_success && (frames_delivered - start != MOVIE_FRAMES
+	                   || !is_same_frames(start, recorded_start,
+	                                      MOVIE_FRAMES))) {
+		printf("Playing differs from recording\n");
+		is_success = false;
+	}
+
+	for (size_t i = 0; i < sizeof(SEEKS) / sizeof(SEEKS[0])
+	                   && is_success; ++i) {
+		uint64_t frame = SEEKS[i];
+		start = frames_delivered;
+		is_success = nes_emulator_console_play_movie(console, data,
+		                                             size) == 0
+		             && nes_emulator_console_seek_movie(console,
+		                                                frame) == 0
+		             && run_movie() == 0;
+		if (is_success && !is_same_frames(start, recorded_start + frame,
+		                                  MOVIE_FRAMES - frame)) {
+			printf("Seeking to frame %llu differs\n",
+			       (unsigned long long) frame);
+			is_success = false;
+		}
+	}
+
+	uint8_t *corrupt = malloc(size);
+	if (corrupt == NULL) {
+		free(data);
+		return false;
+	}
+	memcpy(corrupt, data, size);
+	const uint8_t *entry = data + read_u64(data + MOVIE_INDEX_OFFSET_OFFSET)
+	                       + MOVIE_INDEX_ENTRY_SIZE;
+	uint64_t keyframe = read_u64(entry);
+	uint16_t background_address = 0xF000;
+	memcpy(corrupt + read_u64(entry + sizeof(uint64_t))
+	       + STATE_PPU_FIELD_OFFSET(background_address),
+	       &background_address, sizeof(background_address));
+	if (is_success
+	    && (nes_emulator_console_play_movie(console, corrupt, size) != 0
+	        || nes_emulator_console_seek_movie(console, keyframe)
+	           != EXIT_CODE_ARG_ERROR_BIT)) {
+		printf("Corrupt keyframe loaded\n");
+		is_success = false;
+	}
+	start = frames_delivered;
+	if (is_success && (run_movie() != 0
+	                   || !is_same_frames(start, recorded_start,
+	                                      MOVIE_FRAMES))) {
+		printf("Playing after a rejected seek differs\n");
+		is_success = false;
+	}
+
+	nes_emulator_console_stop_movie(console, NULL, NULL);
+	free(corrupt);
+	free(data);
+	return is_success;
+}
+
+static const struct {
+	const char *name;
+	bool (*run)(void);
+} TESTS[] = {
+	{"save-state", test_save_state},
+	{"rewind", test_rewind},
+	{"run-ahead", test_run_ahead},
+	{"speculation", test_speculation},
+	{"movie", test_movie},
+};
+
+/* Usage: nes-emulator-state ROM TEST */
+int main(int argc, char **argv)
+{
+	struct memory_mapping mm;
+	uint8_t exit_code;
+
+	if (argc != 3) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+
+	bool (*run)(void) = NULL;
+	for (size_t i = 0; i < sizeof(TESTS) / sizeof(TESTS[0]); ++i) {
+		if (strcmp(argv[2], TESTS[i].name) == 0) {
+			run = TESTS[i].run;
+		}
+	}
+	if (run == NULL) {
+		return EXIT_CODE_ARG_ERROR_BIT;
+	}
+
+	exit_code = init_memory_mapping_from_args(argc, argv, &mm);
+	if (exit_code != 0) {
+		return exit_code;
+	}
+
+	exit_code = nes_emulator_console_init(&console);
+	if (exit_code != 0) {
+		exit_code |= fini_memory_mapping(&mm);
+		return exit_code;
+	}
+
+	struct nes_emulator_cartridge *cartridge;
+	exit_code = nes_emulator_cartridge_init(&cartridge, mm.data, mm.size);
+	if (exit_code != 0) {
+		nes_emulator_console_fini(&console);
+		exit_code |= fini_memory_mapping(&mm);
+		return exit_code;
+	}
+
+	nes_emulator_console_insert_cartridge(console, cartridge);
+
+	struct nes_emulator_ppu_backend ppu_backend = {
+		.pointer = NULL,
+		.joypad1_read = joypad1_read,
+		.frame_ready = frame_ready,
+		.is_rewinding = is_rewinding,
+	};
+	nes_emulator_console_add_ppu_backend(console, &ppu_backend);
+
+	if (run()) {
+		printf("Test SUCCESS\n");
+	}
+	else {
+		printf("Test FAILURE\n");
+	}
+
+	nes_emulator_cartridge_fini(&cartridge);
+	nes_emulator_console_fini(&console);
+	exit_code |= fini_memory_mapping(&mm);
+	return exit_code;
+}
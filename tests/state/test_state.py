@@ -0,0 +1,36 @@
+import os
+import subprocess
+
+EXECUTABLE = "build/nes-emulator-state"
+ROM = "../nestest/nestest.nes"
+TESTS = ["save-state", "rewind", "run-ahead", "speculation", "movie"]
+
+def check_build():
+	os.makedirs("build", exist_ok=True)
+	try:
+		subprocess.run(["cmake", "../src"], cwd="build", check=True)
+		subprocess.run(["make"], cwd="build", check=True)
+	except subprocess.CalledProcessError:
+		return False
+	return True
+
+def run_tests():
+	tests_passed = 0
+	for test in TESTS:
+		print(test, ": ", sep="", end="")
+		completed_process = subprocess.run([EXECUTABLE, ROM, test],
+		                                   stdout=subprocess.PIPE)
+		if completed_process.returncode != 0:
+			print("Process FAILED")
+			continue
+		lines = completed_process.stdout.splitlines()
+		last_line = lines[-1].decode()
+		if last_line == "Test SUCCESS":
+			tests_passed += 1
+		print(last_line)
+	print("{}/{} tests passed".format(tests_passed, len(TESTS)))
+
+
+if __name__ == "__main__":
+	if check_build():
+		run_tests()